@@ -0,0 +1,79 @@
+//! With the `embedded-vocab` feature, compiles the snapshot named by `HARMONY_EMBEDDED_SNAPSHOT`
+//! into the crate, so that loading the encoding it holds needs no file, download or hashing.
+//! Write the snapshot with the same version of the crate:
+//!
+//! ```sh
+//! cargo run --release --example write_snapshot -- o200k_harmony /path/to/o200k_harmony.bin
+//! HARMONY_EMBEDDED_SNAPSHOT=/path/to/o200k_harmony.bin cargo build --release --features embedded-vocab
+//! ```
+
+use std::io::Read as _;
+use std::path::Path;
+
+include!("src/snapshot_format.rs");
+
+const SNAPSHOT_VAR: &str = "HARMONY_EMBEDDED_SNAPSHOT";
+
+fn main() {
+    println!("cargo:rustc-check-cfg=cfg(harmony_embedded_snapshot)");
+    println!("cargo:rerun-if-env-changed={SNAPSHOT_VAR}");
+    if std::env::var_os("CARGO_FEATURE_EMBEDDED_VOCAB").is_none() {
+        return;
+    }
+    let Some(path) = std::env::var_os(SNAPSHOT_VAR) else {
+        // Builds with `--all-features` have no snapshot to embed; they load encodings as usual.
+        println!(
+            "cargo:warning=the embedded-vocab feature is enabled but {SNAPSHOT_VAR} is not set, \
+             so no vocabulary is embedded"
+        );
+        return;
+    };
+    let path = Path::new(&path)
+        .canonicalize()
+        .unwrap_or_else(|e| panic!("{SNAPSHOT_VAR}={path:?}: {e}"));
+    let path = path
+        .to_str()
+        .unwrap_or_else(|| panic!("{SNAPSHOT_VAR}={path:?}: the path must be valid UTF-8"));
+    println!("cargo:rerun-if-changed={path}");
+    check_header(path);
+    println!("cargo:rustc-env=HARMONY_EMBEDDED_SNAPSHOT_PATH={path}");
+    println!("cargo:rustc-cfg=harmony_embedded_snapshot");
+}
+
+/// Fail the build if the crate could not read the snapshot at `path`, rather than build a binary
+/// that quietly falls back to loading the vocabulary at run time. Which encoding the snapshot
+/// holds is checked when it is loaded.
+fn check_header(path: &str) {
+    let mut header = [0u8; 16];
+    std::fs::File::open(path)
+        .and_then(|mut file| file.read_exact(&mut header))
+        .unwrap_or_else(|e| panic!("{SNAPSHOT_VAR}={path}: {e}"));
+    // Snapshots are in the byte order of the machine that reads them: the target.
+    let big_endian = std::env::var("CARGO_CFG_TARGET_ENDIAN").as_deref() == Ok("big");
+    let target_bytes = |value: u32| {
+        if big_endian {
+            value.to_be_bytes()
+        } else {
+            value.to_le_bytes()
+        }
+    };
+    if &header[..8] != MAGIC {
+        panic!("{SNAPSHOT_VAR}={path}: not a snapshot written by the write_snapshot example");
+    }
+    if header[12..16] != target_bytes(BYTE_ORDER_MARK) {
+        panic!("{SNAPSHOT_VAR}={path}: the snapshot was written for another byte order");
+    }
+    if header[8..12] != target_bytes(FORMAT_VERSION) {
+        let version: [u8; 4] = header[8..12].try_into().unwrap();
+        let version = if big_endian {
+            u32::from_be_bytes(version)
+        } else {
+            u32::from_le_bytes(version)
+        };
+        panic!(
+            "{SNAPSHOT_VAR}={path}: the snapshot has format version {version}, but this version \
+             of the crate reads version {FORMAT_VERSION}; write it again with the write_snapshot \
+             example"
+        );
+    }
+}
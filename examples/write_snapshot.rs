@@ -0,0 +1,17 @@
+//! Writes a snapshot of an encoding for the `embedded-vocab` feature to compile into the crate.
+//!
+//! Usage: `cargo run --release --example write_snapshot -- <encoding name> <output path>`
+
+use openai_harmony::tiktoken_ext::Encoding;
+
+fn main() -> Result<(), Box<dyn std::error::Error>> {
+    let mut args = std::env::args().skip(1);
+    let (Some(name), Some(path)) = (args.next(), args.next()) else {
+        return Err("usage: write_snapshot <encoding name> <output path>".into());
+    };
+    Encoding::from_name(&name)
+        .ok_or_else(|| format!("unknown encoding name: {name}"))?
+        .write_snapshot(&path)?;
+    println!("wrote {name} to {path}");
+    Ok(())
+}
@@ -13,6 +13,7 @@ from __future__ import annotations
 
 import functools
 import json
+from dataclasses import dataclass
 from enum import Enum
 from typing import (
     AbstractSet,
@@ -38,12 +39,18 @@ try:
         HarmonyError as HarmonyError,  # expose the actual Rust error directly
     )
     from .openai_harmony import PyHarmonyEncoding as _PyHarmonyEncoding  # type: ignore
+    from .openai_harmony import (
+        PyParserCheckpoint as ParserCheckpoint,  # type: ignore
+    )
     from .openai_harmony import (
         PyStreamableParser as _PyStreamableParser,  # type: ignore
     )
     from .openai_harmony import (
         load_harmony_encoding as _load_harmony_encoding,  # type: ignore
     )
+    from .openai_harmony import (
+        warm_up as _warm_up,  # type: ignore
+    )
 
 except ModuleNotFoundError:  # pragma: no cover – raised during type-checking
     # When running *mypy* without the compiled extension in place we still want
@@ -59,8 +66,10 @@ except ModuleNotFoundError:  # pragma: no cover – raised during type-checking
             )
 
     _load_harmony_encoding = _Stub()  # type: ignore
+    _warm_up = _Stub()  # type: ignore
     _PyHarmonyEncoding = _Stub()  # type: ignore
     _PyStreamableParser = _Stub()  # type: ignore
+    ParserCheckpoint = _Stub()  # type: ignore
     _HarmonyError = RuntimeError
 
 
@@ -69,6 +78,11 @@ def _special_token_regex(tokens: frozenset[str]) -> Pattern[str]:
     return re.compile(f"({inner})")
 
 
+def _replace_surrogates(text: str) -> str:
+    """Replace lone surrogates, which cannot be encoded as UTF-8, with U+FFFD."""
+    return text.encode("utf-16", "surrogatepass").decode("utf-16", "replace")
+
+
 def raise_disallowed_special_token(token: str) -> None:
     raise HarmonyError(
         "Encountered text corresponding to disallowed special token "
@@ -571,6 +585,52 @@ class HarmonyEncoding:
         [27, 91, 437, 1659, 5239, 91, 29]
         ```
         """
+        allowed = self._check_special([text], allowed_special, disallowed_special)
+        try:
+            return self._inner.encode(text, allowed)
+        except UnicodeEncodeError:
+            text = _replace_surrogates(text)
+            return self._inner.encode(text, allowed)
+
+    def encode_batch(
+        self,
+        texts: Sequence[str],
+        *,
+        allowed_special: Literal["all"] | AbstractSet[str] = set(),
+        disallowed_special: Literal["all"] | Collection[str] = "all",
+    ) -> list[list[int]]:
+        """Encodes many strings into tokens in parallel.
+
+        The special token handling is the same as for :meth:`encode`. The strings are encoded
+        on a pool of native threads with the GIL released, and the results are returned in the
+        order of ``texts``.
+        """
+        allowed = self._check_special(texts, allowed_special, disallowed_special)
+        try:
+            return self._inner.encode_batch(list(texts), allowed)
+        except UnicodeEncodeError:
+            return self._inner.encode_batch(
+                [_replace_surrogates(text) for text in texts], allowed
+            )
+
+    def encode_ordinary_batch(self, texts: Sequence[str]) -> list[list[int]]:
+        """Encodes many strings into tokens in parallel, treating text that corresponds to
+        special tokens as ordinary text. The results are in the order of ``texts``.
+        """
+        try:
+            return self._inner.encode_ordinary_batch(list(texts))
+        except UnicodeEncodeError:
+            return self._inner.encode_ordinary_batch(
+                [_replace_surrogates(text) for text in texts]
+            )
+
+    def _check_special(
+        self,
+        texts: Sequence[str],
+        allowed_special: Literal["all"] | AbstractSet[str],
+        disallowed_special: Literal["all"] | Collection[str],
+    ) -> List[str]:
+        """Raise if any text contains a disallowed special token; return the allowed ones."""
         if allowed_special == "all":
             allowed_special = self.special_tokens_set
         if disallowed_special == "all":
@@ -578,14 +638,11 @@ class HarmonyEncoding:
         if disallowed_special:
             if not isinstance(disallowed_special, frozenset):
                 disallowed_special = frozenset(disallowed_special)
-            if match := _special_token_regex(disallowed_special).search(text):
-                raise_disallowed_special_token(match.group())
-
-        try:
-            return self._inner.encode(text, list(allowed_special))
-        except UnicodeEncodeError:
-            text = text.encode("utf-16", "surrogatepass").decode("utf-16", "replace")
-            return self._inner.encode(text, list(allowed_special))
+            regex = _special_token_regex(disallowed_special)
+            for text in texts:
+                if match := regex.search(text):
+                    raise_disallowed_special_token(match.group())
+        return list(allowed_special)
 
     def decode(self, tokens: Sequence[int], errors: str = "replace") -> str:
         """Decodes a list of tokens into a string.
@@ -620,6 +677,65 @@ class StreamState(Enum):
     CONTENT = "Content"
 
 
+class StateTransition(BaseModel):
+    """A state change observed by :meth:`StreamableParser.process_many`."""
+
+    token_index: int
+    delta_offset: int
+    state: StreamState
+
+
+class ProcessSummary(BaseModel):
+    """What happened while processing a batch of tokens."""
+
+    content_delta: str = ""
+    state_transitions: List[StateTransition] = Field(default_factory=list)
+    messages_completed: int = 0
+
+
+@dataclass(frozen=True)
+class MessageStart:
+    """A new message has started; emitted once its header has been parsed."""
+
+    role: Role
+    name: Optional[str] = None
+
+
+@dataclass(frozen=True)
+class HeaderComplete:
+    """The header of the current message has been parsed."""
+
+    channel: Optional[str] = None
+    recipient: Optional[str] = None
+    content_type: Optional[str] = None
+
+
+@dataclass(frozen=True)
+class ContentDelta:
+    """Text appended to the content of the current message."""
+
+    text: str
+
+
+@dataclass(frozen=True)
+class MessageEnd:
+    """The current message is complete."""
+
+
+ParserEvent = Union[MessageStart, HeaderComplete, ContentDelta, MessageEnd]
+
+
+def _parser_event(raw: tuple) -> ParserEvent:
+    kind = raw[0]
+    if kind == "message_start":
+        return MessageStart(Role(raw[1]), raw[2])
+    if kind == "header_complete":
+        return HeaderComplete(raw[1], raw[2], raw[3])
+    if kind == "content_delta":
+        return ContentDelta(raw[1])
+    return MessageEnd()
+
+
 class StreamableParser:
     """Incremental parser over completion tokens."""
 
@@ -637,6 +753,52 @@ class StreamableParser:
         self._inner.process(token)
         return self
 
+    def process_many(self, tokens: Sequence[int]) -> ProcessSummary:
+        """Process several tokens in one call and summarise the changes."""
+        raw = self._inner.process_many(list(tokens))
+        return ProcessSummary.model_validate_json(raw)
+
+    def process_events(self, tokens: Union[int, Sequence[int]]) -> List[ParserEvent]:
+        """Process one or more tokens and return what happened as typed events.
+
+        Every message yields a :class:`MessageStart` and a
+        :class:`HeaderComplete`, then any number of :class:`ContentDelta` and
+        finally a :class:`MessageEnd`, so callers can react to changes without
+        polling the parser state after every token.
+        """
+        if isinstance(tokens, int):
+            tokens = [tokens]
+        return [_parser_event(raw) for raw in self._inner.process_events(list(tokens))]
+
+    def process_eos_events(self) -> List[ParserEvent]:
+        """Like :meth:`process_eos`, but return the resulting events."""
+        return [_parser_event(raw) for raw in self._inner.process_eos_events()]
+
+    def fork(self) -> "StreamableParser":
+        """Return a parser that continues independently from the current position.
+
+        The already parsed tokens and messages are shared with the new parser
+        instead of being copied, which keeps forking cheap for beam search or
+        when sampling several completions from one prefix.
+        """
+        forked = StreamableParser.__new__(StreamableParser)
+        forked._inner = self._inner.fork()
+        return forked
+
+    def checkpoint(self) -> ParserCheckpoint:
+        """Record the current position so that :meth:`rollback` can return to it."""
+        return self._inner.checkpoint()
+
+    def rollback(self, checkpoint: ParserCheckpoint) -> "StreamableParser":
+        """Undo all tokens processed since *checkpoint* was taken.
+
+        This is cheap: the cost is proportional to the number of tokens rolled
+        back, which makes it suitable for discarding rejected draft tokens in
+        speculative decoding.
+        """
+        self._inner.rollback(checkpoint)
+        return self
+
     def process_eos(self) -> "StreamableParser":
         self._inner.process_eos()
         return self
@@ -690,7 +852,11 @@ class StreamableParser:
 
 
 def load_harmony_encoding(name: str | "HarmonyEncodingName") -> HarmonyEncoding:  # type: ignore[name-defined]
-    """Load an encoding by *name* (delegates to the Rust implementation)."""
+    """Load an encoding by *name* (delegates to the Rust implementation).
+
+    Each encoding is loaded once per process; later calls, from any thread,
+    share it.
+    """
 
     # Allow both strings and enum values.
     if not isinstance(name, str):
@@ -700,6 +866,13 @@ def load_harmony_encoding(name: str | "HarmonyEncodingName") -> HarmonyEncoding:
     return HarmonyEncoding(inner)
 
 
+def warm_up() -> None:
+    """Load every encoding now, e.g. while a server boots or before it forks
+    its workers, so that no request pays for the first load."""
+
+    _warm_up()
+
+
 # For *mypy* we expose a minimal stub of the `HarmonyEncodingName` enum.  At
 # **runtime** the user is expected to pass the *string* names because the Rust
 # side only operates on strings anyway.
@@ -726,7 +899,16 @@ __all__ = [
     "HarmonyEncoding",
     "HarmonyEncodingName",
     "load_harmony_encoding",
+    "warm_up",
     "StreamableParser",
     "StreamState",
+    "StateTransition",
+    "ProcessSummary",
+    "ParserCheckpoint",
+    "ParserEvent",
+    "MessageStart",
+    "HeaderComplete",
+    "ContentDelta",
+    "MessageEnd",
     "HarmonyError",
 ]
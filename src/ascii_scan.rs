@@ -0,0 +1,189 @@
+//! Vectorized scanning of runs of ASCII characters, used by the pre-tokenizer.
+//!
+//! On x86_64 the scanner classifies 32 bytes at a time with AVX2 when the CPU supports it
+//! (checked once at runtime) and 16 bytes at a time with SSE2 otherwise. Other targets use
+//! the scalar loop.
+
+/// Sets of ASCII characters that the scanner can skip over. They agree with the character
+/// classes of the o200k pattern restricted to ASCII.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub(crate) enum AsciiClass {
+    /// `A-Z`
+    Upper,
+    /// `a-z`
+    Lower,
+    /// `\t`, `\n`, `\x0B`, `\x0C`, `\r` and space.
+    Space,
+    /// Everything that is not a letter, a digit or a space.
+    Other,
+}
+
+impl AsciiClass {
+    #[inline]
+    pub(crate) fn contains(self, byte: u8) -> bool {
+        match self {
+            Self::Upper => byte.is_ascii_uppercase(),
+            Self::Lower => byte.is_ascii_lowercase(),
+            Self::Space => matches!(byte, b'\t'..=b'\r' | b' '),
+            Self::Other => {
+                byte.is_ascii() && !byte.is_ascii_alphanumeric() && !Self::Space.contains(byte)
+            }
+        }
+    }
+}
+
+/// The end of the run of bytes in `class` that starts at `pos`. Non-ASCII bytes are never
+/// in a class, so the run also ends at the first byte of a non-ASCII character.
+#[inline]
+pub(crate) fn run_end(bytes: &[u8], pos: usize, class: AsciiClass) -> usize {
+    // Most runs are short words; only pay for the vector setup when the run is long.
+    let short_end = bytes.len().min(pos + 8);
+    let mut end = pos;
+    while end < short_end {
+        if !class.contains(bytes[end]) {
+            return end;
+        }
+        end += 1;
+    }
+    if end == bytes.len() {
+        return end;
+    }
+    run_end_vectorized(bytes, end, class)
+}
+
+#[cfg(target_arch = "x86_64")]
+fn run_end_vectorized(bytes: &[u8], pos: usize, class: AsciiClass) -> usize {
+    use std::sync::atomic::{AtomicU8, Ordering};
+
+    // 0: not checked yet, 1: SSE2 only, 2: AVX2.
+    static LEVEL: AtomicU8 = AtomicU8::new(0);
+    let mut level = LEVEL.load(Ordering::Relaxed);
+    if level == 0 {
+        level = if is_x86_feature_detected!("avx2") {
+            2
+        } else {
+            1
+        };
+        LEVEL.store(level, Ordering::Relaxed);
+    }
+    if level == 2 {
+        // SAFETY: the CPU supports AVX2.
+        unsafe { x86::run_end_avx2(bytes, pos, class) }
+    } else {
+        x86::run_end_sse2(bytes, pos, class)
+    }
+}
+
+#[cfg(not(target_arch = "x86_64"))]
+fn run_end_vectorized(bytes: &[u8], pos: usize, class: AsciiClass) -> usize {
+    run_end_scalar(bytes, pos, class)
+}
+
+pub(crate) fn run_end_scalar(bytes: &[u8], pos: usize, class: AsciiClass) -> usize {
+    bytes[pos..]
+        .iter()
+        .position(|&byte| !class.contains(byte))
+        .map_or(bytes.len(), |len| pos + len)
+}
+
+#[cfg(target_arch = "x86_64")]
+pub(crate) mod x86 {
+    use super::{run_end_scalar, AsciiClass};
+    use std::arch::x86_64::*;
+
+    // Each byte lane of the result is all ones if the byte is in `class`. The comparisons are
+    // signed, so bytes of non-ASCII characters (>= 0x80) are negative and fall outside every
+    // range. This is a macro rather than a closure so that the intrinsics are inlined into the
+    // `target_feature` function that uses it.
+    macro_rules! class_mask {
+        ($chunk:expr, $class:expr, $set1:ident, $gt:ident, $lt:ident, $eq:ident, $and:ident, $or:ident, $andnot:ident) => {{
+            let chunk = $chunk;
+            macro_rules! in_range {
+                ($lo:expr, $hi:expr) => {
+                    $and(
+                        $gt(chunk, $set1($lo as i8 - 1)),
+                        $lt(chunk, $set1($hi as i8 + 1)),
+                    )
+                };
+            }
+            macro_rules! space {
+                () => {
+                    $or(in_range!(b'\t', b'\r'), $eq(chunk, $set1(b' ' as i8)))
+                };
+            }
+            match $class {
+                AsciiClass::Upper => in_range!(b'A', b'Z'),
+                AsciiClass::Lower => in_range!(b'a', b'z'),
+                AsciiClass::Space => space!(),
+                AsciiClass::Other => {
+                    let ascii = $gt(chunk, $set1(-1));
+                    let word = $or(
+                        $or(in_range!(b'A', b'Z'), in_range!(b'a', b'z')),
+                        $or(in_range!(b'0', b'9'), space!()),
+                    );
+                    $andnot(word, ascii)
+                }
+            }
+        }};
+    }
+
+    pub(crate) fn run_end_sse2(bytes: &[u8], mut pos: usize, class: AsciiClass) -> usize {
+        while pos + 16 <= bytes.len() {
+            // SAFETY: SSE2 is part of the x86_64 baseline and the load reads the 16 bytes
+            // at `pos`, which are in bounds.
+            let mask = unsafe {
+                let chunk = _mm_loadu_si128(bytes.as_ptr().add(pos) as *const __m128i);
+                let lanes = class_mask!(
+                    chunk,
+                    class,
+                    _mm_set1_epi8,
+                    _mm_cmpgt_epi8,
+                    _mm_cmplt_epi8,
+                    _mm_cmpeq_epi8,
+                    _mm_and_si128,
+                    _mm_or_si128,
+                    _mm_andnot_si128
+                );
+                _mm_movemask_epi8(lanes) as u32
+            };
+            if mask != 0xFFFF {
+                return pos + (!mask).trailing_zeros() as usize;
+            }
+            pos += 16;
+        }
+        run_end_scalar(bytes, pos, class)
+    }
+
+    /// # Safety
+    ///
+    /// The CPU must support AVX2.
+    #[target_feature(enable = "avx2")]
+    pub(crate) unsafe fn run_end_avx2(bytes: &[u8], mut pos: usize, class: AsciiClass) -> usize {
+        // AVX2 has no signed less-than; `a < b` is `b > a`.
+        #[inline]
+        #[target_feature(enable = "avx2")]
+        unsafe fn lt(a: __m256i, b: __m256i) -> __m256i {
+            _mm256_cmpgt_epi8(b, a)
+        }
+        while pos + 32 <= bytes.len() {
+            let chunk = _mm256_loadu_si256(bytes.as_ptr().add(pos) as *const __m256i);
+            let lanes = class_mask!(
+                chunk,
+                class,
+                _mm256_set1_epi8,
+                _mm256_cmpgt_epi8,
+                lt,
+                _mm256_cmpeq_epi8,
+                _mm256_and_si256,
+                _mm256_or_si256,
+                _mm256_andnot_si256
+            );
+            let mask = _mm256_movemask_epi8(lanes) as u32;
+            if mask != u32::MAX {
+                return pos + (!mask).trailing_zeros() as usize;
+            }
+            pos += 32;
+        }
+        run_end_sse2(bytes, pos, class)
+    }
+}
@@ -1,6 +1,7 @@
 use crate::{
     chat::{Author, Content, Message, ReasoningEffort, Role, SystemContent, TextContent},
-    tiktoken::{CoreBPE, Rank},
+    forkable_vec::{ForkableVec, HistoryView},
+    tiktoken::{CoreBPE, Rank, SpecialPolicy},
 };
 use anyhow::Context as _;
 use std::{
@@ -55,6 +56,21 @@ pub(crate) enum FormattingToken {
 }
 
 impl FormattingToken {
+    pub(crate) const ALL: [FormattingToken; 12] = [
+        FormattingToken::Start,
+        FormattingToken::Message,
+        FormattingToken::EndMessage,
+        FormattingToken::EndMessageDoneSampling,
+        FormattingToken::EndMessageAssistantToTool,
+        FormattingToken::Refusal,
+        FormattingToken::ConstrainedFormat,
+        FormattingToken::Channel,
+        FormattingToken::BeginUntrusted,
+        FormattingToken::EndUntrusted,
+        FormattingToken::MetaSep,
+        FormattingToken::MetaEnd,
+    ];
+
     fn as_str(&self) -> &str {
         match self {
             FormattingToken::Start => "<|start|>",
@@ -79,9 +95,119 @@ impl std::fmt::Display for FormattingToken {
     }
 }
 
-#[allow(dead_code)]
+#[derive(Clone, Debug)]
+enum ResolvedFormattingToken {
+    Unmapped,
+    Rank(Rank),
+    InvalidEncoding(Vec<Rank>),
+}
+
+/// Dense `FormattingToken -> Rank` table.
+///
+/// Resolving a formatting token through the tokenizer means running the special
+/// token regex over its mapped string, which is far too slow for the per-token
+/// paths in [`StreamableParser`]. The table is therefore built once when the
+/// encoding is loaded and indexed by `FormattingToken as usize` afterwards.
+#[derive(Clone, Debug)]
+pub(crate) struct FormattingTokenTable {
+    entries: [ResolvedFormattingToken; FormattingToken::ALL.len()],
+}
+
+impl FormattingTokenTable {
+    pub(crate) fn new(tokenizer: &CoreBPE, mapping: &HashMap<FormattingToken, String>) -> Self {
+        let entries = FormattingToken::ALL.map(|t| match mapping.get(&t) {
+            None => ResolvedFormattingToken::Unmapped,
+            Some(mapped) => {
+                let encoded = tokenizer.encode_with_special_tokens(mapped);
+                if encoded.len() == 1 {
+                    ResolvedFormattingToken::Rank(encoded[0])
+                } else {
+                    ResolvedFormattingToken::InvalidEncoding(encoded)
+                }
+            }
+        });
+        Self { entries }
+    }
+
+    #[inline]
+    pub(crate) fn get(&self, t: FormattingToken) -> Result<Rank, RenderFormattingTokenError> {
+        match &self.entries[t as usize] {
+            ResolvedFormattingToken::Rank(rank) => Ok(*rank),
+            ResolvedFormattingToken::Unmapped => Err(RenderFormattingTokenError::UnmappedToken(t)),
+            ResolvedFormattingToken::InvalidEncoding(encoding) => {
+                Err(RenderFormattingTokenError::InvalidEncoding {
+                    token: t,
+                    encoding: encoding.clone(),
+                })
+            }
+        }
+    }
+
+    /// Resolve a set of stop formatting tokens to their ranks.
+    pub(crate) fn resolve_stop_tokens<I>(&self, tokens: I) -> anyhow::Result<RankSet>
+    where
+        I: IntoIterator<Item = FormattingToken>,
+    {
+        tokens
+            .into_iter()
+            .map(|t| match self.get(t) {
+                Ok(t) => Ok(t),
+                Err(RenderFormattingTokenError::UnmappedToken(_)) => Err(anyhow::anyhow!(
+                    "token {t} was specified as a stop token, but is not mapped"
+                )),
+                Err(e) => Err(anyhow::anyhow!(e).context("could not render stop token")),
+            })
+            .collect()
+    }
+}
+
+/// A small set of token ranks, such as the stop tokens of an encoding.
+///
+/// These sets only ever hold a handful of entries, so a linear scan over a
+/// sorted slice is cheaper than hashing on the per-token hot path.
+#[derive(Clone, Debug, Default, PartialEq, Eq)]
+pub(crate) struct RankSet(Box<[Rank]>);
+
+impl RankSet {
+    #[inline]
+    pub(crate) fn contains(&self, rank: Rank) -> bool {
+        self.0.contains(&rank)
+    }
+
+    pub(crate) fn iter(&self) -> impl Iterator<Item = Rank> + '_ {
+        self.0.iter().copied()
+    }
+}
+
+impl FromIterator<Rank> for RankSet {
+    fn from_iter<I: IntoIterator<Item = Rank>>(iter: I) -> Self {
+        let mut ranks: Vec<Rank> = iter.into_iter().collect();
+        ranks.sort_unstable();
+        ranks.dedup();
+        Self(ranks.into_boxed_slice())
+    }
+}
+
+/// A harmony encoding: a tokenizer plus the formatting tokens and limits
+/// used to render and parse conversations.
+///
+/// All data lives behind a single [`Arc`], so cloning an encoding, e.g. to
+/// construct a [`StreamableParser`], only bumps a reference count.
 #[derive(Clone)]
 pub struct HarmonyEncoding {
+    pub(crate) inner: Arc<HarmonyEncodingInner>,
+}
+
+impl From<HarmonyEncodingInner> for HarmonyEncoding {
+    fn from(inner: HarmonyEncodingInner) -> Self {
+        Self {
+            inner: Arc::new(inner),
+        }
+    }
+}
+
+#[allow(dead_code)]
+pub(crate) struct HarmonyEncodingInner {
     pub(crate) name: String,
     pub(crate) n_ctx: usize,
     pub(crate) max_message_tokens: usize,
@@ -89,72 +215,89 @@ pub struct HarmonyEncoding {
     pub(crate) tokenizer_name: String,
     pub(crate) tokenizer: Arc<CoreBPE>,
     pub(crate) format_token_mapping: HashMap<FormattingToken, String>,
-    pub(crate) stop_formatting_tokens: HashSet<FormattingToken>,
-    pub(crate) stop_formatting_tokens_for_assistant_actions: HashSet<FormattingToken>,
+    pub(crate) format_token_ranks: FormattingTokenTable,
+    pub(crate) stop_token_ranks: RankSet,
+    pub(crate) stop_token_ranks_for_assistant_actions: RankSet,
 }
 
 impl std::fmt::Debug for HarmonyEncoding {
     fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
         f.debug_struct("HarmonyEncoding")
-            .field("name", &self.name)
-            .field("tokenizer_name", &self.tokenizer_name)
-            .field("n_ctx", &self.n_ctx)
-            .field("max_message_tokens", &self.max_message_tokens)
-            .field("max_action_length", &self.max_action_length)
+            .field("name", &self.inner.name)
+            .field("tokenizer_name", &self.inner.tokenizer_name)
+            .field("n_ctx", &self.inner.n_ctx)
+            .field("max_message_tokens", &self.inner.max_message_tokens)
+            .field("max_action_length", &self.inner.max_action_length)
             .finish()
     }
 }
 
 impl std::fmt::Display for HarmonyEncoding {
     fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
-        write!(f, "Renderer({})", self.name)
+        write!(f, "Renderer({})", self.inner.name)
     }
 }
 
 // General methods
 impl HarmonyEncoding {
     pub fn name(&self) -> &str {
-        &self.name
+        &self.inner.name
     }
 
     pub fn tokenizer_name(&self) -> &str {
-        &self.tokenizer_name
+        &self.inner.tokenizer_name
     }
 
     pub fn max_message_tokens(&self) -> usize {
-        self.max_message_tokens
+        self.inner.max_message_tokens
     }
 
     pub fn tokenizer(&self) -> &CoreBPE {
-        &self.tokenizer
+        &self.inner.tokenizer
+    }
+
+    /// Encode many texts in parallel as plain text, without special tokens. The results are in
+    /// the order of `texts`.
+    pub fn encode_ordinary_batch<S: AsRef<str> + Sync>(&self, texts: &[S]) -> Vec<Vec<Rank>> {
+        self.inner.tokenizer.encode_ordinary_batch(texts)
+    }
+
+    /// Encode many texts in parallel, turning the special tokens that `policy` allows into
+    /// special tokens. Build the policy with [`CoreBPE::special_policy`]. The results are in
+    /// the order of `texts`.
+    pub fn encode_batch<S: AsRef<str> + Sync>(
+        &self,
+        texts: &[S],
+        policy: &SpecialPolicy,
+    ) -> Vec<Vec<Rank>> {
+        self.inner.tokenizer.encode_batch(texts, policy)
     }
 
     pub fn stop_tokens(&self) -> anyhow::Result<HashSet<Rank>> {
-        self.stop_formatting_tokens
-            .iter()
-            .copied()
-            .map(|t| match self.render_formatting_token(t) {
-                Ok(t) => Ok(t),
-                Err(RenderFormattingTokenError::UnmappedToken(_)) => Err(anyhow::anyhow!(
-                    "token {t} was specified as a stop token, but is not mapped"
-                )),
-                Err(e) => Err(anyhow::anyhow!(e).context("could not render stop token")),
-            })
-            .collect()
+        Ok(self.inner.stop_token_ranks.iter().collect())
     }
 
     pub fn stop_tokens_for_assistant_actions(&self) -> anyhow::Result<HashSet<Rank>> {
-        self.stop_formatting_tokens_for_assistant_actions
+        Ok(self
+            .inner
+            .stop_token_ranks_for_assistant_actions
             .iter()
-            .copied()
-            .map(|t| match self.render_formatting_token(t) {
-                Ok(t) => Ok(t),
-                Err(RenderFormattingTokenError::UnmappedToken(_)) => Err(anyhow::anyhow!(
-                    "token {t} was specified as a stop token, but is not mapped"
-                )),
-                Err(e) => Err(anyhow::anyhow!(e).context("could not render stop token")),
-            })
-            .collect()
+            .collect())
+    }
+
+    /// Whether `token` is one of the stop tokens returned by [`Self::stop_tokens`].
+    #[inline]
+    pub fn is_stop_token(&self, token: Rank) -> bool {
+        self.inner.stop_token_ranks.contains(token)
+    }
+
+    /// Whether `token` is one of the stop tokens returned by
+    /// [`Self::stop_tokens_for_assistant_actions`].
+    #[inline]
+    pub fn is_stop_token_for_assistant_actions(&self, token: Rank) -> bool {
+        self.inner
+            .stop_token_ranks_for_assistant_actions
+            .contains(token)
     }
 }
 
@@ -329,24 +472,15 @@ impl HarmonyEncoding {
 // Rendering helper methods
 impl HarmonyEncoding {
     fn mapped_format_token(&self, t: FormattingToken) -> Option<&str> {
-        self.format_token_mapping.get(&t).map(|s| s.as_str())
+        self.inner.format_token_mapping.get(&t).map(|s| s.as_str())
     }
 
+    #[inline]
     fn render_formatting_token(
         &self,
         t: FormattingToken,
     ) -> Result<Rank, RenderFormattingTokenError> {
-        let mapped = self
-            .mapped_format_token(t)
-            .ok_or(RenderFormattingTokenError::UnmappedToken(t))?;
-        let encoded = self.tokenizer.encode_with_special_tokens(mapped);
-        if encoded.len() != 1 {
-            return Err(RenderFormattingTokenError::InvalidEncoding {
-                token: t,
-                encoding: encoded,
-            });
-        }
-        Ok(encoded[0])
+        self.inner.format_token_ranks.get(t)
     }
 
     fn render_formatting_token_into<B>(
@@ -367,7 +501,7 @@ impl HarmonyEncoding {
         T: AsRef<str>,
         B: Extend<Rank>,
     {
-        into.extend(self.tokenizer.encode_ordinary(text.as_ref()));
+        into.extend(self.inner.tokenizer.encode_ordinary(text.as_ref()));
         Ok(())
     }
 
@@ -1054,29 +1188,125 @@ impl Default for ParseOptions {
 /// and retains the partially parsed state of the current message.
 pub struct StreamableParser {
     encoding: HarmonyEncoding,
+    stream: ParserStream,
+}
+
+/// Parsing state of a single token stream.
+///
+/// The state does not own an encoding, so many streams can be driven with a
+/// shared one (see [`crate::ParserPool`]). [`StreamableParser`] pairs a stream
+/// with its encoding.
+#[derive(Clone)]
+pub struct ParserStream {
     next_role: Option<Role>,
-    tokens: Vec<Rank>,
-    messages: Vec<Message>,
+    // The token history and completed messages are shared with forks.
+    tokens: ForkableVec<Rank>,
+    messages: ForkableVec<Message>,
     state: StreamState,
-    stop_tokens: HashSet<Rank>,
-    last_content_delta: Option<String>,
+    // Text of the current message decoded so far. It is built incrementally
+    // from the sampled tokens and reused across messages.
+    content: String,
+    // Offset into `content` where the text decoded from the last processed
+    // token starts, if that token produced a content delta.
+    content_delta_start: Option<usize>,
     undecoded_tokens: Vec<Rank>,
     undecoded_bytes: Vec<u8>,
     options: ParseOptions,
 }
 
+// The header and content tokens of the current message are the tail of the
+// stream's token history; the states only record where that tail starts.
 #[derive(Clone, Debug, serde::Serialize, serde::Deserialize)]
 pub enum StreamState {
     ExpectStart,
     Header {
-        header_tokens: Vec<Rank>,
+        header_start: usize,
     },
     Content {
         header: ParsedHeader,
-        content_tokens: Vec<Rank>,
+        content_start: usize,
+    },
+}
+
+/// Something that happened while processing a token, reported by
+/// [`StreamableParser::process_with_events`].
+///
+/// Every message produces a `MessageStart` and a `HeaderComplete` once its
+/// header has been parsed, followed by any number of `ContentDelta`s and a
+/// final `MessageEnd`.
+#[derive(Clone, Debug, PartialEq)]
+pub enum ParserEvent<'a> {
+    MessageStart {
+        role: Role,
+        name: Option<&'a str>,
+    },
+    HeaderComplete {
+        channel: Option<&'a str>,
+        recipient: Option<&'a str>,
+        content_type: Option<&'a str>,
+    },
+    ContentDelta(&'a str),
+    MessageEnd,
+}
+
+/// A position in a parser's token stream that the parser can be rolled back
+/// to, see [`StreamableParser::checkpoint`].
+#[derive(Clone, Debug)]
+pub struct ParserCheckpoint {
+    tokens_len: usize,
+    messages_len: usize,
+    state: CheckpointState,
+    next_role: Option<Role>,
+    content_delta_start: Option<usize>,
+    undecoded_tokens: Vec<Rank>,
+    undecoded_bytes: Vec<u8>,
+}
+
+// Like `StreamState`, but for content only the length of the text so far is
+// recorded; the rest can be recovered from the stream on rollback.
+#[derive(Clone, Debug)]
+enum CheckpointState {
+    ExpectStart,
+    Header {
+        header_start: usize,
+    },
+    Content {
+        content_start: usize,
+        content_len: usize,
     },
 }
 
+/// Coarse state of a [`StreamableParser`], without any partially parsed data.
+#[derive(Clone, Copy, Debug, PartialEq, Eq, serde::Serialize, serde::Deserialize)]
+pub enum StreamStateKind {
+    ExpectStart,
+    Header,
+    Content,
+}
+
+/// A state change observed while processing a batch of tokens.
+#[derive(Clone, Debug, PartialEq, Eq, serde::Serialize, serde::Deserialize)]
+pub struct StateTransition {
+    /// Index into the processed tokens of the token that caused the change.
+    pub token_index: usize,
+    /// Byte offset into [`ProcessSummary::content_delta`] at which it happened.
+    pub delta_offset: usize,
+    /// The state the parser entered.
+    pub state: StreamStateKind,
+}
+
+/// Summary of what happened during [`StreamableParser::process_many`].
+#[derive(Clone, Debug, Default, PartialEq, Eq, serde::Serialize, serde::Deserialize)]
+pub struct ProcessSummary {
+    /// Content text appended across all processed tokens, in order.
+    pub content_delta: String,
+    /// Every state change, in order.
+    pub state_transitions: Vec<StateTransition>,
+    /// Number of messages completed; they are the last entries of
+    /// [`StreamableParser::messages`].
+    pub messages_completed: usize,
+}
+
 impl StreamableParser {
     /// Create a new streaming parser starting with the given role.
     pub fn new(encoding: HarmonyEncoding, role: Option<Role>) -> anyhow::Result<Self> {
@@ -1089,47 +1319,473 @@ impl StreamableParser {
         role: Option<Role>,
         options: ParseOptions,
     ) -> anyhow::Result<Self> {
-        let stop_tokens = encoding.stop_tokens()?;
+        Ok(Self {
+            encoding,
+            stream: ParserStream::new(role, options),
+        })
+    }
+
+    pub fn process(&mut self, token: Rank) -> anyhow::Result<&mut Self> {
+        let is_stop = self.encoding.is_stop_token(token);
+        self.stream
+            .process_next(&self.encoding, Some(token), is_stop)?;
+        Ok(self)
+    }
+
+    pub fn process_eos(&mut self) -> anyhow::Result<&mut Self> {
+        self.stream.process_next(&self.encoding, None, false)?;
+        Ok(self)
+    }
+
+    /// Like [`Self::process`], but also reports what happened to `on_event`.
+    pub fn process_with_events<F>(
+        &mut self,
+        token: Rank,
+        mut on_event: F,
+    ) -> anyhow::Result<&mut Self>
+    where
+        F: FnMut(ParserEvent<'_>),
+    {
+        let is_stop = self.encoding.is_stop_token(token);
+        self.stream.process_next_with_events(
+            &self.encoding,
+            Some(token),
+            is_stop,
+            &mut on_event,
+        )?;
+        Ok(self)
+    }
+
+    /// Like [`Self::process_many`], but reports events instead of a summary.
+    pub fn process_many_with_events<F>(
+        &mut self,
+        tokens: &[Rank],
+        mut on_event: F,
+    ) -> anyhow::Result<&mut Self>
+    where
+        F: FnMut(ParserEvent<'_>),
+    {
+        self.stream.tokens.reserve(tokens.len());
+        for &token in tokens {
+            self.process_with_events(token, &mut on_event)?;
+        }
+        Ok(self)
+    }
+
+    /// Like [`Self::process_eos`], but also reports what happened to `on_event`.
+    pub fn process_eos_with_events<F>(&mut self, mut on_event: F) -> anyhow::Result<&mut Self>
+    where
+        F: FnMut(ParserEvent<'_>),
+    {
+        self.stream
+            .process_next_with_events(&self.encoding, None, false, &mut on_event)?;
+        Ok(self)
+    }
+
+    /// Consume a batch of tokens and summarize what changed.
+    ///
+    /// This is equivalent to calling [`Self::process`] for every token and
+    /// collecting the content deltas, state changes and completed messages
+    /// along the way. On error the tokens before the failing one stay
+    /// processed.
+    pub fn process_many(&mut self, tokens: &[Rank]) -> anyhow::Result<ProcessSummary> {
+        let mut summary = ProcessSummary::default();
+        let messages_before = self.stream.messages.len();
+        let mut state = self.state_kind();
+        self.stream.tokens.reserve(tokens.len());
+        for (token_index, &token) in tokens.iter().enumerate() {
+            self.process(token)?;
+            if let Some(delta) = self.last_content_delta_str() {
+                summary.content_delta.push_str(delta);
+            }
+            let next_state = self.state_kind();
+            if next_state != state {
+                summary.state_transitions.push(StateTransition {
+                    token_index,
+                    delta_offset: summary.content_delta.len(),
+                    state: next_state,
+                });
+                state = next_state;
+            }
+        }
+        summary.messages_completed = self.stream.messages.len() - messages_before;
+        Ok(summary)
+    }
+
+    /// Split off a parser that continues from the current position
+    /// independently, e.g. for beam search or sampling several completions.
+    ///
+    /// The token history and completed messages are shared between both
+    /// parsers rather than copied; only the partially parsed current message
+    /// is duplicated.
+    pub fn fork(&mut self) -> Self {
+        Self {
+            encoding: self.encoding.clone(),
+            stream: self.stream.fork(),
+        }
+    }
+
+    /// Record the current position so that it can be restored with
+    /// [`Self::rollback`], e.g. before feeding drafted tokens when doing
+    /// speculative decoding.
+    ///
+    /// Taking a checkpoint is O(1) and does not allocate unless the parser is
+    /// in the middle of an incomplete utf-8 sequence.
+    pub fn checkpoint(&self) -> ParserCheckpoint {
+        self.stream.checkpoint()
+    }
+
+    /// Restore the state recorded by `checkpoint`, undoing all tokens
+    /// processed since. The cost is proportional to the number of tokens and
+    /// messages rolled back, not to the length of the stream.
+    ///
+    /// `checkpoint` must have been taken from this parser, and checkpoints
+    /// taken after it are no longer valid once it has been rolled back to.
+    pub fn rollback(&mut self, checkpoint: &ParserCheckpoint) -> anyhow::Result<()> {
+        self.stream.rollback(checkpoint)
+    }
+
+    /// The encoding this parser decodes tokens with.
+    pub fn encoding(&self) -> &HarmonyEncoding {
+        &self.encoding
+    }
+
+    /// The parsing state of this parser's token stream.
+    pub fn stream(&self) -> &ParserStream {
+        &self.stream
+    }
+
+    /// Return the textual content of the current message so far.
+    ///
+    /// This is exactly the text decoded from the sampled content tokens; bytes
+    /// of a utf-8 sequence that is still incomplete are not included yet.
+    pub fn current_content(&self) -> anyhow::Result<String> {
+        Ok(self.current_content_str().to_owned())
+    }
+
+    /// Borrow the textual content of the current message so far.
+    ///
+    /// Unlike [`Self::current_content`] this does not copy, so it is cheap to
+    /// poll after every token.
+    pub fn current_content_str(&self) -> &str {
+        self.stream.current_content_str()
+    }
+
+    /// Coarse state the parser is currently in.
+    pub fn state_kind(&self) -> StreamStateKind {
+        self.stream.state_kind()
+    }
+
+    /// Role of the current message if it has been parsed.
+    pub fn current_role(&self) -> Option<Role> {
+        self.stream.current_role()
+    }
+
+    /// Current content type if known.
+    pub fn current_content_type(&self) -> Option<String> {
+        self.stream.current_content_type()
+    }
+
+    /// Decode the last content delta if available.
+    pub fn last_content_delta(&self) -> anyhow::Result<Option<String>> {
+        Ok(self.last_content_delta_str().map(str::to_owned))
+    }
+
+    /// Borrow the text decoded from the last processed token, if any.
+    pub fn last_content_delta_str(&self) -> Option<&str> {
+        self.stream.last_content_delta_str()
+    }
+
+    /// Reserve capacity for at least `additional` more tokens, so that
+    /// processing them does not need to grow the parser's token buffers.
+    pub fn reserve(&mut self, additional: usize) {
+        self.stream.reserve(additional);
+    }
+
+    /// Consume the parser and return all parsed messages.
+    pub fn into_messages(self) -> Vec<Message> {
+        self.stream.messages.into_vec()
+    }
+
+    /// All fully parsed messages so far, borrowed in place: even after `fork`, this neither
+    /// allocates nor copies.
+    pub fn messages(&self) -> HistoryView<'_, Message> {
+        self.stream.messages()
+    }
+
+    /// All tokens that were fed into the parser, borrowed in place.
+    pub fn tokens(&self) -> HistoryView<'_, Rank> {
+        self.stream.tokens()
+    }
+
+    /// Expose the current state as a JSON string for Python interop.
+    pub fn state_json(&self) -> anyhow::Result<String> {
+        self.stream.state_json()
+    }
+
+    /// Return the current recipient if known.
+    pub fn current_recipient(&self) -> Option<String> {
+        self.stream.current_recipient()
+    }
+
+    /// Return the current channel if known.
+    pub fn current_channel(&self) -> Option<String> {
+        self.stream.current_channel()
+    }
+}
+
+impl ParserStream {
+    /// Create an empty stream starting with the given role.
+    pub(crate) fn new(role: Option<Role>, options: ParseOptions) -> Self {
         let (state, next_role) = match role {
-            Some(role) => (
-                StreamState::Header {
-                    header_tokens: Vec::new(),
-                },
-                Some(role),
-            ),
+            Some(role) => (StreamState::Header { header_start: 0 }, Some(role)),
             None => (StreamState::ExpectStart, None),
         };
-        Ok(Self {
-            encoding,
+        Self {
             next_role,
-            tokens: Vec::new(),
-            messages: Vec::new(),
+            tokens: ForkableVec::new(),
+            messages: ForkableVec::new(),
             state,
-            stop_tokens,
-            last_content_delta: None,
+            content: String::new(),
+            content_delta_start: None,
             undecoded_tokens: Vec::new(),
             undecoded_bytes: Vec::new(),
             options,
-        })
+        }
+    }
+
+    /// Split off an independent copy, see [`StreamableParser::fork`].
+    pub fn fork(&mut self) -> Self {
+        Self {
+            next_role: self.next_role.clone(),
+            tokens: self.tokens.fork(),
+            messages: self.messages.fork(),
+            state: self.state.clone(),
+            content: self.content.clone(),
+            content_delta_start: self.content_delta_start,
+            undecoded_tokens: self.undecoded_tokens.clone(),
+            undecoded_bytes: self.undecoded_bytes.clone(),
+            options: self.options,
+        }
+    }
+
+    /// Number of fully parsed messages so far.
+    pub(crate) fn messages_len(&self) -> usize {
+        self.messages.len()
+    }
+
+    /// Record the current position, see [`StreamableParser::checkpoint`].
+    pub fn checkpoint(&self) -> ParserCheckpoint {
+        let state = match &self.state {
+            StreamState::ExpectStart => CheckpointState::ExpectStart,
+            StreamState::Header { header_start } => CheckpointState::Header {
+                header_start: *header_start,
+            },
+            StreamState::Content { content_start, .. } => CheckpointState::Content {
+                content_start: *content_start,
+                content_len: self.content.len(),
+            },
+        };
+        ParserCheckpoint {
+            tokens_len: self.tokens.len(),
+            messages_len: self.messages.len(),
+            state,
+            next_role: self.next_role.clone(),
+            content_delta_start: self.content_delta_start,
+            undecoded_tokens: self.undecoded_tokens.clone(),
+            undecoded_bytes: self.undecoded_bytes.clone(),
+        }
+    }
+
+    /// Restore a recorded position, see [`StreamableParser::rollback`].
+    pub fn rollback(&mut self, checkpoint: &ParserCheckpoint) -> anyhow::Result<()> {
+        if checkpoint.tokens_len > self.tokens.len()
+            || checkpoint.messages_len > self.messages.len()
+        {
+            anyhow::bail!("checkpoint is ahead of the parser");
+        }
+        // If the checkpoint is inside a message that has been completed since,
+        // that message is the first one rolled back and its text starts with
+        // the content seen at the checkpoint.
+        let reopen_message = match (&checkpoint.state, &self.state) {
+            (
+                CheckpointState::Content { content_start, .. },
+                StreamState::Content {
+                    content_start: current_start,
+                    ..
+                },
+            ) => content_start != current_start,
+            (CheckpointState::Content { .. }, _) => true,
+            _ => false,
+        };
+        if reopen_message
+            && !matches!(
+                self.messages
+                    .get(checkpoint.messages_len)
+                    .map(|message| message.content.as_slice()),
+                Some([Content::Text(_)])
+            )
+        {
+            anyhow::bail!("checkpoint does not belong to this parser");
+        }
+
+        let current = std::mem::replace(&mut self.state, StreamState::ExpectStart);
+        self.state = match checkpoint.state {
+            CheckpointState::ExpectStart => {
+                self.content.clear();
+                StreamState::ExpectStart
+            }
+            CheckpointState::Header { header_start } => {
+                self.content.clear();
+                StreamState::Header { header_start }
+            }
+            CheckpointState::Content {
+                content_start,
+                content_len,
+            } => {
+                let header = match current {
+                    StreamState::Content { header, .. } if !reopen_message => header,
+                    _ => {
+                        self.messages.truncate(checkpoint.messages_len + 1);
+                        // SAFETY: checked above that there is such a message
+                        // holding a single text content
+                        let mut message = self.messages.pop().unwrap();
+                        if let Some(Content::Text(TextContent { text })) = message.content.pop() {
+                            self.content = text;
+                        }
+                        ParsedHeader {
+                            author: message.author,
+                            recipient: message.recipient,
+                            channel: message.channel,
+                            content_type: message.content_type,
+                        }
+                    }
+                };
+                self.content.truncate(content_len);
+                StreamState::Content {
+                    header,
+                    content_start,
+                }
+            }
+        };
+        self.tokens.truncate(checkpoint.tokens_len);
+        self.messages.truncate(checkpoint.messages_len);
+        self.next_role.clone_from(&checkpoint.next_role);
+        self.content_delta_start = checkpoint.content_delta_start;
+        self.undecoded_tokens
+            .clone_from(&checkpoint.undecoded_tokens);
+        self.undecoded_bytes.clone_from(&checkpoint.undecoded_bytes);
+        Ok(())
+    }
+
+    /// Take the fully parsed messages out of the stream.
+    pub(crate) fn take_messages(&mut self) -> Vec<Message> {
+        std::mem::take(&mut self.messages).into_vec()
+    }
+
+    /// Reset to an empty stream starting with the given role, keeping the
+    /// allocated buffers so that the stream can be reused.
+    pub(crate) fn reset(&mut self, role: Option<Role>) {
+        self.state = match &role {
+            Some(_) => StreamState::Header { header_start: 0 },
+            None => StreamState::ExpectStart,
+        };
+        self.next_role = role;
+        self.tokens.clear();
+        self.messages.clear();
+        self.content.clear();
+        self.content_delta_start = None;
+        self.undecoded_tokens.clear();
+        self.undecoded_bytes.clear();
+    }
+
+    /// Like [`Self::process_next`], but derives the events for the token from
+    /// the state before and after processing it.
+    pub(crate) fn process_next_with_events<F>(
+        &mut self,
+        encoding: &HarmonyEncoding,
+        token: Option<Rank>,
+        is_stop: bool,
+        on_event: &mut F,
+    ) -> anyhow::Result<()>
+    where
+        F: FnMut(ParserEvent<'_>),
+    {
+        let was_content = matches!(self.state, StreamState::Content { .. });
+        let content_len = self.content.len();
+        let messages_len = self.messages.len();
+        self.process_next(encoding, token, is_stop)?;
+
+        match &self.state {
+            StreamState::Content { header, .. } if !was_content => {
+                on_event(ParserEvent::MessageStart {
+                    role: header.author.role.clone(),
+                    name: header.author.name.as_deref(),
+                });
+                on_event(ParserEvent::HeaderComplete {
+                    channel: header.channel.as_deref(),
+                    recipient: header.recipient.as_deref(),
+                    content_type: header.content_type.as_deref(),
+                });
+            }
+            StreamState::Content { .. } => {
+                if let Some(delta) = self.last_content_delta_str() {
+                    on_event(ParserEvent::ContentDelta(delta));
+                }
+            }
+            _ => {
+                let Some(message) = self.messages.get(messages_len) else {
+                    return Ok(());
+                };
+                let text = match message.content.first() {
+                    Some(Content::Text(TextContent { text })) => text.as_str(),
+                    _ => "",
+                };
+                // A message that ended without ever reaching the content state
+                // was malformed and is reported in one go. Otherwise only the
+                // text flushed at the end of the message is new.
+                let delta = if was_content {
+                    &text[content_len..]
+                } else {
+                    on_event(ParserEvent::MessageStart {
+                        role: message.author.role.clone(),
+                        name: message.author.name.as_deref(),
+                    });
+                    on_event(ParserEvent::HeaderComplete {
+                        channel: message.channel.as_deref(),
+                        recipient: message.recipient.as_deref(),
+                        content_type: message.content_type.as_deref(),
+                    });
+                    text
+                };
+                if !delta.is_empty() {
+                    on_event(ParserEvent::ContentDelta(delta));
+                }
+                on_event(ParserEvent::MessageEnd);
+            }
+        }
+        Ok(())
     }
 
     /// Consume a single token and update the internal state.
-    /// Consume a single token and update the internal state.
-    fn process_next(&mut self, token: Option<Rank>) -> anyhow::Result<&mut Self> {
+    ///
+    /// `is_stop` tells whether `token` is one of the encoding's stop tokens.
+    pub(crate) fn process_next(
+        &mut self,
+        encoding: &HarmonyEncoding,
+        token: Option<Rank>,
+        is_stop: bool,
+    ) -> anyhow::Result<()> {
         if let Some(token) = token {
             self.tokens.push(token);
         }
-        // Clone next_role up front to avoid borrow checker issues
-        let next_role_clone = self.next_role.clone();
         match &mut self.state {
             StreamState::ExpectStart => {
-                let start = self
-                    .encoding
-                    .render_formatting_token(FormattingToken::Start)?;
+                let start = encoding.render_formatting_token(FormattingToken::Start)?;
                 match token {
                     Some(token) if token == start => {
                         self.state = StreamState::Header {
-                            header_tokens: Vec::new(),
+                            header_start: self.tokens.len(),
                         };
                     }
                     Some(token) => {
@@ -1146,36 +1802,42 @@ impl StreamableParser {
                     }
                 }
             }
-            StreamState::Header { header_tokens } => {
-                let msg_tok = self
-                    .encoding
-                    .render_formatting_token(FormattingToken::Message)?;
+            StreamState::Header { header_start } => {
+                // Everything after the start of the header, except for the
+                // token being processed, belongs to the header.
+                let header_start = *header_start;
+                let header_end = self.tokens.len() - usize::from(token.is_some());
+                let msg_tok = encoding.render_formatting_token(FormattingToken::Message)?;
                 match token {
                     Some(token) if token == msg_tok => {
-                        // Clone the tokens and next_role, then clear the state before parsing
-                        let header_tokens_cloned = header_tokens.clone();
-                        let next_role_cloned = next_role_clone;
-                        // Set state to dummy to drop mutable borrow
+                        // Reset the state before parsing
                         self.state = StreamState::ExpectStart;
-                        let header =
-                            self.parse_header_from_tokens(&header_tokens_cloned, next_role_cloned)?;
+                        let header = Self::parse_header_from_tokens(
+                            encoding,
+                            self.tokens.view().slice(header_start..header_end),
+                            self.next_role.clone(),
+                        )?;
                         self.next_role = None;
                         self.state = StreamState::Content {
                             header,
-                            content_tokens: Vec::new(),
+                            content_start: self.tokens.len(),
                         };
                     }
-                    Some(token) if !self.options.strict && self.stop_tokens.contains(&token) => {
+                    Some(_) if !self.options.strict && is_stop => {
                         // Encountered a stop token while in Header state. This means we have
                         // accumulated header tokens but never saw a <|message|> token, so the
                         // message is malformed. If we have a role, parse header metadata and
                         // treat remaining tokens as content.
-                        if let Some(role) = next_role_clone {
+                        if let Some(role) = self.next_role.clone() {
+                            let header_tokens = self.tokens.view().slice(header_start..header_end);
                             if !header_tokens.is_empty() {
-                                let decoded =
-                                    self.encoding.tokenizer().decode_utf8(header_tokens)?;
-                                let (header, remaining_content) =
-                                    self.parse_header_from_string(decoded, Some(role), false)?;
+                                let decoded = encoding.tokenizer().decode_utf8(header_tokens)?;
+                                let (header, remaining_content) = Self::parse_header_from_string(
+                                    encoding,
+                                    decoded,
+                                    Some(role),
+                                    false,
+                                )?;
 
                                 // Use remaining content if present, otherwise empty string
                                 let text = remaining_content.unwrap_or_default();
@@ -1193,9 +1855,7 @@ impl StreamableParser {
                         self.state = StreamState::ExpectStart;
                         self.next_role = None;
                     }
-                    Some(token) => {
-                        header_tokens.push(token);
-                    }
+                    Some(_) => {}
                     None => {
                         anyhow::bail!(
                             "Unexpected EOS while waiting for message header to complete"
@@ -1203,77 +1863,58 @@ impl StreamableParser {
                     }
                 }
             }
-            StreamState::Content {
-                header,
-                content_tokens,
-            } => {
+            StreamState::Content { header, .. } => {
                 let is_eos = if let Some(token) = token {
-                    if self.stop_tokens.contains(&token) {
+                    if is_stop {
                         // this is a stop token, dont parse and mark EOS
                         true
                     } else {
+                        // The sampled tokens are kept as they are in the token history;
+                        // the text is tracked separately so nothing has to be re-encoded.
+                        self.content_delta_start = None;
                         self.undecoded_tokens.push(token);
                         // some tokens might not appropriately decode on their own. If they don't
                         // we will collect them until they eventually decode
-                        match self
-                            .encoding
+                        if encoding
                             .tokenizer()
-                            .decode_bytes(&self.undecoded_tokens)
+                            .decode_bytes_into(&self.undecoded_tokens, &mut self.undecoded_bytes)
+                            .is_ok()
                         {
-                            Ok(decoded_bytes) => {
-                                self.undecoded_bytes.extend(decoded_bytes.iter().copied());
-                                match String::from_utf8(self.undecoded_bytes.clone()) {
-                                    Ok(decoded_str) => {
-                                        self.encoding
-                                            .render_text_into(&decoded_str, content_tokens)?;
-                                        self.last_content_delta = Some(decoded_str);
-                                        self.undecoded_bytes.clear();
+                            let delta_start = self.content.len();
+                            match std::str::from_utf8(&self.undecoded_bytes) {
+                                Ok(decoded_str) => {
+                                    self.content.push_str(decoded_str);
+                                    self.content_delta_start = Some(delta_start);
+                                    self.undecoded_bytes.clear();
+                                }
+                                Err(utf8_error) => {
+                                    let valid_len = utf8_error.valid_up_to();
+                                    if valid_len > 0 {
+                                        // SAFETY: from_utf8 validated everything up to valid_len
+                                        let valid_str =
+                                            std::str::from_utf8(&self.undecoded_bytes[..valid_len])
+                                                .unwrap();
+                                        self.content.push_str(valid_str);
                                     }
-                                    Err(e) => {
-                                        let utf8_error = e.utf8_error();
-                                        let decoded_bytes = e.into_bytes();
-
-                                        let valid_len = utf8_error.valid_up_to();
-
-                                        let mut content_delta = String::new();
-                                        if valid_len > 0 {
-                                            let valid_str = String::from_utf8(
-                                                decoded_bytes[..valid_len].to_vec(),
-                                            )
-                                            .unwrap();
-                                            self.encoding
-                                                .render_text_into(&valid_str, content_tokens)?;
-                                            content_delta.push_str(&valid_str);
-                                            self.undecoded_bytes.drain(..valid_len);
-                                        }
 
-                                        match utf8_error.error_len() {
-                                            Some(error_len) => {
-                                                self.encoding.render_text_into(
-                                                    REPLACEMENT,
-                                                    content_tokens,
-                                                )?;
-                                                content_delta.push_str(REPLACEMENT);
-                                                self.undecoded_bytes.drain(..error_len);
-                                            }
-                                            None => {
-                                                // waiting on next byte in our utf-8 sequence
-                                                self.last_content_delta = None;
-                                            }
+                                    match utf8_error.error_len() {
+                                        Some(error_len) => {
+                                            self.content.push_str(REPLACEMENT);
+                                            self.undecoded_bytes.drain(..valid_len + error_len);
                                         }
-
-                                        if !content_delta.is_empty() {
-                                            self.last_content_delta = Some(content_delta);
+                                        None => {
+                                            // waiting on next byte in our utf-8 sequence
+                                            self.undecoded_bytes.drain(..valid_len);
                                         }
                                     }
+                                    if self.content.len() > delta_start {
+                                        self.content_delta_start = Some(delta_start);
+                                    }
                                 }
-                                self.undecoded_tokens.clear();
-                            }
-                            Err(_) => {
-                                // Bytes not yet valid utf-8, wait on the next token
-                                self.last_content_delta = None;
                             }
+                            self.undecoded_tokens.clear();
                         }
+                        // otherwise the bytes are not yet valid utf-8, wait on the next token
                         // this was not an EOS
                         false
                     }
@@ -1282,45 +1923,33 @@ impl StreamableParser {
                     true
                 };
                 if is_eos {
-                    // Our rendered content tokens are valid utf-8, so we can decode them directly
-                    let content_text = self.encoding.tokenizer().decode_utf8(content_tokens)?;
                     // Decode any remaining undecoded tokens, replacing any invalid tokens with the replacement character
-                    let tokens_text = match self
-                        .encoding
-                        .tokenizer()
-                        .decode_utf8(self.undecoded_tokens.clone())
-                    {
-                        Ok(text) => text,
-                        Err(_) => REPLACEMENT.to_string(),
-                    };
+                    match encoding.tokenizer().decode_utf8(&self.undecoded_tokens) {
+                        Ok(text) => self.content.push_str(&text),
+                        Err(_) => self.content.push_str(REPLACEMENT),
+                    }
                     // Decode any remaining undecoded bytes, replacing any invalid bytes with the replacement character
-                    let bytes_text = String::from_utf8_lossy(&self.undecoded_bytes);
-                    let text = content_text + &tokens_text + &bytes_text;
+                    self.content
+                        .push_str(&String::from_utf8_lossy(&self.undecoded_bytes));
                     let message = Message {
                         author: header.author.clone(),
                         recipient: header.recipient.clone(),
                         channel: header.channel.clone(),
                         content_type: header.content_type.clone(),
-                        content: vec![Content::Text(TextContent { text })],
+                        content: vec![Content::Text(TextContent {
+                            text: self.content.clone(),
+                        })],
                     };
                     self.messages.push(message);
                     self.state = StreamState::ExpectStart;
-                    self.last_content_delta = None;
+                    self.content.clear();
+                    self.content_delta_start = None;
                     self.undecoded_tokens.clear();
                     self.undecoded_bytes.clear();
                 }
             }
         }
-        Ok(self)
-    }
-
-    pub fn process(&mut self, token: Rank) -> anyhow::Result<&mut Self> {
-        self.process_next(Some(token))
-    }
-
-    pub fn process_eos(&mut self) -> anyhow::Result<&mut Self> {
-        self.process_next(None)?;
-        Ok(self)
+        Ok(())
     }
 
     /// Helper to parse header metadata from a decoded string.
@@ -1330,13 +1959,13 @@ impl StreamableParser {
     /// whitespace-separated tokens (normal header parsing). If false, treats all remaining
     /// text after extracting channel as content (for malformed messages).
     fn parse_header_from_string(
-        &self,
+        encoding: &HarmonyEncoding,
         mut header_string: String,
         role: Option<Role>,
         parse_recipient_and_type: bool,
     ) -> anyhow::Result<(ParsedHeader, Option<String>)> {
         let mut channel: Option<String> = None;
-        if let Some(channel_marker) = self.encoding.mapped_format_token(FormattingToken::Channel) {
+        if let Some(channel_marker) = encoding.mapped_format_token(FormattingToken::Channel) {
             if let Some(idx) = header_string.find(channel_marker) {
                 let after_marker = &header_string[idx + channel_marker.len()..];
                 let channel_end = after_marker
@@ -1363,9 +1992,8 @@ impl StreamableParser {
         // whitespace (e.g. "to=foo<|constrain|>json"), insert a space before
         // the marker so that splitting on whitespace treats the content type
         // as a separate token.
-        if let Some(constrain_marker) = self
-            .encoding
-            .mapped_format_token(FormattingToken::ConstrainedFormat)
+        if let Some(constrain_marker) =
+            encoding.mapped_format_token(FormattingToken::ConstrainedFormat)
         {
             if header_string.contains(constrain_marker) {
                 header_string = header_string
@@ -1471,18 +2099,17 @@ impl StreamableParser {
     }
 
     fn parse_header_from_tokens(
-        &self,
-        header_tokens: &[Rank],
+        encoding: &HarmonyEncoding,
+        header_tokens: HistoryView<'_, Rank>,
         role: Option<Role>,
     ) -> anyhow::Result<ParsedHeader> {
-        let header_string = self
-            .encoding
+        let header_string = encoding
             .tokenizer()
             .decode_utf8(header_tokens)
             .context("could not decode header")?;
 
         let (header, remaining_content) =
-            self.parse_header_from_string(header_string, role, true)?;
+            Self::parse_header_from_string(encoding, header_string, role, true)?;
 
         if remaining_content.is_some() {
             anyhow::bail!(
@@ -1495,14 +2122,27 @@ impl StreamableParser {
     }
 
     /// Return the textual content of the current message so far.
+    ///
+    /// This is exactly the text decoded from the sampled content tokens; bytes
+    /// of a utf-8 sequence that is still incomplete are not included yet.
     pub fn current_content(&self) -> anyhow::Result<String> {
+        Ok(self.current_content_str().to_owned())
+    }
+
+    /// Borrow the textual content of the current message so far.
+    ///
+    /// Unlike [`Self::current_content`] this does not copy, so it is cheap to
+    /// poll after every token.
+    pub fn current_content_str(&self) -> &str {
+        &self.content
+    }
+
+    /// Coarse state the stream is currently in.
+    pub fn state_kind(&self) -> StreamStateKind {
         match &self.state {
-            StreamState::Content { content_tokens, .. } => self
-                .encoding
-                .tokenizer()
-                .decode_utf8(content_tokens)
-                .map_err(|e| anyhow::anyhow!(e)),
-            _ => Ok(String::new()),
+            StreamState::ExpectStart => StreamStateKind::ExpectStart,
+            StreamState::Header { .. } => StreamStateKind::Header,
+            StreamState::Content { .. } => StreamStateKind::Content,
         }
     }
 
@@ -1522,24 +2162,24 @@ impl StreamableParser {
         }
     }
 
-    /// Decode the last content delta if available.
-    pub fn last_content_delta(&self) -> anyhow::Result<Option<String>> {
-        Ok(self.last_content_delta.clone())
+    /// Borrow the text decoded from the last processed token, if any.
+    pub fn last_content_delta_str(&self) -> Option<&str> {
+        self.content_delta_start.map(|start| &self.content[start..])
     }
 
-    /// Consume the parser and return all parsed messages.
-    pub fn into_messages(self) -> Vec<Message> {
-        self.messages
+    /// Reserve capacity for at least `additional` more tokens.
+    pub(crate) fn reserve(&mut self, additional: usize) {
+        self.tokens.reserve(additional);
     }
 
-    /// All fully parsed messages so far.
-    pub fn messages(&self) -> &[Message] {
-        &self.messages
+    /// All fully parsed messages so far, borrowed in place.
+    pub fn messages(&self) -> HistoryView<'_, Message> {
+        self.messages.view()
     }
 
-    /// All tokens that were fed into the parser.
-    pub fn tokens(&self) -> &[Rank] {
-        &self.tokens
+    /// All tokens that were fed into the stream, borrowed in place.
+    pub fn tokens(&self) -> HistoryView<'_, Rank> {
+        self.tokens.view()
     }
 
     /// Expose the current state as a JSON string for Python interop.
@@ -1549,24 +2189,24 @@ impl StreamableParser {
         enum SerializableStreamState<'a> {
             ExpectStart,
             Header {
-                header_tokens: &'a [Rank],
+                header_tokens: HistoryView<'a, Rank>,
             },
             Content {
                 header: &'a ParsedHeader,
-                content_tokens: &'a [Rank],
+                content_tokens: HistoryView<'a, Rank>,
             },
         }
         let serializable = match &self.state {
             StreamState::ExpectStart => SerializableStreamState::ExpectStart,
-            StreamState::Header { header_tokens } => {
-                SerializableStreamState::Header { header_tokens }
-            }
+            StreamState::Header { header_start } => SerializableStreamState::Header {
+                header_tokens: self.tokens.view().slice(*header_start..),
+            },
             StreamState::Content {
                 header,
-                content_tokens,
+                content_start,
             } => SerializableStreamState::Content {
                 header,
-                content_tokens,
+                content_tokens: self.tokens.view().slice(*content_start..),
             },
         };
         Ok(serde_json::to_string(&serializable)?)
@@ -0,0 +1,389 @@
+//! An append-only vector whose contents can be shared between forks.
+
+use std::{
+    fmt,
+    ops::{Bound, Index, RangeBounds},
+    sync::Arc,
+};
+
+/// A frozen run of items, starting at item `start` of every vector that
+/// shares it.
+struct Chunk<T> {
+    start: usize,
+    items: Vec<T>,
+}
+
+/// A vector that can be forked without copying its items.
+///
+/// Items pushed since the last fork live in a private tail; forking freezes
+/// the tail into a chunk that both sides share, so only items pushed after a
+/// fork are owned by one side. Until a vector has been forked it is just a
+/// `Vec`. The items are read through a `HistoryView`, which borrows the chunks
+/// in place rather than copying them into one slice.
+pub(crate) struct ForkableVec<T> {
+    // The shared chunks, in order. A chunk ends where the next one starts, or
+    // at `shared_len` for the last one; anything after that was pushed by
+    // another fork.
+    chunks: Vec<Arc<Chunk<T>>>,
+    shared_len: usize,
+    tail: Vec<T>,
+}
+
+impl<T> Default for ForkableVec<T> {
+    fn default() -> Self {
+        Self {
+            chunks: Vec::new(),
+            shared_len: 0,
+            tail: Vec::new(),
+        }
+    }
+}
+
+impl<T: Clone> Clone for ForkableVec<T> {
+    fn clone(&self) -> Self {
+        Self {
+            chunks: self.chunks.clone(),
+            shared_len: self.shared_len,
+            tail: self.tail.clone(),
+        }
+    }
+}
+
+impl<T> ForkableVec<T> {
+    pub(crate) fn new() -> Self {
+        Self::default()
+    }
+
+    pub(crate) fn len(&self) -> usize {
+        self.shared_len + self.tail.len()
+    }
+
+    pub(crate) fn push(&mut self, item: T) {
+        self.tail.push(item);
+    }
+
+    pub(crate) fn reserve(&mut self, additional: usize) {
+        self.tail.reserve(additional);
+    }
+
+    pub(crate) fn get(&self, index: usize) -> Option<&T> {
+        self.view().get(index)
+    }
+
+    /// All items, borrowed in place.
+    pub(crate) fn view(&self) -> HistoryView<'_, T> {
+        HistoryView {
+            chunks: &self.chunks,
+            shared_len: self.shared_len,
+            tail: &self.tail,
+            start: 0,
+            end: self.len(),
+        }
+    }
+
+    /// Shorten the vector to `len` items. The cost is proportional to the
+    /// number of items and forks removed.
+    pub(crate) fn truncate(&mut self, len: usize) {
+        if len >= self.len() {
+            return;
+        }
+        if len >= self.shared_len {
+            self.tail.truncate(len - self.shared_len);
+            return;
+        }
+        self.tail.clear();
+        while self.chunks.last().is_some_and(|chunk| chunk.start >= len) {
+            self.chunks.pop();
+        }
+        self.shared_len = len;
+    }
+
+    pub(crate) fn clear(&mut self) {
+        self.truncate(0);
+    }
+
+    /// Split off a copy that shares all current items with `self`. The cost
+    /// is proportional to the number of chunks, not items.
+    pub(crate) fn fork(&mut self) -> Self {
+        if !self.tail.is_empty() {
+            self.freeze_tail();
+        }
+        Self {
+            chunks: self.chunks.clone(),
+            shared_len: self.shared_len,
+            tail: Vec::new(),
+        }
+    }
+
+    fn freeze_tail(&mut self) {
+        let shared_len = self.shared_len;
+        self.shared_len += self.tail.len();
+        // A last chunk that no other fork shares any more is extended rather
+        // than followed by a new one, so that a line of forks that replace
+        // their parent, like the beams of a beam search, keeps few chunks.
+        if let Some(last) = self.chunks.last_mut().and_then(Arc::get_mut) {
+            last.items.truncate(shared_len - last.start);
+            last.items.append(&mut self.tail);
+            return;
+        }
+        self.chunks.push(Arc::new(Chunk {
+            start: shared_len,
+            items: std::mem::take(&mut self.tail),
+        }));
+    }
+}
+
+impl<T: Clone> ForkableVec<T> {
+    /// Remove and return the last item, copying it if it is shared.
+    pub(crate) fn pop(&mut self) -> Option<T> {
+        if let Some(item) = self.tail.pop() {
+            return Some(item);
+        }
+        let item = self.get(self.len().checked_sub(1)?)?.clone();
+        self.truncate(self.len() - 1);
+        Some(item)
+    }
+
+    /// The items as a `Vec`, copying those that are still shared.
+    pub(crate) fn into_vec(mut self) -> Vec<T> {
+        if self.chunks.is_empty() {
+            return self.tail;
+        }
+        let mut items = Vec::with_capacity(self.len());
+        let mut ends: Vec<usize> = self.chunks[1..].iter().map(|chunk| chunk.start).collect();
+        ends.push(self.shared_len);
+        for (chunk, end) in self.chunks.drain(..).zip(ends) {
+            let len = end - chunk.start;
+            match Arc::try_unwrap(chunk) {
+                Ok(mut chunk) => {
+                    chunk.items.truncate(len);
+                    items.append(&mut chunk.items);
+                }
+                Err(chunk) => items.extend_from_slice(&chunk.items[..len]),
+            }
+        }
+        items.append(&mut self.tail);
+        items
+    }
+}
+
+/// A borrowed, contiguous range of the items of a parser's history.
+///
+/// After the parser has been forked, the items live in runs shared with the
+/// other forks, so they are not one slice. A view reads them in place:
+/// indexing costs a binary search over the runs and iterating is as cheap as
+/// over a slice. Use `segments` to get at the underlying slices, or `to_vec`
+/// for an owned copy.
+pub struct HistoryView<'a, T> {
+    chunks: &'a [Arc<Chunk<T>>],
+    shared_len: usize,
+    tail: &'a [T],
+    // The range of the vector's items that this view covers.
+    start: usize,
+    end: usize,
+}
+
+impl<T> Clone for HistoryView<'_, T> {
+    fn clone(&self) -> Self {
+        *self
+    }
+}
+
+impl<T> Copy for HistoryView<'_, T> {}
+
+impl<'a, T> HistoryView<'a, T> {
+    pub fn len(&self) -> usize {
+        self.end - self.start
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.start == self.end
+    }
+
+    pub fn get(&self, index: usize) -> Option<&'a T> {
+        let index = self.start.checked_add(index).filter(|&i| i < self.end)?;
+        if index >= self.shared_len {
+            return self.tail.get(index - self.shared_len);
+        }
+        let chunk = &self.chunks[self.chunks.partition_point(|chunk| chunk.start <= index) - 1];
+        chunk.items.get(index - chunk.start)
+    }
+
+    pub fn first(&self) -> Option<&'a T> {
+        self.get(0)
+    }
+
+    pub fn last(&self) -> Option<&'a T> {
+        self.get(self.len().checked_sub(1)?)
+    }
+
+    /// The items in `range` of this view.
+    ///
+    /// # Panics
+    ///
+    /// If `range` is out of bounds.
+    pub fn slice(&self, range: impl RangeBounds<usize>) -> Self {
+        let start = match range.start_bound() {
+            Bound::Included(&start) => start,
+            Bound::Excluded(&start) => start + 1,
+            Bound::Unbounded => 0,
+        };
+        let end = match range.end_bound() {
+            Bound::Included(&end) => end + 1,
+            Bound::Excluded(&end) => end,
+            Bound::Unbounded => self.len(),
+        };
+        assert!(
+            start <= end && end <= self.len(),
+            "range {start}..{end} out of bounds for a view of length {}",
+            self.len()
+        );
+        Self {
+            start: self.start + start,
+            end: self.start + end,
+            ..*self
+        }
+    }
+
+    /// The items as contiguous slices, in order.
+    pub fn segments(&self) -> impl Iterator<Item = &'a [T]> + 'a {
+        let mut rest = *self;
+        std::iter::from_fn(move || {
+            let segment = rest.first_segment()?;
+            rest.start += segment.len();
+            Some(segment)
+        })
+    }
+
+    pub fn iter(&self) -> HistoryIter<'a, T> {
+        HistoryIter {
+            rest: *self,
+            segment: [].iter(),
+        }
+    }
+
+    // The longest run of items at the start of the view that is one slice.
+    fn first_segment(&self) -> Option<&'a [T]> {
+        if self.is_empty() {
+            return None;
+        }
+        if self.start >= self.shared_len {
+            return Some(&self.tail[self.start - self.shared_len..self.end - self.shared_len]);
+        }
+        let index = self
+            .chunks
+            .partition_point(|chunk| chunk.start <= self.start)
+            - 1;
+        let chunk = &self.chunks[index];
+        let chunk_end = self
+            .chunks
+            .get(index + 1)
+            .map_or(self.shared_len, |next| next.start);
+        Some(&chunk.items[self.start - chunk.start..self.end.min(chunk_end) - chunk.start])
+    }
+
+    pub fn to_vec(&self) -> Vec<T>
+    where
+        T: Clone,
+    {
+        let mut items = Vec::with_capacity(self.len());
+        for segment in self.segments() {
+            items.extend_from_slice(segment);
+        }
+        items
+    }
+}
+
+impl<T> Index<usize> for HistoryView<'_, T> {
+    type Output = T;
+
+    fn index(&self, index: usize) -> &T {
+        self.get(index).unwrap_or_else(|| {
+            panic!(
+                "index {index} out of bounds for a view of length {}",
+                self.len()
+            )
+        })
+    }
+}
+
+impl<'a, T> IntoIterator for HistoryView<'a, T> {
+    type Item = &'a T;
+    type IntoIter = HistoryIter<'a, T>;
+
+    fn into_iter(self) -> HistoryIter<'a, T> {
+        self.iter()
+    }
+}
+
+/// Iterates over the items of a `HistoryView`.
+pub struct HistoryIter<'a, T> {
+    // The items after `segment`.
+    rest: HistoryView<'a, T>,
+    segment: std::slice::Iter<'a, T>,
+}
+
+impl<'a, T> Iterator for HistoryIter<'a, T> {
+    type Item = &'a T;
+
+    #[inline]
+    fn next(&mut self) -> Option<&'a T> {
+        loop {
+            if let Some(item) = self.segment.next() {
+                return Some(item);
+            }
+            let segment = self.rest.first_segment()?;
+            self.rest.start += segment.len();
+            self.segment = segment.iter();
+        }
+    }
+
+    fn size_hint(&self) -> (usize, Option<usize>) {
+        let len = self.segment.len() + self.rest.len();
+        (len, Some(len))
+    }
+}
+
+impl<T> ExactSizeIterator for HistoryIter<'_, T> {}
+
+impl<T: fmt::Debug> fmt::Debug for HistoryView<'_, T> {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.debug_list().entries(self.iter()).finish()
+    }
+}
+
+impl<T: serde::Serialize> serde::Serialize for HistoryView<'_, T> {
+    fn serialize<S: serde::Serializer>(&self, serializer: S) -> Result<S::Ok, S::Error> {
+        serializer.collect_seq(self.iter())
+    }
+}
+
+impl<T: PartialEq> PartialEq for HistoryView<'_, T> {
+    fn eq(&self, other: &Self) -> bool {
+        self.len() == other.len() && self.iter().eq(other.iter())
+    }
+}
+
+impl<T: PartialEq> PartialEq<[T]> for HistoryView<'_, T> {
+    fn eq(&self, other: &[T]) -> bool {
+        self.len() == other.len() && self.iter().eq(other)
+    }
+}
+
+impl<T: PartialEq> PartialEq<&[T]> for HistoryView<'_, T> {
+    fn eq(&self, other: &&[T]) -> bool {
+        *self == **other
+    }
+}
+
+impl<T: PartialEq> PartialEq<Vec<T>> for HistoryView<'_, T> {
+    fn eq(&self, other: &Vec<T>) -> bool {
+        *self == **other
+    }
+}
+
+impl<T: PartialEq> PartialEq<HistoryView<'_, T>> for Vec<T> {
+    fn eq(&self, other: &HistoryView<'_, T>) -> bool {
+        other == self
+    }
+}
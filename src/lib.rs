@@ -1,13 +1,28 @@
 #![doc = include_str!("../README.md")]
 
+mod ascii_scan;
 pub mod chat;
 mod encoding;
+mod forkable_vec;
+mod parallel;
+mod parser_pool;
+mod pretokenizer;
 mod registry;
+mod snapshot;
+mod table;
 mod tiktoken;
 pub mod tiktoken_ext;
+mod vocab;
 
-pub use encoding::{HarmonyEncoding, ParseOptions, StreamableParser};
+pub use encoding::{
+    HarmonyEncoding, ParseOptions, ParserCheckpoint, ParserEvent, ParserStream, ProcessSummary,
+    StateTransition, StreamStateKind, StreamableParser,
+};
+pub use forkable_vec::{HistoryIter, HistoryView};
+pub use parser_pool::{ParserPool, PoolStep, SlotId};
 pub use registry::load_harmony_encoding;
+#[cfg(not(target_arch = "wasm32"))]
+pub use registry::warm_up;
 pub use registry::HarmonyEncodingName;
 
 #[cfg(test)]
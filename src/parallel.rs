@@ -0,0 +1,323 @@
+//! A small worker pool for tokenizing many independent inputs at once.
+//!
+//! The pool is one fixed set of threads for the whole process, started on first use, so that
+//! concurrent callers share [`max_threads`] threads between them rather than each starting
+//! their own. A `map` offers its items to the pool and works through them on the calling
+//! thread too; idle workers join in. Everyone claims items from a shared cursor, so a thread
+//! that finishes its share early keeps taking items that would otherwise wait behind a slow
+//! one. The work is borrowed from the caller, which waits for every worker that joined in to
+//! finish before it returns.
+//!
+//! A `map` called from inside a worker, e.g. to encode one large document of a batch in
+//! chunks, runs on that worker alone instead of waiting on the pool.
+//!
+//! A child process forked after the pool started has none of its threads, and the lock of the
+//! pool may have been held by one of them at the fork. So the child never touches the parent's
+//! pool: the pool records the process that started it, and a child starts its own on first use.
+
+use std::any::Any;
+use std::cell::Cell;
+use std::collections::VecDeque;
+use std::panic::AssertUnwindSafe;
+use std::sync::atomic::{AtomicPtr, AtomicUsize, Ordering};
+use std::sync::{Condvar, Mutex, MutexGuard, OnceLock, PoisonError};
+
+const NUM_THREADS_VAR: &str = "HARMONY_NUM_THREADS";
+const CHUNKED_ENCODE_THRESHOLD_VAR: &str = "HARMONY_CHUNKED_ENCODE_THRESHOLD";
+const DEFAULT_CHUNKED_ENCODE_THRESHOLD: usize = 256 * 1024;
+
+thread_local! {
+    // Whether this thread is running the work of a `map`.
+    static IN_WORKER: Cell<bool> = const { Cell::new(false) };
+}
+
+/// The number of threads a batch call uses at most, counting the calling thread. Defaults to
+/// the available parallelism; set `HARMONY_NUM_THREADS` to override it. The pool has one
+/// thread fewer, as callers work too.
+pub(crate) fn max_threads() -> usize {
+    static MAX_THREADS: OnceLock<usize> = OnceLock::new();
+    *MAX_THREADS.get_or_init(|| {
+        std::env::var(NUM_THREADS_VAR)
+            .ok()
+            .and_then(|value| value.parse().ok())
+            .or_else(|| std::thread::available_parallelism().ok().map(Into::into))
+            .unwrap_or(1)
+            .max(1)
+    })
+}
+
+/// Texts of at least this many bytes are split into chunks that are encoded in parallel.
+/// Defaults to 256 KiB; set `HARMONY_CHUNKED_ENCODE_THRESHOLD` to override it.
+pub(crate) fn chunked_encode_threshold() -> usize {
+    static THRESHOLD: OnceLock<usize> = OnceLock::new();
+    *THRESHOLD.get_or_init(|| {
+        std::env::var(CHUNKED_ENCODE_THRESHOLD_VAR)
+            .ok()
+            .and_then(|value| value.parse().ok())
+            .unwrap_or(DEFAULT_CHUNKED_ENCODE_THRESHOLD)
+    })
+}
+
+/// Call `f` on every item, spread over the calling thread and up to [`max_threads`] - 1
+/// threads of the pool, and return the results in the order of `items`.
+pub(crate) fn map<T, R>(items: &[T], f: impl Fn(&T) -> R + Sync) -> Vec<R>
+where
+    T: Sync,
+    R: Send,
+{
+    let helpers = if can_help() {
+        max_threads().min(items.len()).saturating_sub(1)
+    } else {
+        0
+    };
+    if helpers == 0 {
+        return items.iter().map(f).collect();
+    }
+
+    let job = Job {
+        items,
+        f,
+        cursor: AtomicUsize::new(0),
+        helping: AtomicUsize::new(0),
+        done: Mutex::new(Vec::with_capacity(items.len())),
+        panic: Mutex::new(None),
+    };
+    let pool = Pool::get();
+    pool.offer(&job, helpers);
+    // The calling thread works too rather than waiting idle.
+    job.help();
+    pool.withdraw(&job);
+
+    if let Some(payload) = job
+        .panic
+        .into_inner()
+        .unwrap_or_else(PoisonError::into_inner)
+    {
+        std::panic::resume_unwind(payload);
+    }
+    let mut results: Vec<Option<R>> = std::iter::repeat_with(|| None).take(items.len()).collect();
+    for (index, result) in job
+        .done
+        .into_inner()
+        .unwrap_or_else(PoisonError::into_inner)
+    {
+        results[index] = Some(result);
+    }
+    results
+        .into_iter()
+        .map(|result| result.expect("every item is claimed by a thread"))
+        .collect()
+}
+
+/// Whether a `map` on this thread can use the pool: a `map` inside a worker, and everything
+/// on targets without threads, runs on the calling thread alone.
+pub(crate) fn can_help() -> bool {
+    !cfg!(target_arch = "wasm32") && !IN_WORKER.get() && max_threads() > 1
+}
+
+/// The number of threads the pool has started so far.
+#[cfg(test)]
+pub(crate) fn pool_threads() -> usize {
+    Pool::get().threads.load(Ordering::Relaxed)
+}
+
+#[cfg(test)]
+pub(crate) fn in_worker() -> bool {
+    IN_WORKER.get()
+}
+
+/// Marks the current thread as running the work of a `map` until dropped, even if the work
+/// panics.
+struct WorkerGuard {
+    was_in_worker: bool,
+}
+
+impl WorkerGuard {
+    fn enter() -> Self {
+        Self {
+            was_in_worker: IN_WORKER.replace(true),
+        }
+    }
+}
+
+impl Drop for WorkerGuard {
+    fn drop(&mut self) {
+        IN_WORKER.set(self.was_in_worker);
+    }
+}
+
+/// The work of one `map`, as seen by the pool.
+trait Task: Sync {
+    /// Claim and run items until there are none left. Never panics: a panic of the work is
+    /// recorded for the caller of `map` to resume.
+    fn help(&self);
+
+    /// How many pool threads are in `help`.
+    fn helping(&self) -> &AtomicUsize;
+}
+
+struct Job<'a, T, F, R> {
+    items: &'a [T],
+    f: F,
+    cursor: AtomicUsize,
+    helping: AtomicUsize,
+    done: Mutex<Vec<(usize, R)>>,
+    panic: Mutex<Option<Box<dyn Any + Send>>>,
+}
+
+impl<T, F, R> Task for Job<'_, T, F, R>
+where
+    T: Sync,
+    F: Fn(&T) -> R + Sync,
+    R: Send,
+{
+    fn help(&self) {
+        let _worker = WorkerGuard::enter();
+        let mut done = Vec::new();
+        let result = std::panic::catch_unwind(AssertUnwindSafe(|| loop {
+            let index = self.cursor.fetch_add(1, Ordering::Relaxed);
+            let Some(item) = self.items.get(index) else {
+                return;
+            };
+            done.push((index, (self.f)(item)));
+        }));
+        match result {
+            Ok(()) => self
+                .done
+                .lock()
+                .unwrap_or_else(PoisonError::into_inner)
+                .append(&mut done),
+            Err(payload) => {
+                // Stop handing out items; the caller will panic anyway.
+                self.cursor.store(self.items.len(), Ordering::Relaxed);
+                *self.panic.lock().unwrap_or_else(PoisonError::into_inner) = Some(payload);
+            }
+        }
+    }
+
+    fn helping(&self) -> &AtomicUsize {
+        &self.helping
+    }
+}
+
+/// An invitation for a pool thread to help with a job.
+struct Ticket(*const (dyn Task + 'static));
+
+// SAFETY: a `Task` is `Sync`, and `Pool::withdraw` keeps it alive while tickets to it exist.
+unsafe impl Send for Ticket {}
+
+struct Pool {
+    // The process that started the threads.
+    pid: u32,
+    tickets: Mutex<VecDeque<Ticket>>,
+    // Signalled when tickets are offered.
+    offered: Condvar,
+    // Signalled when a pool thread stops helping with a job.
+    finished: Condvar,
+    threads: AtomicUsize,
+}
+
+// The pool of the process, once started. Pools are never freed.
+static POOL: AtomicPtr<Pool> = AtomicPtr::new(std::ptr::null_mut());
+
+impl Pool {
+    /// The pool of this process, with its threads started.
+    fn get() -> &'static Self {
+        let pid = std::process::id();
+        loop {
+            let current = POOL.load(Ordering::Acquire);
+            // SAFETY: a published pool is never freed.
+            if let Some(pool) = unsafe { current.as_ref() } {
+                if pool.pid == pid {
+                    return pool;
+                }
+            }
+            // None yet, or the one of the parent of this forked process, which is left alone.
+            let pool = Box::into_raw(Box::new(Pool {
+                pid,
+                tickets: Mutex::new(VecDeque::new()),
+                offered: Condvar::new(),
+                finished: Condvar::new(),
+                threads: AtomicUsize::new(0),
+            }));
+            match POOL.compare_exchange(current, pool, Ordering::AcqRel, Ordering::Acquire) {
+                Ok(_) => {
+                    // SAFETY: just published, so never freed.
+                    let pool = unsafe { &*pool };
+                    pool.start();
+                    return pool;
+                }
+                // SAFETY: another thread published its pool first; ours was never shared.
+                Err(_) => drop(unsafe { Box::from_raw(pool) }),
+            }
+        }
+    }
+
+    fn start(&'static self) {
+        for _ in 1..max_threads() {
+            let spawned = std::thread::Builder::new()
+                .name("harmony-worker".to_owned())
+                .spawn(|| self.run());
+            // With fewer threads, callers just do more of the work themselves.
+            if spawned.is_ok() {
+                self.threads.fetch_add(1, Ordering::Relaxed);
+            }
+        }
+    }
+
+    fn lock(&self) -> MutexGuard<'_, VecDeque<Ticket>> {
+        self.tickets.lock().unwrap_or_else(PoisonError::into_inner)
+    }
+
+    /// Invite up to `helpers` pool threads to help with `job`. The caller must call `withdraw`
+    /// before `job` goes away.
+    fn offer<'a>(&self, job: &'a (dyn Task + 'a), helpers: usize) {
+        // SAFETY: only the lifetime is erased; `withdraw` waits for every use of the ticket.
+        let task = unsafe {
+            std::mem::transmute::<*const (dyn Task + 'a), *const (dyn Task + 'static)>(job)
+        };
+        let mut tickets = self.lock();
+        tickets.extend((0..helpers).map(|_| Ticket(task)));
+        drop(tickets);
+        for _ in 0..helpers {
+            self.offered.notify_one();
+        }
+    }
+
+    /// Take back the tickets to `job` that no thread has taken, and wait for the threads that
+    /// did to finish helping.
+    fn withdraw(&self, job: &dyn Task) {
+        let mut tickets = self.lock();
+        tickets.retain(|ticket| !std::ptr::addr_eq(ticket.0, job));
+        // A thread takes a ticket and starts helping under the lock, so no more can start.
+        while job.helping().load(Ordering::Relaxed) > 0 {
+            tickets = self
+                .finished
+                .wait(tickets)
+                .unwrap_or_else(PoisonError::into_inner);
+        }
+    }
+
+    /// The loop of a pool thread.
+    fn run(&self) {
+        let mut tickets = self.lock();
+        loop {
+            let Some(ticket) = tickets.pop_front() else {
+                tickets = self
+                    .offered
+                    .wait(tickets)
+                    .unwrap_or_else(PoisonError::into_inner);
+                continue;
+            };
+            // SAFETY: the job is alive while its ticket is queued, and from then on until
+            // `helping` drops back to zero, which `withdraw` waits for.
+            let task = unsafe { &*ticket.0 };
+            task.helping().fetch_add(1, Ordering::Relaxed);
+            drop(tickets);
+            task.help();
+            tickets = self.lock();
+            task.helping().fetch_sub(1, Ordering::Relaxed);
+            self.finished.notify_all();
+        }
+    }
+}
@@ -0,0 +1,257 @@
+//! Parsing many token streams at once, one batched decode step at a time.
+
+use crate::{
+    chat::{Message, Role},
+    encoding::{HarmonyEncoding, ParseOptions, ParserStream},
+    tiktoken::Rank,
+};
+
+/// Identifies a stream within a [`ParserPool`].
+pub type SlotId = usize;
+
+/// A set of token streams that share one encoding, e.g. the sequences of a
+/// batched inference loop.
+///
+/// A slot is acquired for every new sequence and released once the sequence
+/// finishes; released slots and their buffers are reused by later sequences.
+/// Each [`ParserPool::step`] feeds one token to each of a set of slots and
+/// collects the resulting content deltas into one contiguous buffer.
+pub struct ParserPool {
+    encoding: HarmonyEncoding,
+    options: ParseOptions,
+    // Slot storage, indexed by `SlotId`.
+    streams: Vec<ParserStream>,
+    in_use: Vec<bool>,
+    free: Vec<SlotId>,
+    // Per-step stop token flags, reused across steps.
+    is_stop: Vec<bool>,
+    is_final: Vec<bool>,
+    step: PoolStep,
+}
+
+/// Output of a single [`ParserPool::step`], with one entry per token fed.
+#[derive(Debug, Default)]
+pub struct PoolStep {
+    deltas: String,
+    // `delta_offsets[i]..delta_offsets[i + 1]` is the delta of entry `i`.
+    delta_offsets: Vec<usize>,
+    messages_completed: Vec<bool>,
+    finished: Vec<bool>,
+    errors: Vec<(usize, anyhow::Error)>,
+}
+
+impl PoolStep {
+    fn clear(&mut self) {
+        self.deltas.clear();
+        self.delta_offsets.clear();
+        self.delta_offsets.push(0);
+        self.messages_completed.clear();
+        self.finished.clear();
+        self.errors.clear();
+    }
+
+    /// Number of entries in this step.
+    pub fn len(&self) -> usize {
+        self.finished.len()
+    }
+
+    /// Whether this step had no entries.
+    pub fn is_empty(&self) -> bool {
+        self.finished.is_empty()
+    }
+
+    /// The content deltas of all entries, concatenated in order.
+    pub fn deltas(&self) -> &str {
+        &self.deltas
+    }
+
+    /// Byte offsets of each entry's delta in [`Self::deltas`]; there is one
+    /// more offset than there are entries.
+    pub fn delta_offsets(&self) -> &[usize] {
+        &self.delta_offsets
+    }
+
+    /// Content text appended by the token of entry `index`.
+    pub fn delta(&self, index: usize) -> &str {
+        &self.deltas[self.delta_offsets[index]..self.delta_offsets[index + 1]]
+    }
+
+    /// Whether the token of entry `index` completed a message.
+    pub fn message_completed(&self, index: usize) -> bool {
+        self.messages_completed[index]
+    }
+
+    /// Whether the sequence of entry `index` is finished, either because it
+    /// sampled a final stop token or because parsing failed. Finished slots
+    /// should be released.
+    pub fn finished(&self, index: usize) -> bool {
+        self.finished[index]
+    }
+
+    /// Entries whose token could not be parsed, with the error.
+    pub fn errors(&self) -> &[(usize, anyhow::Error)] {
+        &self.errors
+    }
+}
+
+impl ParserPool {
+    /// Create an empty pool using the given encoding for all streams.
+    pub fn new(encoding: HarmonyEncoding, options: ParseOptions) -> Self {
+        Self::with_capacity(encoding, options, 0)
+    }
+
+    /// Create an empty pool with room for `capacity` slots.
+    pub fn with_capacity(
+        encoding: HarmonyEncoding,
+        options: ParseOptions,
+        capacity: usize,
+    ) -> Self {
+        Self {
+            encoding,
+            options,
+            streams: Vec::with_capacity(capacity),
+            in_use: Vec::with_capacity(capacity),
+            free: Vec::new(),
+            is_stop: Vec::with_capacity(capacity),
+            is_final: Vec::with_capacity(capacity),
+            step: PoolStep::default(),
+        }
+    }
+
+    /// The encoding shared by all streams.
+    pub fn encoding(&self) -> &HarmonyEncoding {
+        &self.encoding
+    }
+
+    /// Number of slots currently in use.
+    pub fn len(&self) -> usize {
+        self.streams.len() - self.free.len()
+    }
+
+    /// Whether no slot is in use.
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Start a new stream, reusing a released slot if there is one.
+    pub fn acquire(&mut self, role: Option<Role>) -> SlotId {
+        match self.free.pop() {
+            Some(slot) => {
+                self.streams[slot].reset(role);
+                self.in_use[slot] = true;
+                slot
+            }
+            None => {
+                self.streams.push(ParserStream::new(role, self.options));
+                self.in_use.push(true);
+                self.streams.len() - 1
+            }
+        }
+    }
+
+    /// Start a new stream that continues from the current position of the
+    /// stream in `slot`, sharing its history (see [`crate::StreamableParser::fork`]).
+    pub fn fork(&mut self, slot: SlotId) -> anyhow::Result<SlotId> {
+        self.check_slot(slot)?;
+        let stream = self.streams[slot].fork();
+        Ok(match self.free.pop() {
+            Some(free) => {
+                self.streams[free] = stream;
+                self.in_use[free] = true;
+                free
+            }
+            None => {
+                self.streams.push(stream);
+                self.in_use.push(true);
+                self.streams.len() - 1
+            }
+        })
+    }
+
+    /// Finish the stream in `slot`, returning its parsed messages. The slot is
+    /// recycled by a later [`Self::acquire`].
+    pub fn release(&mut self, slot: SlotId) -> anyhow::Result<Vec<Message>> {
+        self.check_slot(slot)?;
+        self.in_use[slot] = false;
+        self.free.push(slot);
+        Ok(self.streams[slot].take_messages())
+    }
+
+    /// The parsing state of the stream in `slot`, if the slot is in use.
+    pub fn stream(&self, slot: SlotId) -> Option<&ParserStream> {
+        match self.in_use.get(slot) {
+            Some(true) => Some(&self.streams[slot]),
+            _ => None,
+        }
+    }
+
+    /// Signal the end of the token stream in `slot`.
+    pub fn process_eos(&mut self, slot: SlotId) -> anyhow::Result<()> {
+        self.check_slot(slot)?;
+        self.streams[slot].process_next(&self.encoding, None, false)
+    }
+
+    /// Feed `tokens[i]` to the stream in `slot_ids[i]` for every `i`.
+    ///
+    /// All slots must be in use. A token that fails to parse does not abort
+    /// the step; the error is reported in [`PoolStep::errors`] and the slot
+    /// is marked as finished.
+    pub fn step(&mut self, slot_ids: &[SlotId], tokens: &[Rank]) -> anyhow::Result<&PoolStep> {
+        if slot_ids.len() != tokens.len() {
+            anyhow::bail!(
+                "got {} slot ids but {} tokens",
+                slot_ids.len(),
+                tokens.len()
+            );
+        }
+        for &slot in slot_ids {
+            self.check_slot(slot)?;
+        }
+
+        // Classify the whole batch up front so that the per-slot loop below
+        // only has to look up flags.
+        self.is_stop.clear();
+        self.is_stop.extend(
+            tokens
+                .iter()
+                .map(|&token| self.encoding.is_stop_token(token)),
+        );
+        self.is_final.clear();
+        self.is_final.extend(
+            tokens
+                .iter()
+                .map(|&token| self.encoding.is_stop_token_for_assistant_actions(token)),
+        );
+
+        self.step.clear();
+        for (index, (&slot, &token)) in slot_ids.iter().zip(tokens).enumerate() {
+            let stream = &mut self.streams[slot];
+            let messages_before = stream.messages_len();
+            let mut finished = self.is_final[index];
+            match stream.process_next(&self.encoding, Some(token), self.is_stop[index]) {
+                Ok(()) => {
+                    if let Some(delta) = stream.last_content_delta_str() {
+                        self.step.deltas.push_str(delta);
+                    }
+                }
+                Err(error) => {
+                    self.step.errors.push((index, error));
+                    finished = true;
+                }
+            }
+            self.step.delta_offsets.push(self.step.deltas.len());
+            self.step
+                .messages_completed
+                .push(stream.messages_len() > messages_before);
+            self.step.finished.push(finished);
+        }
+        Ok(&self.step)
+    }
+
+    fn check_slot(&self, slot: SlotId) -> anyhow::Result<()> {
+        match self.in_use.get(slot) {
+            Some(true) => Ok(()),
+            _ => anyhow::bail!("slot {slot} is not in use"),
+        }
+    }
+}
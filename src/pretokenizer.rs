@@ -0,0 +1,368 @@
+//! A hand-written equivalent of the o200k pre-tokenization regex.
+//!
+//! The `\s+(?!\S)` alternative of the pattern needs a lookahead, which puts `fancy_regex` on its
+//! backtracking engine for every piece. Each alternative is simple enough to match directly
+//! once the Unicode classes of a character are known, so `CoreBPE` uses [`O200kPieces`]
+//! instead whenever it is created with the o200k pattern.
+//!
+//! The character classes are taken from `regex-syntax`, which provides the Unicode tables of
+//! the regex engine itself, so the two cannot disagree about which class a character is in.
+
+use std::sync::OnceLock;
+
+use regex_syntax::hir::{Class, HirKind};
+
+use crate::ascii_scan::{self, AsciiClass};
+
+/// The alternatives of the pattern shared by the `o200k_base` and `o200k_harmony` encodings.
+pub(crate) const O200K_PATTERN_PARTS: [&str; 7] = [
+    "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?",
+    "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?",
+    "\\p{N}{1,3}",
+    " ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*",
+    "\\s*[\\r\\n]+",
+    "\\s+(?!\\S)",
+    "\\s+",
+];
+
+pub(crate) fn o200k_pattern() -> String {
+    O200K_PATTERN_PARTS.join("|")
+}
+
+// Class bits of a character. `UPPER` and `LOWER` are the two letter classes of the pattern;
+// both include the `Lm`, `Lo` and `M` categories.
+const LETTER: u8 = 1 << 0; // \p{L}
+const NUMBER: u8 = 1 << 1; // \p{N}
+const UPPER: u8 = 1 << 2; // [\p{Lu}\p{Lt}\p{Lm}\p{Lo}\p{M}]
+const LOWER: u8 = 1 << 3; // [\p{Ll}\p{Lm}\p{Lo}\p{M}]
+const SPACE: u8 = 1 << 4; // \s
+const NEWLINE: u8 = 1 << 5; // [\r\n]
+
+struct CharClasses {
+    // Class bits of every character in the Basic Multilingual Plane.
+    bmp: Box<[u8]>,
+    // Sorted, disjoint (first, last, bits) ranges for the other planes.
+    astral: Vec<(u32, u32, u8)>,
+}
+
+impl CharClasses {
+    fn get() -> &'static Self {
+        static CLASSES: OnceLock<CharClasses> = OnceLock::new();
+        CLASSES.get_or_init(Self::new)
+    }
+
+    fn new() -> Self {
+        let classes = [
+            (LETTER, "\\p{L}"),
+            (NUMBER, "\\p{N}"),
+            (UPPER, "[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]"),
+            (LOWER, "[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]"),
+            (SPACE, "\\s"),
+            (NEWLINE, "[\\r\\n]"),
+        ];
+        let mut bmp = vec![0u8; 0x10000].into_boxed_slice();
+        let mut astral_ranges = Vec::new();
+        for (bit, class) in classes {
+            for (first, last) in class_ranges(class) {
+                for c in first..=last.min(0xFFFF) {
+                    bmp[c as usize] |= bit;
+                }
+                if last > 0xFFFF {
+                    astral_ranges.push((first.max(0x10000), last, bit));
+                }
+            }
+        }
+
+        // Split the astral ranges at every boundary so that they no longer overlap.
+        let mut bounds: Vec<u32> = astral_ranges
+            .iter()
+            .flat_map(|&(first, last, _)| [first, last + 1])
+            .collect();
+        bounds.sort_unstable();
+        bounds.dedup();
+        let mut bits = vec![0u8; bounds.len()];
+        for &(first, last, bit) in &astral_ranges {
+            let from = bounds.binary_search(&first).unwrap();
+            let to = bounds.binary_search(&(last + 1)).unwrap();
+            for bits in &mut bits[from..to] {
+                *bits |= bit;
+            }
+        }
+        let mut astral: Vec<(u32, u32, u8)> = Vec::new();
+        for (window, &bits) in bounds.windows(2).zip(&bits) {
+            let (first, last) = (window[0], window[1] - 1);
+            match astral.last_mut() {
+                Some(prev) if prev.1 + 1 == first && prev.2 == bits => prev.1 = last,
+                _ if bits != 0 => astral.push((first, last, bits)),
+                _ => {}
+            }
+        }
+        Self { bmp, astral }
+    }
+
+    #[inline]
+    fn of(&self, c: char) -> u8 {
+        match self.bmp.get(c as usize) {
+            Some(&bits) => bits,
+            None => {
+                let c = c as u32;
+                let index = self.astral.partition_point(|&(_, last, _)| last < c);
+                match self.astral.get(index) {
+                    Some(&(first, _, bits)) if first <= c => bits,
+                    _ => 0,
+                }
+            }
+        }
+    }
+}
+
+fn class_ranges(class: &str) -> Vec<(u32, u32)> {
+    let hir = regex_syntax::Parser::new()
+        .parse(class)
+        .expect("character classes of the o200k pattern are valid");
+    match hir.kind() {
+        HirKind::Class(Class::Unicode(class)) => class
+            .ranges()
+            .iter()
+            .map(|range| (range.start() as u32, range.end() as u32))
+            .collect(),
+        _ => unreachable!("{class} is not a Unicode class"),
+    }
+}
+
+/// Iterator over the pieces the o200k pattern splits a text into; yields the same pieces as
+/// `find_iter` of the pattern.
+pub(crate) struct O200kPieces<'t> {
+    text: &'t str,
+    pos: usize,
+    classes: &'static CharClasses,
+}
+
+impl<'t> O200kPieces<'t> {
+    pub(crate) fn new(text: &'t str) -> Self {
+        Self {
+            text,
+            pos: 0,
+            classes: CharClasses::get(),
+        }
+    }
+
+    /// The character at byte offset `pos` with its class bits, or `None` at the end of the text.
+    #[inline]
+    fn char_at(&self, pos: usize) -> Option<(char, u8)> {
+        let byte = *self.text.as_bytes().get(pos)?;
+        if byte.is_ascii() {
+            return Some((byte as char, self.classes.bmp[byte as usize]));
+        }
+        let c = self.text[pos..].chars().next()?;
+        Some((c, self.classes.of(c)))
+    }
+
+    /// End of the run of characters in `class`, which has the class bits `bits`, starting
+    /// at `pos`. The ASCII part of the run is skipped by the vectorized scanner.
+    #[inline]
+    fn skip(&self, pos: usize, class: AsciiClass, bits: u8) -> usize {
+        let mut pos = ascii_scan::run_end(self.text.as_bytes(), pos, class);
+        while let Some((c, class)) = self.char_at(pos) {
+            if class & bits == 0 {
+                break;
+            }
+            pos += c.len_utf8();
+        }
+        pos
+    }
+
+    // `[^\r\n\p{L}\p{N}]?`: whether the first character can be skipped as an optional prefix.
+    fn word_starts(&self, start: usize, first: char, class: u8) -> [Option<usize>; 2] {
+        if class & (LETTER | NUMBER | NEWLINE) == 0 {
+            [Some(start + first.len_utf8()), Some(start)]
+        } else {
+            [None, Some(start)]
+        }
+    }
+
+    // `[\p{Lu}\p{Lt}\p{Lm}\p{Lo}\p{M}]*[\p{Ll}\p{Lm}\p{Lo}\p{M}]+` from `pos`.
+    fn lower_word(&self, pos: usize) -> Option<usize> {
+        // The greedy `UPPER*` backtracks to the last position from which `LOWER+` can match.
+        let mut last_lower = None;
+        // ASCII upper case letters are not `LOWER`, so they cannot be the last lower one.
+        let mut end = ascii_scan::run_end(self.text.as_bytes(), pos, AsciiClass::Upper);
+        while let Some((c, class)) = self.char_at(end) {
+            if class & UPPER == 0 {
+                break;
+            }
+            if class & LOWER != 0 {
+                last_lower = Some(end + c.len_utf8());
+            }
+            end += c.len_utf8();
+        }
+        match self.char_at(end) {
+            Some((_, class)) if class & LOWER != 0 => {
+                Some(self.skip(end, AsciiClass::Lower, LOWER))
+            }
+            // Every character after the last lower one is `UPPER` but not `LOWER`, and the
+            // character at `end` is not `LOWER`, so `LOWER+` stops right after it.
+            _ => last_lower,
+        }
+    }
+
+    // `[\p{Lu}\p{Lt}\p{Lm}\p{Lo}\p{M}]+[\p{Ll}\p{Lm}\p{Lo}\p{M}]*` from `pos`.
+    fn upper_word(&self, pos: usize) -> Option<usize> {
+        let end = self.skip(pos, AsciiClass::Upper, UPPER);
+        (end > pos).then(|| self.skip(end, AsciiClass::Lower, LOWER))
+    }
+
+    // `(?i:'s|'t|'re|'ve|'m|'ll|'d)?` from `pos`.
+    fn contraction(&self, pos: usize) -> usize {
+        let rest = &self.text[pos..];
+        let Some(rest) = rest.strip_prefix('\'') else {
+            return pos;
+        };
+        let mut chars = rest.chars().map(|c| c.to_ascii_lowercase());
+        let len = match (chars.next(), chars.next()) {
+            // U+017F LATIN SMALL LETTER LONG S case-folds to `s`.
+            (Some('s' | 't' | 'm' | 'd'), _) => rest.chars().next().unwrap().len_utf8(),
+            (Some('\u{17f}'), _) => '\u{17f}'.len_utf8(),
+            (Some('r' | 'v'), Some('e')) | (Some('l'), Some('l')) => 2,
+            _ => return pos,
+        };
+        pos + 1 + len
+    }
+
+    // ` ?[^\s\p{L}\p{N}]+[\r\n/]*`
+    fn punctuation(&self, start: usize, first: char) -> Option<usize> {
+        let pos = if first == ' ' { start + 1 } else { start };
+        let end = self.skip_other(pos);
+        if end == pos {
+            return None;
+        }
+        let trailing = self.text[end..]
+            .bytes()
+            .take_while(|b| matches!(b, b'\r' | b'\n' | b'/'))
+            .count();
+        Some(end + trailing)
+    }
+
+    // End of the run of `[^\s\p{L}\p{N}]` characters starting at `pos`.
+    fn skip_other(&self, pos: usize) -> usize {
+        let mut pos = ascii_scan::run_end(self.text.as_bytes(), pos, AsciiClass::Other);
+        while let Some((c, class)) = self.char_at(pos) {
+            if class & (SPACE | LETTER | NUMBER) != 0 {
+                break;
+            }
+            pos += c.len_utf8();
+        }
+        pos
+    }
+
+    // `\s*[\r\n]+|\s+(?!\S)|\s+`
+    fn whitespace(&self, start: usize) -> usize {
+        let bytes = self.text.as_bytes();
+        let mut end = start;
+        let mut last_newline_end = None;
+        let mut last_char_start = start;
+        loop {
+            let ascii_end = ascii_scan::run_end(bytes, end, AsciiClass::Space);
+            if ascii_end > end {
+                if let Some(i) = bytes[end..ascii_end]
+                    .iter()
+                    .rposition(|&b| b == b'\r' || b == b'\n')
+                {
+                    last_newline_end = Some(end + i + 1);
+                }
+                last_char_start = ascii_end - 1;
+                end = ascii_end;
+            }
+            // Only non-ASCII spaces can continue the run; none of them is a newline.
+            match self.char_at(end) {
+                Some((c, class)) if class & SPACE != 0 => {
+                    last_char_start = end;
+                    end += c.len_utf8();
+                }
+                _ => break,
+            }
+        }
+        if let Some(newline_end) = last_newline_end {
+            // `\s*` backtracks to the last newline, which `[\r\n]+` then matches alone.
+            return newline_end;
+        }
+        if end == self.text.len() || last_char_start == start {
+            end
+        } else {
+            // Leave the last space to the following piece, so that `(?!\S)` holds.
+            last_char_start
+        }
+    }
+
+    fn piece_end(&self, start: usize) -> usize {
+        let (first, class) = self.char_at(start).unwrap();
+        let starts = self.word_starts(start, first, class);
+        for pos in starts.into_iter().flatten() {
+            if let Some(end) = self.lower_word(pos) {
+                return self.contraction(end);
+            }
+        }
+        for pos in starts.into_iter().flatten() {
+            if let Some(end) = self.upper_word(pos) {
+                return self.contraction(end);
+            }
+        }
+        if class & NUMBER != 0 {
+            let mut end = start;
+            for _ in 0..3 {
+                match self.char_at(end) {
+                    Some((c, class)) if class & NUMBER != 0 => end += c.len_utf8(),
+                    _ => break,
+                }
+            }
+            return end;
+        }
+        if let Some(end) = self.punctuation(start, first) {
+            return end;
+        }
+        // Every character that is not matched above is whitespace.
+        debug_assert!(class & SPACE != 0);
+        self.whitespace(start)
+    }
+}
+
+impl<'t> Iterator for O200kPieces<'t> {
+    type Item = &'t str;
+
+    fn next(&mut self) -> Option<&'t str> {
+        if self.pos == self.text.len() {
+            return None;
+        }
+        let start = self.pos;
+        self.pos = self.piece_end(start);
+        Some(&self.text[start..self.pos])
+    }
+}
+
+/// Split `text` into chunks of at least `target_len` bytes (except the last) that the o200k
+/// pattern splits into the same pieces on their own as it does within `text`.
+///
+/// Chunks end between an ASCII letter and a following ASCII character that is neither a letter
+/// nor an apostrophe: no alternative of the pattern matches across such a position, so it is
+/// always a piece boundary, and nothing after it influences the pieces before it. Text
+/// without such positions stays in one chunk.
+pub(crate) fn o200k_chunks(text: &str, target_len: usize) -> Vec<&str> {
+    let bytes = text.as_bytes();
+    let mut chunks = Vec::new();
+    let mut start = 0;
+    while text.len() - start > target_len {
+        let from = start + target_len.max(1);
+        let Some(end) = (from..bytes.len()).find(|&pos| {
+            bytes[pos - 1].is_ascii_alphabetic()
+                && bytes[pos].is_ascii()
+                && !bytes[pos].is_ascii_alphabetic()
+                && bytes[pos] != b'\''
+        }) else {
+            break;
+        };
+        chunks.push(&text[start..end]);
+        start = end;
+    }
+    chunks.push(&text[start..]);
+    chunks
+}
@@ -19,7 +19,7 @@ use pyo3::create_exception;
 use pyo3::exceptions::PyRuntimeError;
 use pyo3::Python;
 
-use pyo3::types::{PyAny, PyDict, PyModule};
+use pyo3::types::{PyAny, PyDict, PyModule, PyString};
 use pyo3::Bound;
 
 // Define a custom Python exception so users can catch Harmony specific errors.
@@ -27,14 +27,17 @@ create_exception!(openai_harmony, HarmonyError, PyRuntimeError);
 
 use crate::{
     chat::{Message, Role, ToolNamespaceConfig},
-    encoding::{HarmonyEncoding, ParseOptions, StreamableParser},
-    load_harmony_encoding, HarmonyEncodingName,
+    encoding::{HarmonyEncoding, ParseOptions, ParserCheckpoint, ParserEvent, StreamableParser},
+    load_harmony_encoding,
+    tiktoken::SpecialPolicyCache,
+    HarmonyEncodingName,
 };
 
 /// A thin PyO3 wrapper around the Rust `HarmonyEncoding` struct.
 #[pyclass]
 struct PyHarmonyEncoding {
     inner: HarmonyEncoding,
+    policies: SpecialPolicyCache,
 }
 
 /// Streaming parser exposed to Python.
@@ -43,6 +46,12 @@ struct PyStreamableParser {
     inner: StreamableParser,
 }
 
+/// Opaque parser position returned by `PyStreamableParser.checkpoint`.
+#[pyclass]
+struct PyParserCheckpoint {
+    inner: ParserCheckpoint,
+}
+
 #[pyclass]
 pub enum PyStreamState {
     ExpectStart,
@@ -53,14 +62,22 @@ pub enum PyStreamState {
 #[pymethods]
 impl PyHarmonyEncoding {
     /// Create a new `HarmonyEncoding` by name.
+    ///
+    /// Encodings are loaded once per process; later calls share the loaded encoding.
     #[new]
-    fn new(name: &str) -> PyResult<Self> {
+    fn new(py: Python<'_>, name: &str) -> PyResult<Self> {
         let parsed: HarmonyEncodingName = name
             .parse::<HarmonyEncodingName>()
             .map_err(|e| PyErr::new::<pyo3::exceptions::PyValueError, _>(e.to_string()))?;
-        let encoding = load_harmony_encoding(parsed)
+        // Release the GIL while loading, so that other threads can run while the first
+        // load of an encoding reads its vocabulary.
+        let encoding = py
+            .allow_threads(|| load_harmony_encoding(parsed))
             .map_err(|e| PyErr::new::<HarmonyError, _>(e.to_string()))?;
-        Ok(Self { inner: encoding })
+        Ok(Self {
+            inner: encoding,
+            policies: SpecialPolicyCache::default(),
+        })
     }
 
     /// Return the name of the encoding.
@@ -262,9 +279,33 @@ impl PyHarmonyEncoding {
             })?,
             None => Vec::new(),
         };
-        let allowed_set: std::collections::HashSet<&str> =
-            allowed_vec.iter().map(|s| s.as_str()).collect();
-        Ok(self.inner.tokenizer().encode(text, &allowed_set).0)
+        let tokenizer = self.inner.tokenizer();
+        let policy = self
+            .policies
+            .get(tokenizer, allowed_vec.iter().map(String::as_str));
+        Ok(tokenizer.encode_with_policy(text, &policy).0)
+    }
+
+    /// Encode many texts in parallel with the same set of allowed special tokens. The GIL is
+    /// released while encoding.
+    fn encode_batch(
+        &self,
+        py: Python<'_>,
+        texts: Vec<String>,
+        allowed_special: Option<Vec<String>>,
+    ) -> PyResult<Vec<Vec<u32>>> {
+        let encoding = &self.inner;
+        let policy = self.policies.get(
+            encoding.tokenizer(),
+            allowed_special.iter().flatten().map(String::as_str),
+        );
+        Ok(py.allow_threads(|| encoding.encode_batch(&texts, &policy)))
+    }
+
+    /// Encode many texts in parallel as plain text. The GIL is released while encoding.
+    fn encode_ordinary_batch(&self, py: Python<'_>, texts: Vec<String>) -> Vec<Vec<u32>> {
+        let encoding = &self.inner;
+        py.allow_threads(|| encoding.encode_ordinary_batch(&texts))
     }
 
     /// Return the list of special tokens for this tokenizer.
@@ -330,6 +371,17 @@ impl PyStreamableParser {
             .map_err(|e| PyErr::new::<HarmonyError, _>(e.to_string()))
     }
 
+    /// Process a batch of tokens and return a JSON summary of the changes.
+    fn process_many(&mut self, tokens: Vec<u32>) -> PyResult<String> {
+        let summary = self
+            .inner
+            .process_many(&tokens)
+            .map_err(|e| PyErr::new::<HarmonyError, _>(e.to_string()))?;
+        serde_json::to_string(&summary).map_err(|e| {
+            PyErr::new::<HarmonyError, _>(format!("failed to serialise summary to JSON: {e}"))
+        })
+    }
+
     fn process_eos(&mut self) -> PyResult<()> {
         self.inner
             .process_eos()
@@ -337,13 +389,66 @@ impl PyStreamableParser {
             .map_err(|e| PyErr::new::<HarmonyError, _>(e.to_string()))
     }
 
-    #[getter]
-    fn current_content(&self) -> PyResult<String> {
+    /// Process a batch of tokens and return the parser events as tuples.
+    fn process_events(&mut self, py: Python<'_>, tokens: Vec<u32>) -> PyResult<Vec<PyObject>> {
+        let mut events = Vec::new();
+        let mut error = None;
         self.inner
-            .current_content()
+            .process_many_with_events(&tokens, |event| {
+                if error.is_none() {
+                    match event_to_py(py, event) {
+                        Ok(event) => events.push(event),
+                        Err(e) => error = Some(e),
+                    }
+                }
+            })
+            .map_err(|e| PyErr::new::<HarmonyError, _>(e.to_string()))?;
+        error.map_or(Ok(events), Err)
+    }
+
+    fn process_eos_events(&mut self, py: Python<'_>) -> PyResult<Vec<PyObject>> {
+        let mut events = Vec::new();
+        let mut error = None;
+        self.inner
+            .process_eos_with_events(|event| {
+                if error.is_none() {
+                    match event_to_py(py, event) {
+                        Ok(event) => events.push(event),
+                        Err(e) => error = Some(e),
+                    }
+                }
+            })
+            .map_err(|e| PyErr::new::<HarmonyError, _>(e.to_string()))?;
+        error.map_or(Ok(events), Err)
+    }
+
+    /// Split off a parser that continues independently from the current
+    /// position, sharing the already parsed history.
+    fn fork(&mut self) -> Self {
+        Self {
+            inner: self.inner.fork(),
+        }
+    }
+
+    /// Record the current position so that it can be restored with `rollback`.
+    fn checkpoint(&self) -> PyParserCheckpoint {
+        PyParserCheckpoint {
+            inner: self.inner.checkpoint(),
+        }
+    }
+
+    /// Undo all tokens processed since `checkpoint` was taken.
+    fn rollback(&mut self, checkpoint: &PyParserCheckpoint) -> PyResult<()> {
+        self.inner
+            .rollback(&checkpoint.inner)
             .map_err(|e| PyErr::new::<HarmonyError, _>(e.to_string()))
     }
 
+    #[getter]
+    fn current_content<'py>(&self, py: Python<'py>) -> Bound<'py, PyString> {
+        PyString::new(py, self.inner.current_content_str())
+    }
+
     #[getter]
     fn current_role(&self) -> Option<String> {
         self.inner.current_role().map(|r| r.as_str().to_string())
@@ -355,15 +460,15 @@ impl PyStreamableParser {
     }
 
     #[getter]
-    fn last_content_delta(&self) -> PyResult<Option<String>> {
+    fn last_content_delta<'py>(&self, py: Python<'py>) -> Option<Bound<'py, PyString>> {
         self.inner
-            .last_content_delta()
-            .map_err(|e| PyErr::new::<HarmonyError, _>(e.to_string()))
+            .last_content_delta_str()
+            .map(|delta| PyString::new(py, delta))
     }
 
     #[getter]
     fn messages(&self) -> PyResult<String> {
-        serde_json::to_string(self.inner.messages()).map_err(|e| {
+        serde_json::to_string(&self.inner.messages()).map_err(|e| {
             PyErr::new::<HarmonyError, _>(format!("failed to serialise messages to JSON: {e}"))
         })
     }
@@ -391,12 +496,33 @@ impl PyStreamableParser {
     }
 }
 
+/// Convert a parser event into a tuple tagged with the event kind; the typed
+/// event classes are built from these on the Python side.
+fn event_to_py(py: Python<'_>, event: ParserEvent<'_>) -> PyResult<PyObject> {
+    let event = match event {
+        ParserEvent::MessageStart { role, name } => ("message_start", role.as_str(), name)
+            .into_pyobject(py)?
+            .into_any(),
+        ParserEvent::HeaderComplete {
+            channel,
+            recipient,
+            content_type,
+        } => ("header_complete", channel, recipient, content_type)
+            .into_pyobject(py)?
+            .into_any(),
+        ParserEvent::ContentDelta(delta) => ("content_delta", delta).into_pyobject(py)?.into_any(),
+        ParserEvent::MessageEnd => ("message_end",).into_pyobject(py)?.into_any(),
+    };
+    Ok(event.unbind())
+}
+
 /// Python module definition.
 #[pymodule]
 fn openai_harmony(_py: Python<'_>, m: &Bound<'_, PyModule>) -> PyResult<()> {
     // Register the PyHarmonyEncoding class.
     m.add_class::<PyHarmonyEncoding>()?;
     m.add_class::<PyStreamableParser>()?;
+    m.add_class::<PyParserCheckpoint>()?;
     m.add_class::<PyStreamState>()?;
     m.add("HarmonyError", _py.get_type::<HarmonyError>())?;
 
@@ -404,11 +530,18 @@ fn openai_harmony(_py: Python<'_>, m: &Bound<'_, PyModule>) -> PyResult<()> {
     // returning an *instance* of `PyHarmonyEncoding`.
     #[pyfunction(name = "load_harmony_encoding")]
     fn load_harmony_encoding_py(py: Python<'_>, name: &str) -> PyResult<Py<PyHarmonyEncoding>> {
-        let enc = PyHarmonyEncoding::new(name)?;
+        let enc = PyHarmonyEncoding::new(py, name)?;
         Py::new(py, enc)
     }
     m.add_function(pyo3::wrap_pyfunction!(load_harmony_encoding_py, m)?)?;
 
+    #[pyfunction(name = "warm_up")]
+    fn warm_up_py(py: Python<'_>) -> PyResult<()> {
+        py.allow_threads(crate::warm_up)
+            .map_err(|e| PyErr::new::<HarmonyError, _>(e.to_string()))
+    }
+    m.add_function(pyo3::wrap_pyfunction!(warm_up_py, m)?)?;
+
     // Convenience functions to get the tool configs for the browser and python tools.
     #[pyfunction]
     fn get_tool_namespace_config(py: Python<'_>, tool: &str) -> PyResult<PyObject> {
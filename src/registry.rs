@@ -1,10 +1,10 @@
-use std::{
-    collections::{HashMap, HashSet},
-    sync::Arc,
-};
+#[cfg(not(target_arch = "wasm32"))]
+use std::sync::{Mutex, OnceLock, PoisonError};
+use std::{collections::HashMap, sync::Arc};
 
 use crate::{
-    encoding::{FormattingToken, HarmonyEncoding},
+    encoding::{FormattingToken, FormattingTokenTable, HarmonyEncoding, HarmonyEncodingInner},
+    tiktoken::CoreBPE,
     tiktoken_ext,
 };
 
@@ -41,42 +41,64 @@ impl std::fmt::Debug for HarmonyEncodingName {
     }
 }
 
+#[cfg(not(target_arch = "wasm32"))]
+impl HarmonyEncodingName {
+    const ALL: &'static [Self] = &[Self::HarmonyGptOss];
+}
+
+// The encodings loaded so far. Each name has its own slot, so that loading one encoding does
+// not hold up callers that want another.
+#[cfg(not(target_arch = "wasm32"))]
+type Registry = HashMap<HarmonyEncodingName, Arc<Mutex<Option<HarmonyEncoding>>>>;
+
+/// Load a predefined encoding by name.
+///
+/// Encodings are loaded once per process and shared: every call with the same name returns a
+/// clone of the same `HarmonyEncoding`, which shares its tokenizer behind an `Arc`. Callers
+/// that ask for an encoding while it is being loaded wait for that load instead of starting
+/// their own. A failed load is not remembered, so the next call tries again.
 #[cfg(not(target_arch = "wasm32"))]
 pub fn load_harmony_encoding(name: HarmonyEncodingName) -> anyhow::Result<HarmonyEncoding> {
+    static REGISTRY: OnceLock<Mutex<Registry>> = OnceLock::new();
+    let slot = REGISTRY
+        .get_or_init(Default::default)
+        .lock()
+        .unwrap_or_else(PoisonError::into_inner)
+        .entry(name)
+        .or_default()
+        .clone();
+    // A load that panicked leaves the slot empty, so a poisoned slot is safe to use.
+    let mut slot = slot.lock().unwrap_or_else(PoisonError::into_inner);
+    if let Some(encoding) = &*slot {
+        return Ok(encoding.clone());
+    }
+    let encoding = load_harmony_encoding_uncached(name)?;
+    *slot = Some(encoding.clone());
+    Ok(encoding)
+}
+
+/// Load every predefined encoding ahead of time, e.g. while a server boots or before it forks
+/// its workers, so that no request pays for the first load. Workers that start cold and load an
+/// encoding at the same time wait for one of them to build its snapshot, but only on Unix;
+/// elsewhere, call this before forking so that they do not each build it.
+#[cfg(not(target_arch = "wasm32"))]
+pub fn warm_up() -> anyhow::Result<()> {
+    for &name in HarmonyEncodingName::ALL {
+        let encoding = load_harmony_encoding(name)?;
+        // Touch the tables that every encode uses.
+        encoding
+            .tokenizer()
+            .encode_with_special_tokens("<|start|>user<|message|>Hello, world!<|end|>");
+    }
+    Ok(())
+}
+
+#[cfg(not(target_arch = "wasm32"))]
+fn load_harmony_encoding_uncached(name: HarmonyEncodingName) -> anyhow::Result<HarmonyEncoding> {
     match name {
         HarmonyEncodingName::HarmonyGptOss => {
-            let n_ctx = 1_048_576; // 2^20
-            let max_action_length = 524_288; // 2^19
             let encoding_ext = tiktoken_ext::Encoding::O200kHarmony;
-            Ok(HarmonyEncoding {
-                name: name.to_string(),
-                n_ctx,
-                tokenizer: Arc::new(encoding_ext.load()?),
-                tokenizer_name: encoding_ext.name().to_owned(),
-                max_message_tokens: n_ctx - max_action_length,
-                max_action_length,
-                format_token_mapping: make_mapping([
-                    (FormattingToken::Start, "<|start|>"),
-                    (FormattingToken::Message, "<|message|>"),
-                    (FormattingToken::EndMessage, "<|end|>"),
-                    (FormattingToken::EndMessageDoneSampling, "<|return|>"),
-                    (FormattingToken::Refusal, "<|refusal|>"),
-                    (FormattingToken::ConstrainedFormat, "<|constrain|>"),
-                    (FormattingToken::Channel, "<|channel|>"),
-                    (FormattingToken::EndMessageAssistantToTool, "<|call|>"),
-                    (FormattingToken::BeginUntrusted, "<|untrusted|>"),
-                    (FormattingToken::EndUntrusted, "<|end_untrusted|>"),
-                ]),
-                stop_formatting_tokens: HashSet::from([
-                    FormattingToken::EndMessageDoneSampling,
-                    FormattingToken::EndMessageAssistantToTool,
-                    FormattingToken::EndMessage,
-                ]),
-                stop_formatting_tokens_for_assistant_actions: HashSet::from([
-                    FormattingToken::EndMessageDoneSampling,
-                    FormattingToken::EndMessageAssistantToTool,
-                ]),
-            })
+            build_harmony_gpt_oss(name, encoding_ext, encoding_ext.load()?)
         }
     }
 }
@@ -85,43 +107,58 @@ pub fn load_harmony_encoding(name: HarmonyEncodingName) -> anyhow::Result<Harmon
 pub async fn load_harmony_encoding(name: HarmonyEncodingName) -> anyhow::Result<HarmonyEncoding> {
     match name {
         HarmonyEncodingName::HarmonyGptOss => {
-            let n_ctx = 1_048_576; // 2^20
-            let max_action_length = 524_288; // 2^19
             let encoding_ext = tiktoken_ext::Encoding::O200kHarmony;
-            Ok(HarmonyEncoding {
-                name: name.to_string(),
-                n_ctx,
-                tokenizer: Arc::new(encoding_ext.load().await?),
-                tokenizer_name: encoding_ext.name().to_owned(),
-                max_message_tokens: n_ctx - max_action_length,
-                max_action_length,
-                format_token_mapping: make_mapping([
-                    (FormattingToken::Start, "<|start|>"),
-                    (FormattingToken::Message, "<|message|>"),
-                    (FormattingToken::EndMessage, "<|end|>"),
-                    (FormattingToken::EndMessageDoneSampling, "<|return|>"),
-                    (FormattingToken::Refusal, "<|refusal|>"),
-                    (FormattingToken::ConstrainedFormat, "<|constrain|>"),
-                    (FormattingToken::Channel, "<|channel|>"),
-                    (FormattingToken::EndMessageAssistantToTool, "<|call|>"),
-                    (FormattingToken::BeginUntrusted, "<|untrusted|>"),
-                    (FormattingToken::EndUntrusted, "<|end_untrusted|>"),
-                ]),
-                stop_formatting_tokens: HashSet::from([
-                    FormattingToken::EndMessageDoneSampling,
-                    FormattingToken::EndMessageAssistantToTool,
-                    FormattingToken::EndMessage,
-                ]),
-                stop_formatting_tokens_for_assistant_actions: HashSet::from([
-                    FormattingToken::EndMessageDoneSampling,
-                    FormattingToken::EndMessageAssistantToTool,
-                ]),
-                conversation_has_function_tools: Arc::new(AtomicBool::new(false)),
-            })
+            build_harmony_gpt_oss(name, encoding_ext, encoding_ext.load().await?)
         }
     }
 }
 
+fn build_harmony_gpt_oss(
+    name: HarmonyEncodingName,
+    encoding_ext: tiktoken_ext::Encoding,
+    tokenizer: CoreBPE,
+) -> anyhow::Result<HarmonyEncoding> {
+    let n_ctx = 1_048_576; // 2^20
+    let max_action_length = 524_288; // 2^19
+    let format_token_mapping = make_mapping([
+        (FormattingToken::Start, "<|start|>"),
+        (FormattingToken::Message, "<|message|>"),
+        (FormattingToken::EndMessage, "<|end|>"),
+        (FormattingToken::EndMessageDoneSampling, "<|return|>"),
+        (FormattingToken::Refusal, "<|refusal|>"),
+        (FormattingToken::ConstrainedFormat, "<|constrain|>"),
+        (FormattingToken::Channel, "<|channel|>"),
+        (FormattingToken::EndMessageAssistantToTool, "<|call|>"),
+        (FormattingToken::BeginUntrusted, "<|untrusted|>"),
+        (FormattingToken::EndUntrusted, "<|end_untrusted|>"),
+    ]);
+    // Resolve formatting and stop tokens once here so that rendering and
+    // parsing never have to go back through the tokenizer for them.
+    let format_token_ranks = FormattingTokenTable::new(&tokenizer, &format_token_mapping);
+    let stop_token_ranks = format_token_ranks.resolve_stop_tokens([
+        FormattingToken::EndMessageDoneSampling,
+        FormattingToken::EndMessageAssistantToTool,
+        FormattingToken::EndMessage,
+    ])?;
+    let stop_token_ranks_for_assistant_actions = format_token_ranks.resolve_stop_tokens([
+        FormattingToken::EndMessageDoneSampling,
+        FormattingToken::EndMessageAssistantToTool,
+    ])?;
+    Ok(HarmonyEncodingInner {
+        name: name.to_string(),
+        n_ctx,
+        tokenizer: Arc::new(tokenizer),
+        tokenizer_name: encoding_ext.name().to_owned(),
+        max_message_tokens: n_ctx - max_action_length,
+        max_action_length,
+        format_token_mapping,
+        format_token_ranks,
+        stop_token_ranks,
+        stop_token_ranks_for_assistant_actions,
+    }
+    .into())
+}
+
 fn make_mapping<I>(iter: I) -> HashMap<FormattingToken, String>
 where
     I: IntoIterator<Item = (FormattingToken, &'static str)>,
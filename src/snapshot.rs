@@ -0,0 +1,243 @@
+//! Binary snapshots of the tables of a `CoreBPE`.
+//!
+//! Building an encoder from a `.tiktoken` file decodes and hashes every token, and builds the
+//! merge table from every way of splitting every token. A snapshot stores the finished tables
+//! as raw arrays, so loading one is a memory map and a few bounds checks.
+//!
+//! A snapshot is a header followed by a sequence of scalars and arrays, in the order the
+//! encoder writes them. Every item starts at a multiple of 8 bytes, so arrays can be used in
+//! place. The data is in native byte order; the header records it, and a snapshot written on
+//! a machine with another byte order is rejected like any other mismatch.
+//!
+//! The header also holds a key that identifies everything the tables were built from; a
+//! snapshot whose key does not match the expected one is not used. Last comes the SHA-256
+//! digest of everything after the header, which catches a snapshot that was truncated or
+//! damaged after it was written. Checking it reads the whole snapshot, so callers decide when
+//! it is needed (see `check_digest`).
+//!
+//! Snapshots are normally cached next to the downloaded vocabulary files. With the
+//! `embedded-vocab` feature, `build.rs` can also compile one into the crate, so that the encoder
+//! it holds loads without any I/O at all.
+
+use std::io::{Error, ErrorKind};
+use std::path::Path;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+
+use sha2::{Digest as _, Sha256};
+
+use crate::table::{Buffer, MappedFile, Pod, Table};
+
+include!("snapshot_format.rs");
+const KEY_START: usize = 8 + 4 + 4;
+const DIGEST_START: usize = KEY_START + 32;
+const HEADER_LEN: usize = DIGEST_START + 32;
+
+/// The snapshot that `build.rs` compiled into the crate, if any.
+#[cfg(harmony_embedded_snapshot)]
+pub(crate) static EMBEDDED_SNAPSHOT: Option<&[u8]> = Some(&EMBEDDED.0);
+#[cfg(not(harmony_embedded_snapshot))]
+pub(crate) static EMBEDDED_SNAPSHOT: Option<&[u8]> = None;
+
+// Tables are used in place, so the snapshot must be aligned like a mapped file.
+#[cfg(harmony_embedded_snapshot)]
+#[repr(C, align(8))]
+struct Aligned<T: ?Sized>(T);
+
+#[cfg(harmony_embedded_snapshot)]
+static EMBEDDED: &Aligned<[u8]> = &Aligned(*include_bytes!(env!("HARMONY_EMBEDDED_SNAPSHOT_PATH")));
+
+/// Identifies the inputs of a snapshot.
+pub(crate) type SnapshotKey = [u8; 32];
+
+/// The key of a snapshot of the encoder built from the vocabulary file with SHA-256 `vocab_hash`
+/// and the given special tokens and pattern, by this version of the crate.
+pub(crate) fn snapshot_key<'a>(
+    vocab_hash: &str,
+    special_tokens: impl IntoIterator<Item = (&'a str, u32)>,
+    pattern: &str,
+) -> SnapshotKey {
+    let mut hasher = Sha256::new();
+    let mut field = |bytes: &[u8]| {
+        hasher.update((bytes.len() as u64).to_le_bytes());
+        hasher.update(bytes);
+    };
+    field(env!("CARGO_PKG_VERSION").as_bytes());
+    field(&FORMAT_VERSION.to_le_bytes());
+    field(vocab_hash.as_bytes());
+    let mut special_tokens: Vec<_> = special_tokens.into_iter().collect();
+    special_tokens.sort_unstable();
+    for (token, rank) in special_tokens {
+        field(token.as_bytes());
+        field(&rank.to_le_bytes());
+    }
+    field(pattern.as_bytes());
+    hasher.finalize().into()
+}
+
+/// The name under which the snapshot with `key` is cached.
+pub(crate) fn snapshot_file_name(key: &SnapshotKey) -> String {
+    format!("{}.harmony-bpe", hex(key))
+}
+
+/// The key in the header of the snapshot in `bytes`. Nothing else is checked, so that a snapshot
+/// can be told apart from a snapshot of something else even when it cannot be read.
+pub(crate) fn header_key(bytes: &[u8]) -> Option<&SnapshotKey> {
+    if bytes.get(..8)? != MAGIC {
+        return None;
+    }
+    bytes.get(KEY_START..DIGEST_START)?.try_into().ok()
+}
+
+fn hex(bytes: &[u8]) -> String {
+    bytes.iter().map(|byte| format!("{byte:02x}")).collect()
+}
+
+fn invalid(message: &str) -> Error {
+    Error::new(
+        ErrorKind::InvalidData,
+        format!("invalid snapshot: {message}"),
+    )
+}
+
+pub(crate) struct SnapshotWriter {
+    buf: Vec<u8>,
+}
+
+impl SnapshotWriter {
+    pub(crate) fn new(key: &SnapshotKey) -> Self {
+        let mut buf = Vec::with_capacity(HEADER_LEN);
+        buf.extend_from_slice(MAGIC);
+        buf.extend_from_slice(&FORMAT_VERSION.to_ne_bytes());
+        buf.extend_from_slice(&BYTE_ORDER_MARK.to_ne_bytes());
+        buf.extend_from_slice(key);
+        // The digest, filled in by `finish`.
+        buf.resize(HEADER_LEN, 0);
+        Self { buf }
+    }
+
+    pub(crate) fn scalar(&mut self, value: u64) {
+        self.align();
+        self.buf.extend_from_slice(&value.to_ne_bytes());
+    }
+
+    pub(crate) fn table<T: Pod>(&mut self, items: &Table<T>) {
+        self.scalar(items.len() as u64);
+        self.align();
+        self.buf.extend_from_slice(items.as_bytes());
+    }
+
+    fn align(&mut self) {
+        self.buf.resize(self.buf.len().next_multiple_of(8), 0);
+    }
+
+    /// Write the snapshot to `path`. The data goes to a temporary file that is then renamed
+    /// over `path`, so readers never see a partial snapshot, and processes that have the old
+    /// one mapped keep it.
+    pub(crate) fn finish(mut self, path: &Path) -> std::io::Result<()> {
+        let digest = Sha256::digest(&self.buf[HEADER_LEN..]);
+        self.buf[DIGEST_START..HEADER_LEN].copy_from_slice(&digest);
+        // Unique to this call, so that threads and processes writing the same snapshot at once
+        // each write their own temporary file.
+        static WRITES: AtomicU64 = AtomicU64::new(0);
+        let mut tmp_name = path.file_name().unwrap_or_default().to_owned();
+        tmp_name.push(format!(
+            ".{}.{}.tmp",
+            std::process::id(),
+            WRITES.fetch_add(1, Ordering::Relaxed)
+        ));
+        let tmp_path = path.with_file_name(tmp_name);
+        std::fs::write(&tmp_path, &self.buf)
+            .and_then(|()| std::fs::rename(&tmp_path, path))
+            .inspect_err(|_| {
+                let _ = std::fs::remove_file(&tmp_path);
+            })
+    }
+}
+
+pub(crate) struct SnapshotReader<B = MappedFile> {
+    buffer: Arc<B>,
+    pos: usize,
+}
+
+impl SnapshotReader {
+    /// Map the snapshot at `path`, checking that its header matches `key`.
+    pub(crate) fn open(path: &Path, key: &SnapshotKey) -> std::io::Result<Self> {
+        Self::new(MappedFile::open(path)?, key)
+    }
+}
+
+impl<B: Buffer> SnapshotReader<B> {
+    /// Read the snapshot in `buffer`, checking that its header matches `key`. The data is not
+    /// checked against the digest; see `check_digest`.
+    pub(crate) fn new(buffer: B, key: &SnapshotKey) -> std::io::Result<Self> {
+        if buffer.bytes().as_ptr().align_offset(8) != 0 {
+            return Err(invalid("misaligned"));
+        }
+        let header = buffer
+            .bytes()
+            .get(..HEADER_LEN)
+            .ok_or_else(|| invalid("truncated header"))?;
+        if &header[..8] != MAGIC {
+            return Err(invalid("bad magic"));
+        }
+        if header[8..12] != FORMAT_VERSION.to_ne_bytes()
+            || header[12..16] != BYTE_ORDER_MARK.to_ne_bytes()
+        {
+            return Err(invalid("unsupported format version or byte order"));
+        }
+        if &header[KEY_START..DIGEST_START] != key {
+            return Err(invalid("built from different inputs"));
+        }
+        Ok(Self {
+            buffer: Arc::new(buffer),
+            pos: HEADER_LEN,
+        })
+    }
+
+    /// The SHA-256 digest of the data that the header records, in hex.
+    pub(crate) fn digest(&self) -> String {
+        hex(&self.buffer.bytes()[DIGEST_START..HEADER_LEN])
+    }
+
+    /// Check the data against the digest in the header. This reads the whole snapshot.
+    pub(crate) fn check_digest(&self) -> std::io::Result<()> {
+        let bytes = self.buffer.bytes();
+        if Sha256::digest(&bytes[HEADER_LEN..])[..] != bytes[DIGEST_START..HEADER_LEN] {
+            return Err(invalid("data does not match its digest"));
+        }
+        Ok(())
+    }
+
+    pub(crate) fn scalar(&mut self) -> std::io::Result<u64> {
+        self.align();
+        let bytes = self
+            .buffer
+            .bytes()
+            .get(self.pos..self.pos + 8)
+            .ok_or_else(|| invalid("truncated"))?;
+        self.pos += 8;
+        Ok(u64::from_ne_bytes(bytes.try_into().unwrap()))
+    }
+
+    pub(crate) fn table<T: Pod>(&mut self) -> std::io::Result<Table<T>> {
+        let len = usize::try_from(self.scalar()?).map_err(|_| invalid("table too long"))?;
+        self.align();
+        let table =
+            Table::mapped(&self.buffer, self.pos, len).ok_or_else(|| invalid("truncated"))?;
+        self.pos += std::mem::size_of_val::<[T]>(&table);
+        Ok(table)
+    }
+
+    fn align(&mut self) {
+        self.pos = self.pos.next_multiple_of(8);
+    }
+
+    /// Check that the whole snapshot has been read.
+    pub(crate) fn finish(self) -> std::io::Result<()> {
+        if self.pos != self.buffer.bytes().len() {
+            return Err(invalid("trailing data"));
+        }
+        Ok(())
+    }
+}
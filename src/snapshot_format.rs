@@ -0,0 +1,7 @@
+// The start of a snapshot header. Included by `snapshot.rs` and by `build.rs`, which checks the
+// snapshot that it compiles into the crate against it.
+
+const MAGIC: &[u8; 8] = b"HRMNYBPE";
+// Bump this whenever the layout of any snapshotted table changes.
+const FORMAT_VERSION: u32 = 2;
+const BYTE_ORDER_MARK: u32 = 0x0102_0304;
@@ -0,0 +1,198 @@
+//! Immutable arrays that are either owned or borrowed from a memory-mapped file or from data
+//! compiled into the binary.
+//!
+//! The large tables of a `CoreBPE` are `Table`s, so that an encoder loaded from a snapshot
+//! (see `snapshot.rs`) reads them straight from the page cache instead of copying them.
+
+use std::fs::File;
+use std::ops::Deref;
+use std::path::Path;
+use std::ptr::NonNull;
+use std::sync::Arc;
+
+/// Plain old data: types without padding for which every bit pattern is a valid value, so
+/// that they can be stored as raw bytes and read back.
+///
+/// # Safety
+///
+/// Implementors must be `Copy`, have no padding and accept every bit pattern, and their
+/// alignment must be at most 8.
+pub(crate) unsafe trait Pod: Copy + Send + Sync + 'static {}
+
+unsafe impl Pod for u8 {}
+unsafe impl Pod for u32 {}
+unsafe impl Pod for u64 {}
+
+/// A shared, immutable `[T]`. Clones share the elements.
+pub(crate) struct Table<T: Pod> {
+    ptr: NonNull<T>,
+    len: usize,
+    // Keeps the memory behind `ptr` alive.
+    _owner: Arc<dyn Send + Sync>,
+}
+
+// A `Table` is an immutable slice.
+unsafe impl<T: Pod> Send for Table<T> {}
+unsafe impl<T: Pod> Sync for Table<T> {}
+
+/// Memory that tables can borrow from.
+pub(crate) trait Buffer: Send + Sync + 'static {
+    fn bytes(&self) -> &[u8];
+}
+
+impl Buffer for &'static [u8] {
+    fn bytes(&self) -> &[u8] {
+        self
+    }
+}
+
+impl<T: Pod> Table<T> {
+    /// Elements `start..start + len` of `buffer`, reinterpreted as `T`s. `None` if they are
+    /// out of bounds or misaligned.
+    pub(crate) fn mapped<B: Buffer>(buffer: &Arc<B>, start: usize, len: usize) -> Option<Self> {
+        let size = len.checked_mul(std::mem::size_of::<T>())?;
+        let bytes = buffer.bytes().get(start..start.checked_add(size)?)?;
+        let ptr = NonNull::new(bytes.as_ptr() as *mut T)?;
+        if ptr.as_ptr().align_offset(std::mem::align_of::<T>()) != 0 {
+            return None;
+        }
+        Some(Self {
+            ptr,
+            len,
+            _owner: buffer.clone(),
+        })
+    }
+
+    /// The elements as raw bytes, in native byte order.
+    pub(crate) fn as_bytes(&self) -> &[u8] {
+        // SAFETY: `T: Pod` has no padding, so every byte of the slice is initialised.
+        unsafe {
+            std::slice::from_raw_parts(
+                self.ptr.as_ptr() as *const u8,
+                std::mem::size_of_val::<[T]>(self),
+            )
+        }
+    }
+}
+
+impl<T: Pod> From<Vec<T>> for Table<T> {
+    fn from(items: Vec<T>) -> Self {
+        let items: Arc<Box<[T]>> = Arc::new(items.into_boxed_slice());
+        Self {
+            // A boxed slice does not move when the box does.
+            ptr: NonNull::new(items.as_ptr() as *mut T).unwrap(),
+            len: items.len(),
+            _owner: items,
+        }
+    }
+}
+
+impl<T: Pod> Deref for Table<T> {
+    type Target = [T];
+
+    #[inline(always)]
+    fn deref(&self) -> &[T] {
+        // SAFETY: `ptr` points to `len` initialised, immutable `T`s that `_owner` keeps alive.
+        unsafe { std::slice::from_raw_parts(self.ptr.as_ptr(), self.len) }
+    }
+}
+
+impl<T: Pod> Clone for Table<T> {
+    fn clone(&self) -> Self {
+        Self {
+            ptr: self.ptr,
+            len: self.len,
+            _owner: self._owner.clone(),
+        }
+    }
+}
+
+/// The contents of a file, mapped read-only into memory where the platform supports it and
+/// read into an 8-byte aligned buffer elsewhere.
+///
+/// The file must not be modified while it is mapped; snapshots are only ever replaced by
+/// renaming a new file over them, which leaves the mapped one intact.
+pub(crate) struct MappedFile {
+    #[cfg(unix)]
+    ptr: NonNull<u8>,
+    #[cfg(not(unix))]
+    words: Box<[u64]>,
+    len: usize,
+}
+
+// The mapping is read-only.
+unsafe impl Send for MappedFile {}
+unsafe impl Sync for MappedFile {}
+
+impl MappedFile {
+    pub(crate) fn open(path: &Path) -> std::io::Result<Self> {
+        let file = File::open(path)?;
+        let len = usize::try_from(file.metadata()?.len()).map_err(|_| {
+            std::io::Error::new(std::io::ErrorKind::InvalidData, "file too large to map")
+        })?;
+        if len == 0 {
+            return Err(std::io::Error::new(
+                std::io::ErrorKind::InvalidData,
+                "file is empty",
+            ));
+        }
+        Self::map(&file, len)
+    }
+
+    #[cfg(unix)]
+    fn map(file: &File, len: usize) -> std::io::Result<Self> {
+        use std::os::unix::io::AsRawFd;
+
+        // SAFETY: a fresh read-only mapping of an open file; the kernel picks the address.
+        let ptr = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ,
+                libc::MAP_SHARED,
+                file.as_raw_fd(),
+                0,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(std::io::Error::last_os_error());
+        }
+        Ok(Self {
+            ptr: NonNull::new(ptr as *mut u8).unwrap(),
+            len,
+        })
+    }
+
+    #[cfg(not(unix))]
+    fn map(mut file: &File, len: usize) -> std::io::Result<Self> {
+        use std::io::Read as _;
+
+        let mut words = vec![0u64; len.div_ceil(8)].into_boxed_slice();
+        // SAFETY: the buffer is at least `len` bytes of initialised `u64`s.
+        let bytes = unsafe { std::slice::from_raw_parts_mut(words.as_mut_ptr() as *mut u8, len) };
+        file.read_exact(bytes)?;
+        Ok(Self { words, len })
+    }
+}
+
+impl Buffer for MappedFile {
+    fn bytes(&self) -> &[u8] {
+        #[cfg(unix)]
+        let ptr = self.ptr.as_ptr() as *const u8;
+        #[cfg(not(unix))]
+        let ptr = self.words.as_ptr() as *const u8;
+        // SAFETY: the mapping or buffer is `len` readable bytes for as long as `self` lives.
+        unsafe { std::slice::from_raw_parts(ptr, self.len) }
+    }
+}
+
+#[cfg(unix)]
+impl Drop for MappedFile {
+    fn drop(&mut self) {
+        // SAFETY: `ptr` and `len` describe a mapping created in `map`, and no `Table` into it
+        // outlives `self`.
+        unsafe {
+            libc::munmap(self.ptr.as_ptr() as *mut libc::c_void, self.len);
+        }
+    }
+}
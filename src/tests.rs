@@ -1,13 +1,14 @@
+use std::collections::HashSet;
 use std::path::Path;
 
 use crate::{
     chat::{
-        Author, Conversation, DeveloperContent, Message, ReasoningEffort, Role, SystemContent,
-        ToolDescription,
+        Author, Content, Conversation, DeveloperContent, Message, ReasoningEffort, Role,
+        SystemContent, TextContent, ToolDescription,
     },
     load_harmony_encoding,
     tiktoken::{CoreBPE, Rank},
-    HarmonyEncodingName, ParseOptions, StreamableParser,
+    HarmonyEncodingName, ParseOptions, ParserPool, SlotId, StreamStateKind, StreamableParser,
 };
 use pretty_assertions::{assert_eq, Comparison};
 use serde_json::json;
@@ -33,15 +34,58 @@ fn load_test_data(path: impl AsRef<Path>) -> String {
 
 const ENCODINGS: [HarmonyEncodingName; 1] = [HarmonyEncodingName::HarmonyGptOss];
 
+// Counts heap allocations per thread so that tests can assert that hot paths
+// do not allocate, without interference from tests running concurrently.
+struct CountingAllocator;
+
+thread_local! {
+    static ALLOCATIONS: std::cell::Cell<usize> = const { std::cell::Cell::new(0) };
+}
+
+fn record_allocation() {
+    let _ = ALLOCATIONS.try_with(|count| count.set(count.get() + 1));
+}
+
+unsafe impl std::alloc::GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: std::alloc::Layout) -> *mut u8 {
+        record_allocation();
+        std::alloc::System.alloc(layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: std::alloc::Layout) -> *mut u8 {
+        record_allocation();
+        std::alloc::System.alloc_zeroed(layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: std::alloc::Layout, new_size: usize) -> *mut u8 {
+        record_allocation();
+        std::alloc::System.realloc(ptr, layout, new_size)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: std::alloc::Layout) {
+        std::alloc::System.dealloc(ptr, layout)
+    }
+}
+
+#[global_allocator]
+static GLOBAL: CountingAllocator = CountingAllocator;
+
+/// Run `f` and return how many heap allocations it made on this thread.
+fn count_allocations(f: impl FnOnce()) -> usize {
+    let before = ALLOCATIONS.with(|count| count.get());
+    f();
+    ALLOCATIONS.with(|count| count.get()) - before
+}
+
 #[test]
 fn test_simple_convo() {
     for encoding_name in ENCODINGS {
         let encoding = load_harmony_encoding(encoding_name).unwrap();
         let expected_tokens = encoding
-            .tokenizer
+            .tokenizer()
             .encode(
                 load_test_data("../test-data/test_simple_convo.txt").as_str(),
-                &encoding.tokenizer.special_tokens(),
+                &encoding.tokenizer().special_tokens(),
             )
             .0;
         let convo = Conversation::from_messages([
@@ -56,7 +100,7 @@ fn test_simple_convo() {
         let tokens = encoding
             .render_conversation_for_completion(&convo, Role::Assistant, None)
             .unwrap();
-        assert_tokens_eq(&encoding.tokenizer, &expected_tokens, &tokens);
+        assert_tokens_eq(encoding.tokenizer(), &expected_tokens, &tokens);
     }
 }
 
@@ -99,8 +143,11 @@ fn test_simple_convo_with_effort() {
         let encoding = load_harmony_encoding(encoding_name).unwrap();
         for &(effort, ref expected_text, use_instruction) in &test_cases {
             let expected_tokens = encoding
-                .tokenizer
-                .encode(expected_text.as_str(), &encoding.tokenizer.special_tokens())
+                .tokenizer()
+                .encode(
+                    expected_text.as_str(),
+                    &encoding.tokenizer().special_tokens(),
+                )
                 .0;
             let sys = SystemContent::new()
                 .with_model_identity("You are ChatGPT, a large language model trained by OpenAI.")
@@ -128,7 +175,7 @@ fn test_simple_convo_with_effort() {
             let tokens = encoding
                 .render_conversation_for_completion(&convo, Role::Assistant, None)
                 .unwrap();
-            assert_tokens_eq(&encoding.tokenizer, &expected_tokens, &tokens);
+            assert_tokens_eq(encoding.tokenizer(), &expected_tokens, &tokens);
         }
     }
 }
@@ -190,10 +237,10 @@ fn test_reasoning_system_message() {
     for encoding_name in ENCODINGS {
         let encoding = load_harmony_encoding(encoding_name).unwrap();
         let expected = encoding
-            .tokenizer
+            .tokenizer()
             .encode(
                 load_test_data("../test-data/test_reasoning_system_message.txt").as_str(),
-                &encoding.tokenizer.special_tokens(),
+                &encoding.tokenizer().special_tokens(),
             )
             .0;
         let convo = Conversation::from_messages([
@@ -212,7 +259,7 @@ fn test_reasoning_system_message() {
         let tokens = encoding
             .render_conversation_for_completion(&convo, Role::Assistant, None)
             .unwrap();
-        assert_tokens_eq(&encoding.tokenizer, &expected, &tokens);
+        assert_tokens_eq(encoding.tokenizer(), &expected, &tokens);
     }
 }
 
@@ -221,11 +268,11 @@ fn test_reasoning_system_message_no_instruction() {
     for encoding_name in ENCODINGS {
         let encoding = load_harmony_encoding(encoding_name).unwrap();
         let expected = encoding
-            .tokenizer
+            .tokenizer()
             .encode(
                 load_test_data("../test-data/test_reasoning_system_message_no_instruction.txt")
                     .as_str(),
-                &encoding.tokenizer.special_tokens(),
+                &encoding.tokenizer().special_tokens(),
             )
             .0;
         let convo = Conversation::from_messages([
@@ -246,7 +293,7 @@ fn test_reasoning_system_message_no_instruction() {
         let tokens = encoding
             .render_conversation_for_completion(&convo, Role::Assistant, None)
             .unwrap();
-        assert_tokens_eq(&encoding.tokenizer, &expected, &tokens);
+        assert_tokens_eq(encoding.tokenizer(), &expected, &tokens);
     }
 }
 
@@ -255,11 +302,11 @@ fn test_reasoning_system_message_with_dates() {
     for encoding_name in ENCODINGS {
         let encoding = load_harmony_encoding(encoding_name).unwrap();
         let expected = encoding
-            .tokenizer
+            .tokenizer()
             .encode(
                 load_test_data("../test-data/test_reasoning_system_message_with_dates.txt")
                     .as_str(),
-                &encoding.tokenizer.special_tokens(),
+                &encoding.tokenizer().special_tokens(),
             )
             .0;
         let convo = Conversation::from_messages([
@@ -280,7 +327,7 @@ fn test_reasoning_system_message_with_dates() {
         let tokens = encoding
             .render_conversation_for_completion(&convo, Role::Assistant, None)
             .unwrap();
-        assert_tokens_eq(&encoding.tokenizer, &expected, &tokens);
+        assert_tokens_eq(encoding.tokenizer(), &expected, &tokens);
     }
 }
 
@@ -386,7 +433,7 @@ fn test_render_functions_with_parameters() {
         .render_conversation_for_completion(&convo, Role::Assistant, None)
         .unwrap();
 
-    let decoded = encoding.tokenizer.decode_utf8(&tokens).unwrap();
+    let decoded = encoding.tokenizer().decode_utf8(&tokens).unwrap();
     assert_eq!(decoded, expected_output);
 }
 
@@ -407,7 +454,7 @@ fn test_browser_and_python_tool() {
         .render_conversation_for_completion(&convo, Role::Assistant, None)
         .unwrap();
 
-    let decoded = encoding.tokenizer.decode_utf8(&tokens).unwrap();
+    let decoded = encoding.tokenizer().decode_utf8(&tokens).unwrap();
     assert_eq!(decoded, expected_output);
 }
 
@@ -437,7 +484,7 @@ fn test_dropping_cot_by_default() {
         )
         .unwrap();
 
-    let decoded = encoding.tokenizer.decode_utf8(&tokens).unwrap();
+    let decoded = encoding.tokenizer().decode_utf8(&tokens).unwrap();
     assert_eq!(decoded, expected_output);
 }
 
@@ -473,7 +520,7 @@ fn test_does_not_drop_if_ongoing_analysis() {
         )
         .unwrap();
 
-    let decoded = encoding.tokenizer.decode_utf8(&tokens).unwrap();
+    let decoded = encoding.tokenizer().decode_utf8(&tokens).unwrap();
     assert_eq!(decoded, expected_output);
 }
 
@@ -503,7 +550,7 @@ fn test_preserve_cot() {
         )
         .unwrap();
 
-    let decoded = encoding.tokenizer.decode_utf8(&tokens).unwrap();
+    let decoded = encoding.tokenizer().decode_utf8(&tokens).unwrap();
     assert_eq!(decoded, expected_output);
 }
 
@@ -511,11 +558,11 @@ fn test_preserve_cot() {
 fn test_reserved_token_decoding() {
     let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
     assert_eq!(
-        encoding.tokenizer.decode_utf8([200014]).unwrap(),
+        encoding.tokenizer().decode_utf8([200014]).unwrap(),
         "<|reserved_200014|>"
     );
     assert_eq!(
-        encoding.tokenizer.decode_utf8([201088]).unwrap(),
+        encoding.tokenizer().decode_utf8([201088]).unwrap(),
         "<|reserved_201088|>"
     );
 }
@@ -537,7 +584,7 @@ fn test_render_and_render_conversation_roundtrip() {
 #[test]
 fn test_decode_utf8_invalid_token() {
     let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
-    let result = encoding.tokenizer.decode_utf8([99999999]);
+    let result = encoding.tokenizer().decode_utf8([99999999]);
     assert!(result.is_err(), "Expected error for invalid token");
 }
 
@@ -546,8 +593,8 @@ fn test_tool_response_parsing() {
     let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
     let text_tokens = load_test_data("../test-data/test_tool_response_parsing.txt");
     let tokens = encoding
-        .tokenizer
-        .encode(&text_tokens, &encoding.tokenizer.special_tokens())
+        .tokenizer()
+        .encode(&text_tokens, &encoding.tokenizer().special_tokens())
         .0;
 
     let expected_message = Message::from_author_and_content(
@@ -562,7 +609,7 @@ fn test_tool_response_parsing() {
         .unwrap();
     assert_eq!(messages.len(), 1);
     assert_eq!(
-        encoding.tokenizer.decode_utf8(&tokens).unwrap(),
+        encoding.tokenizer().decode_utf8(&tokens).unwrap(),
         text_tokens
     );
     assert_eq!(messages[0], expected_message);
@@ -573,10 +620,10 @@ fn test_encode_decode_roundtrip() {
     let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
     let text = "hello world";
     let tokens = encoding
-        .tokenizer
+        .tokenizer()
         .encode(text, &std::collections::HashSet::new())
         .0;
-    assert_eq!(encoding.tokenizer.decode_utf8(&tokens).unwrap(), text);
+    assert_eq!(encoding.tokenizer().decode_utf8(&tokens).unwrap(), text);
 }
 
 #[test]
@@ -584,41 +631,95 @@ fn test_encode_allowed_special() {
     use std::collections::HashSet;
     let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
     let text = "hello world";
-    let tokens = encoding.tokenizer.encode(text, &HashSet::new()).0;
+    let tokens = encoding.tokenizer().encode(text, &HashSet::new()).0;
     assert_eq!(tokens, vec![24912, 2375]);
     // Allowed special token
     let mut allowed = HashSet::new();
     allowed.insert("<|start|>");
-    let tokens = encoding.tokenizer.encode("<|start|>", &allowed).0;
+    let tokens = encoding.tokenizer().encode("<|start|>", &allowed).0;
     assert_eq!(tokens, vec![200006]);
     // Allowed special = all
-    allowed = encoding.tokenizer.special_tokens(); // set of all special tokens
-    let tokens = encoding.tokenizer.encode("<|start|>", &allowed).0;
+    allowed = encoding.tokenizer().special_tokens(); // set of all special tokens
+    let tokens = encoding.tokenizer().encode("<|start|>", &allowed).0;
     assert_eq!(tokens, vec![200006]);
     // Disallowed special (should error)
-    let result = encoding.tokenizer.encode("<|start|>", &HashSet::new());
+    let result = encoding.tokenizer().encode("<|start|>", &HashSet::new());
     assert!(
         result.0.is_empty() || result.0 != vec![200006],
         "Expected error or not special token for disallowed special token"
     );
     // Disallowed special = empty (should not treat as special)
-    let tokens = encoding.tokenizer.encode("<|start|>", &HashSet::new()).0;
+    let tokens = encoding.tokenizer().encode("<|start|>", &HashSet::new()).0;
     // This may not match the Python fallback, but should not be the special token
     assert_ne!(tokens, vec![200006]);
 }
 
+#[test]
+fn test_formatting_token_table_matches_tokenizer() {
+    use crate::encoding::FormattingToken;
+    use std::collections::HashSet;
+    let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
+    for t in FormattingToken::ALL {
+        let resolved = encoding.inner.format_token_ranks.get(t);
+        match encoding.inner.format_token_mapping.get(&t) {
+            Some(mapped) => {
+                let encoded = encoding.inner.tokenizer.encode_with_special_tokens(mapped);
+                if encoded.len() == 1 {
+                    assert_eq!(resolved.unwrap(), encoded[0], "{t}");
+                } else {
+                    assert!(
+                        resolved.is_err(),
+                        "{t} should not resolve to a single token"
+                    );
+                }
+            }
+            None => assert!(resolved.is_err(), "{t} is not mapped"),
+        }
+    }
+    assert_eq!(
+        encoding.stop_tokens().unwrap(),
+        HashSet::from([200002, 200007, 200012])
+    );
+    assert_eq!(
+        encoding.stop_tokens_for_assistant_actions().unwrap(),
+        HashSet::from([200002, 200012])
+    );
+    assert!(encoding.is_stop_token(200007));
+    assert!(!encoding.is_stop_token(200006));
+    assert!(encoding.is_stop_token_for_assistant_actions(200012));
+    assert!(!encoding.is_stop_token_for_assistant_actions(200007));
+}
+
+#[test]
+fn test_load_harmony_encoding_is_shared() {
+    let loads: Vec<_> = std::thread::scope(|scope| {
+        let threads: Vec<_> = (0..8)
+            .map(|_| scope.spawn(|| load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss)))
+            .collect();
+        threads
+            .into_iter()
+            .map(|thread| thread.join().unwrap().unwrap())
+            .collect()
+    });
+    crate::warm_up().unwrap();
+    let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
+    for load in &loads {
+        assert!(std::sync::Arc::ptr_eq(&load.inner, &encoding.inner));
+    }
+}
+
 #[test]
 fn test_is_special_token() {
     let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
-    assert!(encoding.tokenizer.is_special_token(200006)); // <|start|>
-    assert!(!encoding.tokenizer.is_special_token(24912)); // hello
+    assert!(encoding.tokenizer().is_special_token(200006)); // <|start|>
+    assert!(!encoding.tokenizer().is_special_token(24912)); // hello
 }
 
 #[test]
 fn test_invalid_utf8_decoding() {
     let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
     let tokens = vec![132990, 9552];
-    let result = encoding.tokenizer.decode_utf8(&tokens);
+    let result = encoding.tokenizer().decode_utf8(&tokens);
     assert!(result.is_err(), "Expected error for invalid utf-8");
     // decode_utf8 should error, and we do not test permissive decode as it does not exist
 }
@@ -628,8 +729,8 @@ fn test_streamable_parser() {
     let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
     let text = load_test_data("../test-data/test_streamable_parser.txt");
     let tokens = encoding
-        .tokenizer
-        .encode(&text, &encoding.tokenizer.special_tokens())
+        .tokenizer()
+        .encode(&text, &encoding.tokenizer().special_tokens())
         .0;
     let mut parser =
         crate::encoding::StreamableParser::new(encoding.clone(), Some(Role::Assistant)).unwrap();
@@ -886,3 +987,1357 @@ fn test_parse_completion_with_invalid_content_token_errors_on_eos() {
             .with_channel("analysis");
     assert_eq!(parsed_message, &expected_message);
 }
+
+#[test]
+fn test_streamable_parser_content_streaming_does_not_allocate() {
+    let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
+    let header = encoding
+        .tokenizer()
+        .encode_with_special_tokens("<|start|>assistant<|channel|>analysis<|message|>");
+    let end = encoding.tokenizer().encode_with_special_tokens("<|end|>");
+    // Includes characters whose utf-8 bytes are split across several tokens.
+    let text =
+        "The quick brown fox jumps over the lazy dog, 42 times! 🦀 naïve 𝔘𝔫𝔦𝔠𝔬𝔡𝔢\n".repeat(32);
+    let content = encoding.tokenizer().encode_ordinary(&text);
+
+    let mut parser = StreamableParser::new(encoding, None).unwrap();
+    // The first message warms up the parser's reusable buffers.
+    for &token in header.iter().chain(&content).chain(&end) {
+        parser.process(token).unwrap();
+    }
+    for &token in &header {
+        parser.process(token).unwrap();
+    }
+    parser.reserve(content.len());
+
+    let allocations = count_allocations(|| {
+        for &token in &content {
+            parser.process(token).unwrap();
+        }
+    });
+    assert_eq!(allocations, 0, "content streaming should not allocate");
+    assert_eq!(parser.current_content().unwrap(), text);
+
+    for &token in &end {
+        parser.process(token).unwrap();
+    }
+    assert_eq!(parser.messages().len(), 2);
+    assert_eq!(parser.messages()[0], parser.messages()[1]);
+    assert_eq!(
+        parser.messages()[1].content,
+        vec![Content::Text(TextContent { text })]
+    );
+}
+
+#[test]
+fn test_streamable_parser_borrowed_content_accessors() {
+    let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
+    let text = "Streaming 🦀 with naïve 𝔘𝔫𝔦𝔠𝔬𝔡𝔢 deltas";
+    let tokens = encoding
+        .tokenizer()
+        .encode_with_special_tokens(&format!("<|start|>assistant<|message|>{text}<|end|>"));
+
+    let mut parser = StreamableParser::new(encoding, None).unwrap();
+    let mut streamed = String::new();
+    for &token in &tokens {
+        parser.process(token).unwrap();
+        if let Some(delta) = parser.last_content_delta_str() {
+            streamed.push_str(delta);
+            assert_eq!(parser.current_content_str(), streamed);
+        }
+        assert_eq!(
+            parser.last_content_delta().unwrap().as_deref(),
+            parser.last_content_delta_str()
+        );
+    }
+    assert_eq!(streamed, text);
+    assert_eq!(parser.current_content_str(), "");
+    assert_eq!(parser.last_content_delta_str(), None);
+}
+
+#[test]
+fn test_streamable_parser_process_many_matches_process() {
+    let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
+    let tokens = encoding.tokenizer().encode_with_special_tokens(
+        "<|start|>assistant<|channel|>analysis<|message|>Thinking 🤔<|end|>\
+         <|start|>assistant<|channel|>final<|message|>Done",
+    );
+
+    let mut one_by_one = StreamableParser::new(encoding.clone(), None).unwrap();
+    let mut deltas = String::new();
+    for &token in &tokens {
+        one_by_one.process(token).unwrap();
+        deltas.push_str(one_by_one.last_content_delta_str().unwrap_or_default());
+    }
+
+    let mut parser = StreamableParser::new(encoding, None).unwrap();
+    let summary = parser.process_many(&tokens).unwrap();
+    assert_eq!(summary.content_delta, deltas);
+    assert_eq!(summary.messages_completed, 1);
+    let states: Vec<_> = summary
+        .state_transitions
+        .iter()
+        .map(|transition| transition.state)
+        .collect();
+    assert_eq!(
+        states,
+        [
+            StreamStateKind::Header,
+            StreamStateKind::Content,
+            StreamStateKind::ExpectStart,
+            StreamStateKind::Header,
+            StreamStateKind::Content,
+        ]
+    );
+    assert_eq!(
+        summary.state_transitions[2].delta_offset,
+        "Thinking 🤔".len()
+    );
+    assert_eq!(parser.messages(), one_by_one.messages());
+    assert_eq!(parser.current_content_str(), "Done");
+    assert_eq!(parser.tokens(), tokens.as_slice());
+}
+
+#[test]
+fn test_parser_pool_matches_individual_parsers() {
+    let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
+    let texts = [
+        "<|channel|>analysis<|message|>Let me think 🤔<|end|><|start|>assistant<|channel|>final<|message|>Done<|return|>",
+        "<|channel|>commentary to=functions.get_weather<|constrain|>json<|message|>{\"city\":\"Zürich\"}<|call|>",
+        "<|channel|>final<|message|>Short<|return|>",
+    ];
+    let sequences: Vec<Vec<Rank>> = texts
+        .iter()
+        .map(|text| encoding.tokenizer().encode_with_special_tokens(text))
+        .collect();
+
+    let mut pool = ParserPool::new(encoding.clone(), ParseOptions::default());
+    let mut active: Vec<(SlotId, usize)> = sequences
+        .iter()
+        .enumerate()
+        .map(|(sequence, _)| (pool.acquire(Some(Role::Assistant)), sequence))
+        .collect();
+    let mut deltas = vec![String::new(); sequences.len()];
+    let mut results = vec![Vec::new(); sequences.len()];
+    let mut position = 0;
+    while !active.is_empty() {
+        let (slot_ids, tokens): (Vec<SlotId>, Vec<Rank>) = active
+            .iter()
+            .map(|&(slot, sequence)| (slot, sequences[sequence][position]))
+            .unzip();
+        let step = pool.step(&slot_ids, &tokens).unwrap();
+        assert!(step.errors().is_empty());
+        assert_eq!(step.delta_offsets().len(), step.len() + 1);
+        let mut still_active = Vec::new();
+        for (index, &(slot, sequence)) in active.iter().enumerate() {
+            deltas[sequence].push_str(step.delta(index));
+            if step.finished(index) {
+                assert_eq!(position + 1, sequences[sequence].len());
+            } else {
+                still_active.push((slot, sequence));
+            }
+        }
+        for &(slot, sequence) in &active {
+            if !still_active.contains(&(slot, sequence)) {
+                results[sequence] = pool.release(slot).unwrap();
+            }
+        }
+        active = still_active;
+        position += 1;
+    }
+    assert!(pool.is_empty());
+
+    for (sequence, tokens) in sequences.iter().enumerate() {
+        let mut parser = StreamableParser::new(encoding.clone(), Some(Role::Assistant)).unwrap();
+        let mut expected_deltas = String::new();
+        for &token in tokens {
+            parser.process(token).unwrap();
+            expected_deltas.push_str(parser.last_content_delta_str().unwrap_or_default());
+        }
+        assert_eq!(results[sequence], parser.messages());
+        assert_eq!(deltas[sequence], expected_deltas);
+    }
+
+    // Released slots are recycled and start out empty.
+    let slot = pool.acquire(None);
+    assert!(slot < sequences.len());
+    let stream = pool.stream(slot).unwrap();
+    assert!(stream.tokens().is_empty());
+    assert!(stream.messages().is_empty());
+    assert_eq!(stream.current_content_str(), "");
+    assert!(pool.step(&[slot + 1], &[0]).is_err());
+}
+
+#[test]
+fn test_streamable_parser_construction_does_not_allocate() {
+    let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
+    let allocations = count_allocations(|| {
+        let parser = StreamableParser::new(encoding.clone(), Some(Role::Assistant)).unwrap();
+        assert!(std::sync::Arc::ptr_eq(
+            &parser.encoding().inner,
+            &encoding.inner
+        ));
+    });
+    assert_eq!(
+        allocations, 0,
+        "cloning the encoding should be a refcount bump"
+    );
+}
+
+#[test]
+fn test_forked_parser_history_does_not_allocate() {
+    let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
+    let tokens = encoding.tokenizer().encode_with_special_tokens(
+        "<|start|>assistant<|channel|>analysis<|message|>Let me think.<|end|>\
+         <|start|>assistant<|channel|>final<|message|>The answer is 42<|return|>",
+    );
+    let (first, second) = tokens.split_at(tokens.len() / 2);
+    let mut parser = StreamableParser::new(encoding.clone(), None).unwrap();
+    parser.process_many(first).unwrap();
+    let mut forks: Vec<_> = (0..8).map(|_| parser.fork()).collect();
+    for fork in &mut forks {
+        fork.process_many(second).unwrap();
+    }
+    for fork in &forks {
+        let allocations = count_allocations(|| {
+            let messages = fork.messages();
+            assert_eq!(messages.len(), 2);
+            assert_eq!(messages[1].channel.as_deref(), Some("final"));
+            assert_eq!(messages.iter().count(), 2);
+            assert_eq!(fork.tokens().len(), tokens.len());
+            assert!(fork.tokens().iter().eq(&tokens));
+        });
+        assert_eq!(
+            allocations, 0,
+            "reading a forked parser's history should not copy it"
+        );
+    }
+}
+
+#[test]
+fn test_streamable_parser_rollback_restores_state() {
+    let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
+    let tokens = encoding.tokenizer().encode_with_special_tokens(
+        "<|start|>assistant<|channel|>analysis<|message|>Thinking about 𝔘𝔫𝔦𝔠𝔬𝔡𝔢 🤔<|end|>\
+         <|start|>assistant<|channel|>final<|message|>Here you go: naïve<|return|>",
+    );
+
+    let parser_after = |n: usize| {
+        let mut parser = StreamableParser::new(encoding.clone(), None).unwrap();
+        for &token in &tokens[..n] {
+            parser.process(token).unwrap();
+        }
+        parser
+    };
+    let assert_same = |parser: &StreamableParser, expected: &StreamableParser| {
+        assert_eq!(parser.tokens(), expected.tokens());
+        assert_eq!(parser.messages(), expected.messages());
+        assert_eq!(parser.state_json().unwrap(), expected.state_json().unwrap());
+        assert_eq!(parser.current_content_str(), expected.current_content_str());
+        assert_eq!(
+            parser.last_content_delta_str(),
+            expected.last_content_delta_str()
+        );
+        assert_eq!(parser.current_role(), expected.current_role());
+    };
+
+    let complete = parser_after(tokens.len());
+    for checkpoint_at in 0..tokens.len() {
+        let expected = parser_after(checkpoint_at);
+        for rollback_at in checkpoint_at..=tokens.len() {
+            let mut parser = parser_after(checkpoint_at);
+            let checkpoint = parser.checkpoint();
+            for &token in &tokens[checkpoint_at..rollback_at] {
+                parser.process(token).unwrap();
+            }
+            parser.rollback(&checkpoint).unwrap();
+            assert_same(&parser, &expected);
+
+            // The parser continues as if the rolled back tokens were never seen.
+            for &token in &tokens[checkpoint_at..] {
+                parser.process(token).unwrap();
+            }
+            assert_same(&parser, &complete);
+        }
+    }
+
+    let mut parser = parser_after(tokens.len());
+    let checkpoint = parser.checkpoint();
+    parser.rollback(&parser_after(0).checkpoint()).unwrap();
+    assert!(parser.rollback(&checkpoint).is_err());
+}
+
+#[test]
+fn test_forkable_vec_matches_vec() {
+    use crate::forkable_vec::ForkableVec;
+
+    // Drive a tree of forks with pseudo-random operations and compare each
+    // branch against a plain `Vec`.
+    let mut seed = 0x2545_f491_4f6c_dd1du64;
+    let mut next = move |n: usize| {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        (seed % n as u64) as usize
+    };
+    let mut branches = vec![(ForkableVec::new(), Vec::new())];
+    for step in 0..2000 {
+        let index = next(branches.len());
+        let can_fork = branches.len() < 16;
+        let (forkable, expected) = &mut branches[index];
+        match next(10) {
+            0..=5 => {
+                forkable.push(step);
+                expected.push(step);
+            }
+            6 => {
+                let len = next(expected.len() + 1);
+                forkable.truncate(len);
+                expected.truncate(len);
+            }
+            7 => assert_eq!(forkable.pop(), expected.pop()),
+            _ if can_fork => {
+                let fork = forkable.fork();
+                let copy = expected.clone();
+                branches.push((fork, copy));
+            }
+            _ => {}
+        }
+        let (forkable, expected) = &branches[index];
+        assert_eq!(forkable.len(), expected.len());
+        assert_eq!(forkable.view(), expected.as_slice());
+        let start = next(expected.len() + 1);
+        let end = start + next(expected.len() - start + 1);
+        let view = forkable.view().slice(start..end);
+        assert_eq!(view, &expected[start..end]);
+        assert_eq!(view.segments().flatten().count(), end - start);
+        assert_eq!(view.last(), expected[start..end].last());
+        if let Some(last) = expected.len().checked_sub(1) {
+            assert_eq!(forkable.get(last), expected.get(last));
+        }
+    }
+    for (forkable, expected) in branches {
+        assert_eq!(forkable.into_vec(), expected);
+    }
+}
+
+#[test]
+fn test_streamable_parser_fork() {
+    let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
+    let prefix = encoding.tokenizer().encode_with_special_tokens(
+        "<|start|>assistant<|channel|>analysis<|message|>Let me think.<|end|>\
+         <|start|>assistant<|channel|>final<|message|>The answer is",
+    );
+    let branches = [" 42 🎉<|return|>", " unknown, sorry<|return|>", "<|end|>"]
+        .map(|text| encoding.tokenizer().encode_with_special_tokens(text));
+
+    for fork_at in 0..=prefix.len() {
+        let mut parser = StreamableParser::new(encoding.clone(), None).unwrap();
+        parser.process_many(&prefix[..fork_at]).unwrap();
+        let mut forks: Vec<_> = branches.iter().map(|_| parser.fork()).collect();
+        for (fork, branch) in forks.iter_mut().zip(&branches) {
+            fork.process_many(&prefix[fork_at..]).unwrap();
+            fork.process_many(branch).unwrap();
+        }
+        parser.process_many(&prefix[fork_at..]).unwrap();
+
+        for (fork, branch) in forks.iter().zip(&branches) {
+            let mut expected = StreamableParser::new(encoding.clone(), None).unwrap();
+            expected.process_many(&prefix).unwrap();
+            expected.process_many(branch).unwrap();
+            assert_eq!(fork.tokens(), expected.tokens());
+            assert_eq!(fork.messages(), expected.messages());
+            assert_eq!(fork.state_json().unwrap(), expected.state_json().unwrap());
+        }
+        let mut expected = StreamableParser::new(encoding.clone(), None).unwrap();
+        expected.process_many(&prefix).unwrap();
+        assert_eq!(parser.tokens(), expected.tokens());
+        assert_eq!(parser.messages(), expected.messages());
+        assert_eq!(parser.current_content_str(), expected.current_content_str());
+    }
+}
+
+#[test]
+fn test_streamable_parser_events_rebuild_messages() {
+    use crate::ParserEvent;
+
+    let encoding = load_harmony_encoding(HarmonyEncodingName::HarmonyGptOss).unwrap();
+    let mut partial_emoji = encoding
+        .tokenizer()
+        .encode_with_special_tokens("<|start|>assistant<|message|>Almost 💖");
+    partial_emoji.pop();
+    let cases = [
+        (
+            encoding.tokenizer().encode_with_special_tokens(
+                "<|start|>assistant<|channel|>analysis<|message|>Let me check 🤔<|end|>\
+                 <|start|>assistant to=functions.get_weather<|channel|>commentary \
+                 <|constrain|>json<|message|>{\"city\": \"Zürich\"}<|call|>",
+            ),
+            None,
+            true,
+        ),
+        (partial_emoji, None, true),
+        (
+            encoding
+                .tokenizer()
+                .encode_with_special_tokens("<|channel|>commentary Hello<|end|>"),
+            Some(Role::Assistant),
+            false,
+        ),
+    ];
+
+    for (tokens, role, strict) in cases {
+        let mut parser =
+            StreamableParser::new_with_options(encoding.clone(), role, ParseOptions { strict })
+                .unwrap();
+        let mut rebuilt: Vec<Message> = Vec::new();
+        let mut current: Option<Message> = None;
+        let mut on_event = |event: ParserEvent<'_>| match event {
+            ParserEvent::MessageStart { role, name } => {
+                assert!(current.is_none());
+                let author = Author {
+                    role,
+                    name: name.map(str::to_owned),
+                };
+                current = Some(Message::from_author_and_content(author, ""));
+            }
+            ParserEvent::HeaderComplete {
+                channel,
+                recipient,
+                content_type,
+            } => {
+                let message = current.as_mut().unwrap();
+                message.channel = channel.map(str::to_owned);
+                message.recipient = recipient.map(str::to_owned);
+                message.content_type = content_type.map(str::to_owned);
+            }
+            ParserEvent::ContentDelta(delta) => {
+                let Some(Content::Text(TextContent { text })) =
+                    current.as_mut().unwrap().content.first_mut()
+                else {
+                    unreachable!()
+                };
+                text.push_str(delta);
+            }
+            ParserEvent::MessageEnd => rebuilt.push(current.take().unwrap()),
+        };
+        parser
+            .process_many_with_events(&tokens, &mut on_event)
+            .unwrap();
+        parser.process_eos_with_events(&mut on_event).unwrap();
+
+        assert!(!parser.messages().is_empty());
+        assert_eq!(rebuilt, parser.messages());
+    }
+}
+
+/// A small BPE vocabulary over the base64 alphabet: every byte, plus `merges` tokens that
+/// each concatenate two earlier tokens, ranked in creation order like a trained vocabulary.
+fn synthetic_bpe_ranks(merges: usize) -> rustc_hash::FxHashMap<Vec<u8>, Rank> {
+    const ALPHABET: &[u8] = b"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    let mut ranks: rustc_hash::FxHashMap<Vec<u8>, Rank> =
+        (0..=255u8).map(|byte| (vec![byte], byte as Rank)).collect();
+    let mut tokens: Vec<Vec<u8>> = ALPHABET.iter().map(|&byte| vec![byte]).collect();
+    let mut state = 0x2545_f491_4f6c_dd1du64;
+    let mut next_index = |len: usize| {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        // Bias towards early (short) tokens so that merges nest several levels deep.
+        let r = (state % len as u64) as usize;
+        r * r / len
+    };
+    while tokens.len() < ALPHABET.len() + merges {
+        let mut token = tokens[next_index(tokens.len())].clone();
+        token.extend_from_slice(&tokens[next_index(tokens.len())]);
+        if !ranks.contains_key(&token) {
+            ranks.insert(token.clone(), ranks.len() as Rank);
+            tokens.push(token);
+        }
+    }
+    ranks
+}
+
+/// Long pieces that make the linear merge loop quadratic.
+fn adversarial_bpe_pieces() -> Vec<(&'static str, Vec<u8>)> {
+    let mut state = 0x9e37_79b9_7f4a_7c15u64;
+    let base64: Vec<u8> = (0..4096)
+        .map(|_| {
+            state = state
+                .wrapping_mul(6364136223846793005)
+                .wrapping_add(1442695040888963407);
+            b"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"
+                [(state >> 58) as usize]
+        })
+        .collect();
+    vec![
+        ("base64", base64),
+        ("repeated byte", vec![b'a'; 4096]),
+        ("repeated pair", b"ab".repeat(2048)),
+        ("punctuation", b"+/".repeat(1024).repeat(2)),
+    ]
+}
+
+/// Straightforward BPE over byte slices, for checking the optimised merge loops against.
+fn reference_byte_pair_encode(
+    ranks: &rustc_hash::FxHashMap<Vec<u8>, Rank>,
+    piece: &[u8],
+) -> Vec<Rank> {
+    // The end offset of every part.
+    let mut ends: Vec<usize> = (1..=piece.len()).collect();
+    let start = |ends: &[usize], i: usize| if i == 0 { 0 } else { ends[i - 1] };
+    loop {
+        let best = (0..ends.len() - 1)
+            .filter_map(|i| Some((*ranks.get(&piece[start(&ends, i)..ends[i + 1]])?, i)))
+            .min();
+        let Some((_, i)) = best else {
+            break;
+        };
+        ends.remove(i);
+    }
+    (0..ends.len())
+        .map(|i| ranks[&piece[start(&ends, i)..ends[i]]])
+        .collect()
+}
+
+#[test]
+fn test_byte_pair_merge_matches_reference() {
+    use crate::tiktoken::{MergeTable, _byte_pair_merge_large, _byte_pair_merge_small};
+    use crate::vocab::Vocab;
+
+    let ranks = synthetic_bpe_ranks(20_000);
+    let merges = MergeTable::new(&Vocab::new(&ranks, &Default::default()).unwrap()).unwrap();
+    for (name, piece) in adversarial_bpe_pieces() {
+        for len in [2, 3, 17, 255, 256, 1000, piece.len() - 7] {
+            for start in [0, 1, 7] {
+                let piece = &piece[start..start + len];
+                let expected = reference_byte_pair_encode(&ranks, piece);
+                let context = format!("{name}[{start}..{}]", start + len);
+                assert_eq!(
+                    _byte_pair_merge_small(&merges, piece),
+                    expected,
+                    "{context}"
+                );
+                assert_eq!(
+                    _byte_pair_merge_large(&merges, piece),
+                    expected,
+                    "{context}"
+                );
+            }
+        }
+    }
+}
+
+/// Compares both merge implementations on long pieces. Run with
+/// `cargo test --release -- --ignored --nocapture bench_byte_pair_merge`.
+#[test]
+#[ignore]
+fn bench_byte_pair_merge_long_pieces() {
+    use crate::tiktoken::{MergeTable, _byte_pair_merge_large, _byte_pair_merge_small};
+    use crate::vocab::Vocab;
+    use std::time::Instant;
+
+    let vocab = Vocab::new(&synthetic_bpe_ranks(50_000), &Default::default()).unwrap();
+    let merges = MergeTable::new(&vocab).unwrap();
+    for (name, piece) in adversarial_bpe_pieces() {
+        for len in [64, 256, 1024, 4096] {
+            let piece = &piece[..len];
+            let iterations = 200_000 / len;
+            let start = Instant::now();
+            for _ in 0..iterations {
+                std::hint::black_box(_byte_pair_merge_small(&merges, std::hint::black_box(piece)));
+            }
+            let small = start.elapsed() / iterations as u32;
+            let start = Instant::now();
+            for _ in 0..iterations {
+                std::hint::black_box(_byte_pair_merge_large(&merges, std::hint::black_box(piece)));
+            }
+            let large = start.elapsed() / iterations as u32;
+            println!("{name:>14} {len:>5} bytes: linear {small:>10.2?}  heap {large:>10.2?}");
+        }
+    }
+}
+
+#[test]
+fn test_o200k_pieces_match_regex() {
+    use crate::pretokenizer::{o200k_pattern, O200kPieces};
+
+    let regex = fancy_regex::Regex::new(&o200k_pattern()).unwrap();
+    let split_with_regex = |text: &str| -> Vec<String> {
+        regex
+            .find_iter(text)
+            .map(|m| m.unwrap().as_str().to_owned())
+            .collect()
+    };
+    let split = |text: &str| -> Vec<String> { O200kPieces::new(text).map(str::to_owned).collect() };
+
+    let mut texts: Vec<String> = [
+        "Hello world! It's a test, isn't it? WE'RE HERE'LL'D",
+        "  leading and trailing spaces   ",
+        "tabs\tand\r\nnewlines \n\n  \nend\n",
+        "numbers 1234567 and ½ and Ⅻ and ١٢٣٤",
+        "punctuation... /path/to/file\n//comment\r\n!!!",
+        "unicode: naïve café Ǆungla ʰello 日本語 Привет мир",
+        "combining: e\u{301}e\u{301} \u{301}\u{301}x",
+        "spaces\u{a0}\u{a0}nbsp\u{2028}line\u{3000}ideographic",
+        "emoji 🤔💖 and 𝔘𝔫𝔦𝔠𝔬𝔡𝔢 𝟙𝟚𝟛 and 'ſ 'S 'Ll 'RE",
+        "",
+        " ",
+        "\n",
+    ]
+    .into_iter()
+    .map(str::to_owned)
+    .collect();
+
+    // Random strings over characters from all the classes the pattern distinguishes.
+    let alphabet: Vec<char> = "aZ'sSteErRvVmMlLdDſ \t\r\n\u{b}\u{c}\u{1c}\u{0}\u{7f}\u{a0}\u{2028}\u{3000}09½Ⅻ١.,!?/-_\"é\u{301}\u{300}Ǆʰ日ДЖ🤔𝔘𝟙\u{e0001}"
+        .chars()
+        .collect();
+    let mut state = 0x853c_49e6_748f_ea9bu64;
+    let mut next = |bound: usize| {
+        state = state
+            .wrapping_mul(6364136223846793005)
+            .wrapping_add(1442695040888963407);
+        ((state >> 33) % bound as u64) as usize
+    };
+    for _ in 0..20_000 {
+        let len = next(24);
+        texts.push((0..len).map(|_| alphabet[next(alphabet.len())]).collect());
+    }
+    // Long runs of one character, which the ASCII scanner skips in vector-sized blocks.
+    for _ in 0..5_000 {
+        let mut text = String::new();
+        for _ in 0..next(6) {
+            let c = alphabet[next(alphabet.len())];
+            text.extend(std::iter::repeat_n(c, 1 + next(70)));
+        }
+        texts.push(text);
+    }
+
+    for text in &texts {
+        assert_eq!(split(text), split_with_regex(text), "{text:?}");
+    }
+}
+
+#[test]
+fn test_ascii_scan_matches_scalar() {
+    use crate::ascii_scan::{run_end, run_end_scalar, AsciiClass};
+
+    let mut state = 0x2f69_3c1a_9d34_7eb5u64;
+    let mut next = |bound: usize| {
+        state = state
+            .wrapping_mul(6364136223846793005)
+            .wrapping_add(1442695040888963407);
+        ((state >> 33) % bound as u64) as usize
+    };
+    for _ in 0..2_000 {
+        // Runs of a single byte, so that the scan crosses several vector blocks.
+        let mut bytes = Vec::new();
+        while bytes.len() < 100 {
+            let byte = next(256) as u8;
+            bytes.extend(std::iter::repeat_n(byte, 1 + next(40)));
+        }
+        for class in [
+            AsciiClass::Upper,
+            AsciiClass::Lower,
+            AsciiClass::Space,
+            AsciiClass::Other,
+        ] {
+            for pos in 0..bytes.len() {
+                assert_eq!(
+                    run_end(&bytes, pos, class),
+                    run_end_scalar(&bytes, pos, class),
+                    "{class:?} {pos} {bytes:?}"
+                );
+            }
+        }
+    }
+}
+
+#[test]
+fn test_core_bpe_encodes_from_many_threads() {
+    // Each thread uses its own clone of the regexes; encodings built one after another may
+    // reuse the address of a dropped regex, which must not hand out the stale clone.
+    let text = "Hello <|special|> world, it's 2024!\n  and more  text<|special|>";
+    let allowed_special = std::collections::HashSet::from(["<|special|>"]);
+    for pattern in [r"\w+|\s+|[^\w\s]+", r"\S+|\s+"] {
+        let bpe = CoreBPE::new(
+            synthetic_bpe_ranks(1_000),
+            [("<|special|>".to_string(), 100_000)],
+            pattern,
+        )
+        .unwrap();
+        let (expected, _) = bpe.encode(text, &allowed_special);
+        assert_eq!(bpe.decode_utf8(&expected).unwrap(), text);
+        std::thread::scope(|scope| {
+            for _ in 0..8 {
+                scope.spawn(|| {
+                    for _ in 0..100 {
+                        assert_eq!(bpe.encode(text, &allowed_special).0, expected);
+                    }
+                });
+            }
+        });
+        assert_eq!(bpe.clone().encode(text, &allowed_special).0, expected);
+    }
+}
+
+/// A `CoreBPE` over `synthetic_bpe_ranks` with special tokens `<|special_0|>` and so on.
+fn synthetic_bpe_with_specials(specials: usize) -> CoreBPE {
+    CoreBPE::new(
+        synthetic_bpe_ranks(1_000),
+        (0..specials).map(|i| (format!("<|special_{i}|>"), 100_000 + i as Rank)),
+        r"\w+|\s+|[^\w\s]+",
+    )
+    .unwrap()
+}
+
+/// A regex matching any special token of `bpe`.
+fn special_regex(bpe: &CoreBPE) -> fancy_regex::Regex {
+    let mut specials: Vec<&str> = bpe.special_tokens().into_iter().collect();
+    specials.sort();
+    let parts: Vec<_> = specials.iter().map(|s| fancy_regex::escape(s)).collect();
+    fancy_regex::Regex::new(&parts.join("|")).unwrap()
+}
+
+/// The old special token search: find the next special token with `special_regex` and search
+/// again one byte later if it is not allowed.
+fn reference_encode(
+    bpe: &CoreBPE,
+    regex: &fancy_regex::Regex,
+    text: &str,
+    allowed: &HashSet<&str>,
+) -> Vec<Rank> {
+    let mut tokens = vec![];
+    let mut start = 0;
+    loop {
+        let mut start_find = start;
+        let next_special = loop {
+            match regex.find_from_pos(text, start_find).unwrap() {
+                Some(m) if allowed.contains(m.as_str()) => break Some(m),
+                Some(m) => start_find = m.start() + 1,
+                None => break None,
+            }
+        };
+        let end = next_special.map_or(text.len(), |m| m.start());
+        tokens.extend(bpe.encode_ordinary(&text[start..end]));
+        match next_special {
+            Some(m) => {
+                tokens.push(bpe.encode_with_special_tokens(m.as_str())[0]);
+                start = m.end();
+            }
+            None => return tokens,
+        }
+    }
+}
+
+#[test]
+fn test_special_policy_matches_reference() {
+    let bpe = synthetic_bpe_with_specials(300);
+    let regex = special_regex(&bpe);
+    let policies: Vec<Vec<String>> = vec![
+        vec![],
+        vec!["<|special_7|>".into()],
+        vec![
+            "<|special_1|>".into(),
+            "<|special_12|>".into(),
+            "not special".into(),
+        ],
+        (0..300)
+            .step_by(2)
+            .map(|i| format!("<|special_{i}|>"))
+            .collect(),
+        (0..300).map(|i| format!("<|special_{i}|>")).collect(),
+    ];
+
+    let fragments = [
+        "<|special_1|>",
+        "<|special_12|>",
+        "<|special_7|>",
+        "<|special_299|>",
+        "<|special_",
+        "<|",
+        "|>",
+        "<",
+        "hello",
+        " world",
+        "\n",
+        "1",
+    ];
+    let mut state = 0x6a09_e667_f3bc_c908u64;
+    let mut next = |bound: usize| {
+        state = state
+            .wrapping_mul(6364136223846793005)
+            .wrapping_add(1442695040888963407);
+        ((state >> 33) % bound as u64) as usize
+    };
+    let texts: Vec<String> = (0..500)
+        .map(|_| {
+            (0..next(20))
+                .map(|_| fragments[next(fragments.len())])
+                .collect()
+        })
+        .collect();
+
+    for allowed in &policies {
+        let allowed_set: HashSet<&str> = allowed.iter().map(String::as_str).collect();
+        let policy = bpe.special_policy(allowed_set.iter().copied());
+        let known = allowed_set
+            .iter()
+            .filter(|s| s.starts_with("<|special_"))
+            .count();
+        assert_eq!(policy.len(), known);
+        for i in 0..300 {
+            assert_eq!(
+                policy.allows(100_000 + i),
+                allowed_set.contains(format!("<|special_{i}|>").as_str())
+            );
+        }
+        assert!(!policy.allows(0));
+        for text in &texts {
+            let expected = reference_encode(&bpe, &regex, text, &allowed_set);
+            assert_eq!(
+                bpe.encode_with_policy(text, &policy).0,
+                expected,
+                "{text:?}"
+            );
+            assert_eq!(bpe.encode(text, &allowed_set).0, expected, "{text:?}");
+        }
+    }
+}
+
+/// Measures encoding of text that is full of disallowed special tokens. Run with
+/// `cargo test --release -- --ignored --nocapture bench_special_policy`.
+#[test]
+#[ignore]
+fn bench_special_policy_disallowed_specials() {
+    use std::time::Instant;
+
+    let bpe = synthetic_bpe_with_specials(1_100);
+    let text = "<|special_1|><|special_1099|> <|not special|>".repeat(20_000);
+    let allowed: HashSet<&str> = ["<|special_1|>"].into();
+
+    let regex = special_regex(&bpe);
+    let start = Instant::now();
+    let expected = reference_encode(&bpe, &regex, &text, &allowed);
+    let regex_elapsed = start.elapsed();
+    let policy = bpe.special_policy(allowed.iter().copied());
+    let start = Instant::now();
+    let tokens = bpe.encode_with_policy(&text, &policy).0;
+    let elapsed = start.elapsed();
+    assert_eq!(tokens, expected);
+    println!(
+        "{} bytes: policy {elapsed:?}, regex rescan {regex_elapsed:?}",
+        text.len()
+    );
+}
+
+#[test]
+fn test_encode_batch_matches_encode() {
+    let bpe = synthetic_bpe_with_specials(10);
+    let texts: Vec<String> = (0..200)
+        .map(|i| format!("document {i} <|special_{}|> {}", i % 20, "word ".repeat(i)))
+        .collect();
+    let policy = bpe.special_policy(["<|special_3|>", "<|special_5|>"]);
+
+    let batch = bpe.encode_batch(&texts, &policy);
+    let ordinary_batch = bpe.encode_ordinary_batch(&texts);
+    assert_eq!(batch.len(), texts.len());
+    for ((text, tokens), ordinary) in texts.iter().zip(&batch).zip(&ordinary_batch) {
+        assert_eq!(tokens, &bpe.encode_with_policy(text, &policy).0);
+        assert_eq!(ordinary, &bpe.encode_ordinary(text));
+    }
+    assert!(bpe.encode_batch::<&str>(&[], &policy).is_empty());
+}
+
+#[test]
+fn test_parallel_map_shares_one_pool() {
+    use crate::parallel;
+
+    let items: Vec<usize> = (0..64).collect();
+    std::thread::scope(|scope| {
+        for caller in 0..8 {
+            let items = &items;
+            scope.spawn(move || {
+                for _ in 0..20 {
+                    let results = parallel::map(items, |&item| item * caller);
+                    assert_eq!(
+                        results,
+                        items.iter().map(|item| item * caller).collect::<Vec<_>>()
+                    );
+                }
+            });
+        }
+    });
+    assert!(parallel::pool_threads() < parallel::max_threads());
+
+    // A panic in the work reaches the caller, which can go on using the pool.
+    let panicked = std::panic::catch_unwind(|| {
+        parallel::map(&items, |&item| assert_ne!(item, 7));
+    });
+    assert!(panicked.is_err());
+    assert!(!parallel::in_worker());
+    assert_eq!(parallel::map(&items, |&item| item + 1)[63], 64);
+}
+
+#[cfg(unix)]
+#[test]
+fn test_parallel_map_after_fork() {
+    use crate::parallel;
+
+    let items: Vec<usize> = (0..64).collect();
+    let expected: Vec<usize> = items.iter().map(|item| item * 3).collect();
+    // Start the pool before forking.
+    assert_eq!(parallel::map(&items, |item| item * 3), expected);
+    // SAFETY: the child only runs `map`, then exits without returning into the test harness.
+    let pid = unsafe { libc::fork() };
+    if pid == 0 {
+        // The child gets a pool of its own, whose threads help again.
+        let ok = std::panic::catch_unwind(|| {
+            let threads = std::sync::Mutex::new(HashSet::new());
+            let results = parallel::map(&items, |item| {
+                threads.lock().unwrap().insert(std::thread::current().id());
+                std::thread::sleep(std::time::Duration::from_millis(1));
+                item * 3
+            });
+            let helped = threads.into_inner().unwrap().len() > 1;
+            results == expected && (helped || parallel::max_threads() == 1)
+        });
+        unsafe { libc::_exit(if ok.unwrap_or(false) { 0 } else { 1 }) };
+    }
+    assert!(pid > 0);
+    let mut status = 0;
+    assert_eq!(unsafe { libc::waitpid(pid, &mut status, 0) }, pid);
+    assert!(libc::WIFEXITED(status) && libc::WEXITSTATUS(status) == 0);
+    assert_eq!(parallel::map(&items, |item| item * 3), expected);
+}
+
+#[test]
+fn test_concurrent_chunked_encodes_share_the_pool() {
+    use crate::parallel;
+    use crate::pretokenizer::o200k_pattern;
+
+    let bpe = CoreBPE::new(synthetic_bpe_ranks(1_000), [], &o200k_pattern()).unwrap();
+    let text =
+        "The quick brown fox, it's 2024!\n".repeat(parallel::chunked_encode_threshold() / 32 + 1);
+    let mut expected = vec![];
+    bpe.encode_chunks(&[&text], &mut expected);
+    std::thread::scope(|scope| {
+        for _ in 0..8 {
+            scope.spawn(|| assert_eq!(bpe.encode_ordinary(&text), expected));
+        }
+    });
+    assert!(parallel::pool_threads() < parallel::max_threads());
+}
+
+/// Measures batch encoding throughput against encoding one text after another. Run with
+/// `cargo test --release -- --ignored --nocapture bench_encode_batch`.
+#[test]
+#[ignore]
+fn bench_encode_batch() {
+    use std::time::Instant;
+
+    let bpe = synthetic_bpe_with_specials(10);
+    let texts: Vec<String> = (0..2_000)
+        .map(|i| {
+            format!(
+                "Document {i}: {}",
+                "The quick brown fox jumps over the lazy dog. ".repeat(50)
+            )
+        })
+        .collect();
+    let start = Instant::now();
+    let sequential: Vec<_> = texts.iter().map(|text| bpe.encode_ordinary(text)).collect();
+    let sequential_elapsed = start.elapsed();
+    let start = Instant::now();
+    let batch = bpe.encode_ordinary_batch(&texts);
+    let batch_elapsed = start.elapsed();
+    assert_eq!(batch, sequential);
+    println!(
+        "{} threads: batch {batch_elapsed:?}, sequential {sequential_elapsed:?}",
+        crate::parallel::max_threads()
+    );
+}
+
+#[test]
+fn test_chunked_encode_matches_sequential() {
+    use crate::pretokenizer::{o200k_chunks, o200k_pattern, O200kPieces};
+
+    let bpe = CoreBPE::new(synthetic_bpe_ranks(1_000), [], &o200k_pattern()).unwrap();
+    let no_special = bpe.special_policy([]);
+    let alphabet: Vec<char> = "abcXYZ'sStTſ  \t\n\r09.,;\"{}/-_é\u{301}Ǆ日Д🤔\u{a0}"
+        .chars()
+        .collect();
+    let mut state = 0x3c6e_f372_fe94_f82bu64;
+    let mut next = |bound: usize| {
+        state = state
+            .wrapping_mul(6364136223846793005)
+            .wrapping_add(1442695040888963407);
+        ((state >> 33) % bound as u64) as usize
+    };
+    for _ in 0..5_000 {
+        let text: String = (0..next(40))
+            .map(|_| alphabet[next(alphabet.len())])
+            .collect();
+        let pieces: Vec<&str> = O200kPieces::new(&text).collect();
+        let (tokens, last_piece_token_len) = bpe.encode_with_policy(&text, &no_special);
+        for target_len in [0, 1, 3, 8] {
+            let chunks = o200k_chunks(&text, target_len);
+            assert_eq!(chunks.concat(), text);
+            let chunk_pieces: Vec<&str> = chunks
+                .iter()
+                .flat_map(|chunk| O200kPieces::new(chunk))
+                .collect();
+            assert_eq!(chunk_pieces, pieces, "{text:?} {chunks:?}");
+
+            let mut chunk_tokens = vec![];
+            let chunk_last = bpe.encode_chunks(&chunks, &mut chunk_tokens);
+            assert_eq!(chunk_tokens, tokens, "{text:?} {chunks:?}");
+            assert_eq!(chunk_last, last_piece_token_len, "{text:?} {chunks:?}");
+        }
+    }
+}
+
+#[test]
+fn test_token_bytes_cover_every_token() {
+    let ranks = synthetic_bpe_ranks(1_000);
+    let bpe = synthetic_bpe_with_specials(3);
+    for (bytes, &rank) in &ranks {
+        assert_eq!(bpe.token_bytes(rank), Some(bytes.as_slice()));
+        assert_eq!(bpe.token_byte_len(rank), Some(bytes.len()));
+        assert!(!bpe.is_special_token(rank));
+    }
+    assert_eq!(bpe.token_bytes(100_001), Some(b"<|special_1|>".as_slice()));
+    assert!(bpe.is_special_token(100_001));
+    assert_eq!(bpe.token_byte_len(100_003), None);
+    assert_eq!(bpe.token_bytes(Rank::MAX), None);
+
+    let mut decoded = b"prefix".to_vec();
+    bpe.decode_bytes_into([65, 100_002, 66], &mut decoded)
+        .unwrap();
+    assert_eq!(decoded, b"prefixA<|special_2|>B");
+    let err = bpe
+        .decode_bytes_into([65, 99_999], &mut decoded)
+        .unwrap_err();
+    assert_eq!(err.token, 99_999);
+    assert_eq!(decoded, b"prefixA<|special_2|>B");
+
+    let shared_rank = CoreBPE::new(
+        synthetic_bpe_ranks(10),
+        [("<|special|>".to_string(), 65)],
+        r"\S+|\s+",
+    );
+    assert!(shared_rank.is_err());
+}
+
+#[test]
+fn test_vocab_index_matches_map() {
+    use crate::vocab::Vocab;
+
+    for merges in [0, 1, 100, 5_000] {
+        let ranks = synthetic_bpe_ranks(merges);
+        let specials = [("<|special|>".to_string(), ranks.len() as Rank)]
+            .into_iter()
+            .collect();
+        let vocab = Vocab::new(&ranks, &specials).unwrap();
+        for (bytes, &rank) in &ranks {
+            assert_eq!(vocab.rank(bytes), Some(rank));
+            assert_eq!(vocab.token_bytes(rank), Some(bytes.as_slice()));
+            let mut longer = bytes.clone();
+            longer.push(0xFF);
+            assert_eq!(vocab.rank(&longer), ranks.get(&longer).copied());
+        }
+        assert_eq!(vocab.rank(b"<|special|>"), None);
+        assert_eq!(vocab.rank(b""), None);
+        let mut ordinary: Vec<_> = vocab.ordinary_tokens().map(|(_, rank)| rank).collect();
+        ordinary.sort_unstable();
+        let mut expected: Vec<_> = ranks.values().copied().collect();
+        expected.sort_unstable();
+        assert_eq!(ordinary, expected);
+    }
+}
+
+/// Measures token lookups in the vocabulary index against a hash map. Run with
+/// `cargo test --release -- --ignored --nocapture bench_vocab_index`.
+#[test]
+#[ignore]
+fn bench_vocab_index() {
+    use crate::vocab::Vocab;
+    use std::time::Instant;
+
+    // Words of 1 to 12 letters, about as long as the tokens of real vocabularies.
+    let mut state = 0x9e37_79b9_7f4a_7c15u64;
+    let mut next = |bound: usize| {
+        state = state
+            .wrapping_mul(6364136223846793005)
+            .wrapping_add(1442695040888963407);
+        ((state >> 33) % bound as u64) as usize
+    };
+    let mut ranks = rustc_hash::FxHashMap::default();
+    while ranks.len() < 200_000 {
+        let len = 1 + next(12);
+        let token: Vec<u8> = (0..len).map(|_| b'a' + next(26) as u8).collect();
+        let rank = ranks.len() as Rank;
+        ranks.entry(token).or_insert(rank);
+    }
+    let vocab = Vocab::new(&ranks, &Default::default()).unwrap();
+    // Shuffle, so that the lookups do not follow the layout of either table, and copy the
+    // tokens into one buffer like the pieces of a text.
+    let mut tokens: Vec<&[u8]> = ranks.keys().map(Vec::as_slice).collect();
+    for i in (1..tokens.len()).rev() {
+        tokens.swap(i, next(i + 1));
+    }
+    let text = tokens.concat();
+    let mut queries = Vec::with_capacity(tokens.len());
+    let mut start = 0;
+    for token in &tokens {
+        queries.push(&text[start..start + token.len()]);
+        start += token.len();
+    }
+    for _ in 0..3 {
+        let start = Instant::now();
+        let map_sum: u64 = queries.iter().map(|&q| ranks[q] as u64).sum();
+        let map_elapsed = start.elapsed();
+        let start = Instant::now();
+        let vocab_sum: u64 = queries.iter().map(|q| vocab.rank(q).unwrap() as u64).sum();
+        let vocab_elapsed = start.elapsed();
+        assert_eq!(map_sum, vocab_sum);
+        println!(
+            "{} lookups: vocab {vocab_elapsed:?}, hash map {map_elapsed:?}",
+            queries.len()
+        );
+    }
+}
+
+/// Measures pre-tokenization throughput on ASCII prose and code. Run with
+/// `cargo test --release -- --ignored --nocapture bench_o200k_split`.
+#[test]
+#[ignore]
+fn bench_o200k_split_ascii() {
+    use crate::ascii_scan::{run_end, run_end_scalar, AsciiClass};
+    use crate::pretokenizer::{o200k_pattern, O200kPieces};
+    use std::time::Instant;
+
+    let prose = "The quick brown fox jumps over the lazy dog. It's been a long day, hasn't it? ";
+    let code = "fn main() {\n    let values: Vec<u32> = (0..100).map(|x| x * 2).collect();\n        println!(\"{values:?}\");\n}\n\n";
+    let corpora = [
+        ("prose", prose.repeat(4096)),
+        ("code", code.repeat(4096)),
+        (
+            "minified",
+            "aVeryLongIdentifierNameThatGoesOnAndOn+=".repeat(8192),
+        ),
+    ];
+    let regex = fancy_regex::Regex::new(&o200k_pattern()).unwrap();
+    let mb_per_s = |bytes: usize, elapsed: std::time::Duration| {
+        bytes as f64 / elapsed.as_secs_f64() / (1 << 20) as f64
+    };
+    for (name, text) in &corpora {
+        let start = Instant::now();
+        let pieces = O200kPieces::new(text).count();
+        let split = start.elapsed();
+        let start = Instant::now();
+        let regex_pieces = regex.find_iter(text).count();
+        let regex_split = start.elapsed();
+        assert_eq!(pieces, regex_pieces);
+        println!(
+            "{name:>9}: splitter {:8.1} MB/s, regex {:8.1} MB/s",
+            mb_per_s(text.len(), split),
+            mb_per_s(text.len(), regex_split)
+        );
+    }
+
+    let runs = "abcdefghijklmnopqrstuvwxyz".repeat(8);
+    let start = Instant::now();
+    for pos in 0..runs.len() {
+        std::hint::black_box(run_end_scalar(runs.as_bytes(), pos, AsciiClass::Lower));
+    }
+    let scalar = start.elapsed();
+    let start = Instant::now();
+    for pos in 0..runs.len() {
+        std::hint::black_box(run_end(runs.as_bytes(), pos, AsciiClass::Lower));
+    }
+    let vectorized = start.elapsed();
+    println!("long runs: scalar {scalar:?}, vectorized {vectorized:?}");
+}
+
+#[test]
+fn test_snapshot_roundtrip() {
+    use crate::snapshot::snapshot_key;
+
+    let dir = std::env::temp_dir().join(format!("harmony-snapshot-test-{}", std::process::id()));
+    std::fs::create_dir_all(&dir).unwrap();
+    let path = dir.join("snapshot");
+    let pattern = r"\w+|\s+|[^\w\s]+";
+    let bpe = synthetic_bpe_with_specials(5);
+    let key = snapshot_key("vocab", [("<|special_0|>", 100_000)], pattern);
+    bpe.write_snapshot(&path, &key).unwrap();
+    let loaded = CoreBPE::load_snapshot(&path, &key).unwrap();
+
+    let text = "Hello <|special_3|> world, it's 2024!\n  and more  text<|special_1|>";
+    let allowed = HashSet::from(["<|special_1|>"]);
+    assert_eq!(loaded.encode(text, &allowed), bpe.encode(text, &allowed));
+    assert_eq!(
+        loaded.encode_with_special_tokens(text),
+        bpe.encode_with_special_tokens(text)
+    );
+    assert_eq!(loaded.special_tokens(), bpe.special_tokens());
+    let tokens = loaded.encode_with_special_tokens(text);
+    assert_eq!(loaded.decode_utf8(&tokens).unwrap(), text);
+    assert_eq!(
+        loaded._encode_unstable_native("Hello wor", &allowed),
+        bpe._encode_unstable_native("Hello wor", &allowed)
+    );
+
+    let other_key = snapshot_key("other vocab", [("<|special_0|>", 100_000)], pattern);
+    assert!(CoreBPE::load_snapshot(&path, &other_key).is_err());
+    // Never overwrite a mapped snapshot in place: write the damaged copies elsewhere.
+    let bytes = std::fs::read(&path).unwrap();
+    let damaged = dir.join("damaged");
+    for len in [bytes.len() - 1, 100] {
+        std::fs::write(&damaged, &bytes[..len]).unwrap();
+        assert!(CoreBPE::load_snapshot(&damaged, &key).is_err());
+    }
+    // Damage that keeps the tables consistent is caught by the digest.
+    let mut flipped = bytes.clone();
+    flipped[bytes.len() / 2] ^= 1;
+    std::fs::write(&damaged, &flipped).unwrap();
+    assert!(CoreBPE::load_snapshot(&damaged, &key).is_err());
+    // The encoder keeps the mapping alive after its file is gone.
+    drop(bpe);
+    std::fs::remove_dir_all(&dir).unwrap();
+    assert_eq!(loaded.decode_utf8(&tokens).unwrap(), text);
+}
+
+#[test]
+fn test_snapshot_with_inconsistent_merges() {
+    use crate::snapshot::snapshot_key;
+    use sha2::{Digest as _, Sha256};
+
+    let dir = std::env::temp_dir().join(format!("harmony-merges-test-{}", std::process::id()));
+    std::fs::create_dir_all(&dir).unwrap();
+    let path = dir.join("snapshot");
+    let key = snapshot_key("vocab", [], "");
+    synthetic_bpe_with_specials(0)
+        .write_snapshot(&path, &key)
+        .unwrap();
+    let bytes = std::fs::read(&path).unwrap();
+    // The merge table starts with the 256 byte tokens, which are ranks 0 to 255 here, followed
+    // by the 1 << 16 byte pair merges.
+    let mut byte_tokens = 256u64.to_ne_bytes().to_vec();
+    byte_tokens.extend((0..256u32).flat_map(u32::to_ne_bytes));
+    let start = bytes
+        .windows(byte_tokens.len())
+        .position(|window| window == byte_tokens)
+        .unwrap()
+        + 8;
+    let byte_pairs = start + 1024 + 8;
+    assert_eq!(
+        bytes[byte_pairs - 8..byte_pairs],
+        (1u64 << 16).to_ne_bytes()
+    );
+    let unmerged = (byte_pairs..byte_pairs + (4 << 16))
+        .step_by(4)
+        .find(|&at| bytes[at..at + 4] == Rank::MAX.to_ne_bytes())
+        .unwrap();
+
+    // Damage that the digest does not catch, as it is recomputed.
+    let damages: [(usize, Rank); 2] = [(start, 1), (unmerged, 999_999)];
+    for (at, rank) in damages {
+        let mut damaged = bytes.clone();
+        damaged[at..at + 4].copy_from_slice(&rank.to_ne_bytes());
+        let digest = Sha256::digest(&damaged[80..]);
+        damaged[48..80].copy_from_slice(&digest);
+        let damaged_path = dir.join("damaged");
+        std::fs::write(&damaged_path, &damaged).unwrap();
+        let error = CoreBPE::load_snapshot(&damaged_path, &key).err().unwrap();
+        assert!(error.to_string().contains("inconsistent tables"), "{error}");
+    }
+    std::fs::remove_dir_all(&dir).unwrap();
+}
+
+#[test]
+fn test_concurrent_snapshot_writes() {
+    use crate::snapshot::snapshot_key;
+
+    let dir = std::env::temp_dir().join(format!("harmony-snapshot-race-{}", std::process::id()));
+    std::fs::create_dir_all(&dir).unwrap();
+    let path = dir.join("snapshot");
+    let bpe = synthetic_bpe_with_specials(5);
+    let key = snapshot_key("vocab", [], "");
+    std::thread::scope(|scope| {
+        for _ in 0..8 {
+            scope.spawn(|| bpe.write_snapshot(&path, &key).unwrap());
+        }
+    });
+    let loaded = CoreBPE::load_snapshot(&path, &key).unwrap();
+    let text = "Hello <|special_3|> world, it's 2024!";
+    assert_eq!(
+        loaded.encode_with_special_tokens(text),
+        bpe.encode_with_special_tokens(text)
+    );
+    // Every writer renamed its own temporary file into place.
+    assert_eq!(std::fs::read_dir(&dir).unwrap().count(), 1);
+    std::fs::remove_dir_all(&dir).unwrap();
+}
+
+#[test]
+fn test_static_snapshot() {
+    use crate::snapshot::snapshot_key;
+
+    let dir = std::env::temp_dir().join(format!("harmony-static-test-{}", std::process::id()));
+    std::fs::create_dir_all(&dir).unwrap();
+    let path = dir.join("snapshot");
+    let bpe = synthetic_bpe_with_specials(5);
+    let key = snapshot_key("vocab", [], "");
+    bpe.write_snapshot(&path, &key).unwrap();
+    // Stands in for a snapshot compiled into the binary, which is 8-byte aligned.
+    let bytes = std::fs::read(&path).unwrap();
+    std::fs::remove_dir_all(&dir).unwrap();
+    let words = vec![0u64; bytes.len() / 8 + 1].leak();
+    // SAFETY: the leaked words are `8 * words.len()` initialised bytes that live forever.
+    let buffer =
+        unsafe { std::slice::from_raw_parts_mut(words.as_mut_ptr() as *mut u8, 8 * words.len()) };
+    buffer[..bytes.len()].copy_from_slice(&bytes);
+    let buffer: &'static [u8] = buffer;
+    let (aligned, shifted) = (&buffer[..bytes.len()], &buffer[1..=bytes.len()]);
+
+    let loaded = CoreBPE::load_static_snapshot(aligned, &key).unwrap();
+    let text = "Hello <|special_3|> world, it's 2024!\n  and more  text<|special_1|>";
+    assert_eq!(
+        loaded.encode_with_special_tokens(text),
+        bpe.encode_with_special_tokens(text)
+    );
+    assert!(CoreBPE::load_static_snapshot(aligned, &snapshot_key("other", [], "")).is_err());
+    assert!(CoreBPE::load_static_snapshot(shifted, &key).is_err());
+}
+
+/// Compares building an encoder from its vocabulary with loading it from a snapshot. Run with
+/// `cargo test --release -- --ignored --nocapture bench_snapshot_load`.
+#[test]
+#[ignore]
+fn bench_snapshot_load() {
+    use crate::snapshot::snapshot_key;
+    use std::time::Instant;
+
+    let dir = std::env::temp_dir().join(format!("harmony-snapshot-bench-{}", std::process::id()));
+    std::fs::create_dir_all(&dir).unwrap();
+    let path = dir.join("snapshot");
+    let ranks = synthetic_bpe_ranks(200_000);
+    let specials = (0..1_000).map(|i| (format!("<|special_{i}|>"), 300_000 + i as Rank));
+    let start = Instant::now();
+    let bpe = CoreBPE::new(ranks, specials, r"\w+|\s+|[^\w\s]+").unwrap();
+    let build_elapsed = start.elapsed();
+    let key = snapshot_key("vocab", [], "");
+    bpe.write_snapshot(&path, &key).unwrap();
+    let start = Instant::now();
+    let loaded = CoreBPE::load_snapshot(&path, &key).unwrap();
+    let load_elapsed = start.elapsed();
+    let text = "The quick brown fox jumps over the lazy dog. ".repeat(100);
+    assert_eq!(loaded.encode_ordinary(&text), bpe.encode_ordinary(&text));
+    println!(
+        "build {build_elapsed:?}, snapshot load {load_elapsed:?} ({} bytes)",
+        std::fs::metadata(&path).unwrap().len()
+    );
+    std::fs::remove_dir_all(&dir).unwrap();
+}
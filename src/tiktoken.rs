@@ -1,79 +1,324 @@
 use std::borrow::Borrow;
-use std::collections::HashSet;
-use std::num::NonZeroU64;
-use std::thread;
+use std::cell::RefCell;
+use std::cmp::Reverse;
+use std::collections::{BinaryHeap, HashSet};
+use std::path::Path;
+use std::rc::Rc;
+use std::sync::{Arc, OnceLock, Weak};
 
+use aho_corasick::{AhoCorasick, MatchKind};
 use fancy_regex::Regex;
 use rustc_hash::FxHashMap as HashMap;
 
+use crate::parallel;
+use crate::pretokenizer::{o200k_chunks, o200k_pattern, O200kPieces};
+use crate::snapshot::{SnapshotKey, SnapshotReader, SnapshotWriter};
+use crate::table::{Buffer, Pod, Table};
+use crate::vocab::Vocab;
+
 pub type Rank = u32;
 
-fn _byte_pair_merge(ranks: &HashMap<Vec<u8>, Rank>, piece: &[u8]) -> Vec<(usize, Rank)> {
-    // This is a vector of (start, rank).
-    // The rank is of the pair starting at position start.
-    let mut parts = Vec::with_capacity(piece.len() + 1);
+/// Ranks of the merges between two adjacent tokens, keyed by the token ids rather than by the
+/// bytes of the merged token.
+///
+/// A pair of tokens merges exactly when their concatenated bytes are a token, and the rank of
+/// the merge is that token's rank. Every way of splitting a token into two tokens is recorded
+/// here, so looking up a pair gives the same answer as hashing the concatenated bytes, and
+/// the merged token comes out of the lookup for free.
+#[derive(Clone)]
+pub(crate) struct MergeTable {
+    byte_tokens: [Rank; 256],
+    // Merges of two single bytes, indexed by `first << 8 | second`. These are looked up for
+    // every byte of every piece, so they get a dense table.
+    byte_pairs: Table<Rank>,
+    // All other merges, in an open-addressing table: the merge of `left` and `right` is in
+    // the first empty-or-matching slot at or after `pair_hash(left, right) >> pairs_shift`,
+    // wrapping around. Like `Vocab`, the hash is fixed so that the table can be snapshotted.
+    pairs: Table<PairSlot>,
+    pairs_shift: u32,
+}
+
+#[derive(Clone, Copy)]
+#[repr(C)]
+struct PairSlot {
+    left: Rank,
+    right: Rank,
+    merged: Rank,
+}
+
+// SAFETY: three `u32`s.
+unsafe impl Pod for PairSlot {}
+
+// An empty slot. It also reads as "no merge" to a lookup that happens to match it.
+const EMPTY_PAIR: PairSlot = PairSlot {
+    left: Rank::MAX,
+    right: Rank::MAX,
+    merged: Rank::MAX,
+};
+
+#[inline(always)]
+fn pair_hash(left: Rank, right: Rank) -> u64 {
+    ((left as u64) << 32 | right as u64).wrapping_mul(0x9e37_79b9_7f4a_7c15)
+}
+
+impl MergeTable {
+    /// Returns `None` if `vocab` does not have a token for every single byte.
+    pub(crate) fn new(vocab: &Vocab) -> Option<Self> {
+        let mut byte_tokens = [Rank::MAX; 256];
+        for (byte, token) in byte_tokens.iter_mut().enumerate() {
+            *token = vocab.rank(&[byte as u8])?;
+        }
+        let mut byte_pairs = vec![Rank::MAX; 1 << 16];
+        let mut merges = Vec::new();
+        for (bytes, rank) in vocab.ordinary_tokens() {
+            if bytes.len() == 2 {
+                byte_pairs[(bytes[0] as usize) << 8 | bytes[1] as usize] = rank;
+            }
+            for split in 1..bytes.len() {
+                if let (Some(left), Some(right)) =
+                    (vocab.rank(&bytes[..split]), vocab.rank(&bytes[split..]))
+                {
+                    merges.push(PairSlot {
+                        left,
+                        right,
+                        merged: rank,
+                    });
+                }
+            }
+        }
+
+        // At most two thirds of the slots are used. Most lookups are of pairs that do not
+        // merge, and those probe up to the next empty slot.
+        let slots = (merges.len() + merges.len() / 2).next_power_of_two().max(2);
+        let pairs_shift = 64 - slots.trailing_zeros();
+        let mut pairs = vec![EMPTY_PAIR; slots];
+        for merge in merges {
+            // A pair of tokens concatenates to exactly one token, so there are no duplicates.
+            let mut slot = (pair_hash(merge.left, merge.right) >> pairs_shift) as usize;
+            while pairs[slot].left != Rank::MAX {
+                slot = (slot + 1) & (slots - 1);
+            }
+            pairs[slot] = merge;
+        }
+        Some(Self {
+            byte_tokens,
+            byte_pairs: byte_pairs.into(),
+            pairs: pairs.into(),
+            pairs_shift,
+        })
+    }
+
+    fn write_snapshot(&self, snapshot: &mut SnapshotWriter) {
+        snapshot.table(&Table::from(self.byte_tokens.to_vec()));
+        snapshot.table(&self.byte_pairs);
+        snapshot.table(&self.pairs);
+        snapshot.scalar(self.pairs_shift as u64);
+    }
+
+    /// Read the merge table that `write_snapshot` wrote for `vocab`.
+    fn read_snapshot(
+        snapshot: &mut SnapshotReader<impl Buffer>,
+        vocab: &Vocab,
+    ) -> std::io::Result<Self> {
+        let byte_tokens: Table<Rank> = snapshot.table()?;
+        let merges = Self {
+            byte_tokens: byte_tokens
+                .as_ref()
+                .try_into()
+                .map_err(|_| invalid_snapshot())?,
+            byte_pairs: snapshot.table()?,
+            pairs: snapshot.table()?,
+            pairs_shift: snapshot.scalar()? as u32,
+        };
+        // Like `Vocab::read_snapshot`, check what encoding relies on, including that every rank
+        // a lookup can return is a token of `vocab`, so that a damaged snapshot is rejected here
+        // rather than found out by a panic later.
+        let slots = merges.pairs.len();
+        let shape_valid = merges.byte_pairs.len() == 1 << 16
+            && slots.is_power_of_two()
+            && slots >= 2
+            && merges.pairs_shift == 64 - slots.trailing_zeros()
+            && merges.pairs.iter().any(|slot| slot.left == Rank::MAX);
+        let byte_tokens_valid =
+            (0..=255u8).all(|byte| vocab.rank(&[byte]) == Some(merges.byte_token(byte)));
+        let byte_pairs_valid = merges.byte_pairs.iter().enumerate().all(|(pair, &rank)| {
+            rank == Rank::MAX
+                || vocab.token_bytes(rank) == Some(&[(pair >> 8) as u8, pair as u8][..])
+        });
+        let pairs_valid = merges
+            .pairs
+            .iter()
+            .all(|slot| slot.left == Rank::MAX || vocab.token_bytes(slot.merged).is_some());
+        if !shape_valid || !byte_tokens_valid || !byte_pairs_valid || !pairs_valid {
+            return Err(invalid_snapshot());
+        }
+        Ok(merges)
+    }
+
+    #[inline(always)]
+    fn byte_token(&self, byte: u8) -> Rank {
+        self.byte_tokens[byte as usize]
+    }
+
+    #[inline(always)]
+    fn byte_pair(&self, first: u8, second: u8) -> Rank {
+        self.byte_pairs[(first as usize) << 8 | second as usize]
+    }
 
-    // Note that we hash bytes when indexing into `ranks`, not token pairs. As long as we train BPE
+    /// The token that `left` and `right` merge into, or `Rank::MAX` if they do not merge.
+    #[inline(always)]
+    fn get(&self, left: Rank, right: Rank) -> Rank {
+        let mask = self.pairs.len() - 1;
+        let mut slot = (pair_hash(left, right) >> self.pairs_shift) as usize;
+        loop {
+            let entry = self.pairs[slot];
+            if entry.left == left && entry.right == right {
+                return entry.merged;
+            }
+            if entry.left == Rank::MAX {
+                return Rank::MAX;
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+}
+
+fn invalid_snapshot() -> std::io::Error {
+    std::io::Error::new(
+        std::io::ErrorKind::InvalidData,
+        "invalid snapshot: inconsistent tables",
+    )
+}
+
+pub(crate) fn _byte_pair_merge_small(merges: &MergeTable, piece: &[u8]) -> Vec<Rank> {
+    // This is a vector of (token, rank).
+    // The rank is of the merge of the token with the following one, and is also the token
+    // they merge into.
+    let mut parts = Vec::with_capacity(piece.len());
+
+    // Note that the ranks of merges are the ranks of the merged tokens. As long as we train BPE
     // the way we currently do, this is equivalent. An easy way to break this would be to decouple
     // merge priority from token index or to prevent specific token merges.
     let mut min_rank: (Rank, usize) = (Rank::MAX, usize::MAX);
     for i in 0..piece.len() - 1 {
-        let rank = *ranks.get(&piece[i..i + 2]).unwrap_or(&Rank::MAX);
+        let rank = merges.byte_pair(piece[i], piece[i + 1]);
         if rank < min_rank.0 {
             min_rank = (rank, i);
         }
-        parts.push((i, rank));
-    }
-    parts.push((piece.len() - 1, Rank::MAX));
-    parts.push((piece.len(), Rank::MAX));
-
-    let get_rank = {
-        #[inline(always)]
-        |parts: &Vec<(usize, Rank)>, i: usize| {
-            if (i + 3) < parts.len() {
-                // Similar to `piece[i..i + 2]` above. The +3 is because we haven't yet deleted
-                // parts[i + 1], see comment in the main loop.
-                *ranks
-                    .get(&piece[parts[i].0..parts[i + 3].0])
-                    .unwrap_or(&Rank::MAX)
-            } else {
-                Rank::MAX
-            }
-        }
-    };
+        parts.push((merges.byte_token(piece[i]), rank));
+    }
+    parts.push((merges.byte_token(piece[piece.len() - 1]), Rank::MAX));
 
     // If you have n parts and m merges, this does O(mn) work.
-    // We could do something with a heap and do O(m log n) work.
     // n is often very small so considerations like cache-locality outweigh the algorithmic
-    // complexity downsides of the `parts` vector.
+    // complexity downsides of the `parts` vector. Long pieces go through
+    // `_byte_pair_merge_large` instead.
     while min_rank.0 != Rank::MAX {
         let i = min_rank.1;
+        let token = min_rank.0;
         // Update parts[i] and parts[i - 1] before removing parts[i + 1], since
         // `parts.remove(i + 1)` will thrash the cache.
         if i > 0 {
-            parts[i - 1].1 = get_rank(&parts, i - 1);
+            parts[i - 1].1 = merges.get(parts[i - 1].0, token);
         }
-        parts[i].1 = get_rank(&parts, i);
+        parts[i] = match parts.get(i + 2) {
+            Some(&(next, _)) => (token, merges.get(token, next)),
+            None => (token, Rank::MAX),
+        };
         parts.remove(i + 1);
 
         min_rank = (Rank::MAX, usize::MAX);
-        for (i, &(_, rank)) in parts[..parts.len() - 1].iter().enumerate() {
+        for (i, &(_, rank)) in parts.iter().enumerate() {
             if rank < min_rank.0 {
                 min_rank = (rank, i);
             }
         }
     }
-    parts
+    parts.into_iter().map(|(token, _)| token).collect()
 }
 
-pub fn byte_pair_encode(piece: &[u8], ranks: &HashMap<Vec<u8>, Rank>) -> Vec<Rank> {
+// The smallest chunk `encode_ordinary_into` splits a large text into.
+const MIN_CHUNK_LEN: usize = 16 * 1024;
+
+/// Pieces at least this long are merged with `_byte_pair_merge_large`. Below it, the linear
+/// scans of `_byte_pair_merge_small` are cheaper than maintaining a heap.
+const LARGE_PIECE_THRESHOLD: usize = 256;
+
+/// Same result as `_byte_pair_merge_small`, in O(m log n) instead of O(mn) work.
+///
+/// Parts are kept in a doubly linked list indexed by their start offset, and the candidate
+/// merges in a min-heap of (rank, start). Merging updates the ranks of at most two
+/// neighbours; their old heap entries are not removed but skipped when popped, because the
+/// rank they carry no longer matches `rank[start]`. Ties are broken by start offset, which
+/// is the leftmost-first order of the linear scan.
+pub(crate) fn _byte_pair_merge_large(merges: &MergeTable, piece: &[u8]) -> Vec<Rank> {
+    let n = piece.len();
+
+    // For the part starting at offset i: `token[i]` is its token, `next[i]` the start of the
+    // following part (or `n`), `prev[i]` the start of the preceding one, and `rank[i]` the
+    // rank of merging the part with the following one. Parts that have been merged away
+    // have `Rank::MAX`.
+    let mut token: Vec<Rank> = piece.iter().map(|&byte| merges.byte_token(byte)).collect();
+    let mut next: Vec<usize> = (1..=n).collect();
+    let mut prev: Vec<usize> = (0..n).map(|i| i.wrapping_sub(1)).collect();
+    let mut rank = vec![Rank::MAX; n];
+    let mut heap = BinaryHeap::with_capacity(n);
+    for (i, pair_rank) in rank[..n - 1].iter_mut().enumerate() {
+        *pair_rank = merges.byte_pair(piece[i], piece[i + 1]);
+        if *pair_rank != Rank::MAX {
+            heap.push(Reverse((*pair_rank, i)));
+        }
+    }
+
+    while let Some(Reverse((min_rank, i))) = heap.pop() {
+        if rank[i] != min_rank {
+            continue;
+        }
+        // Merge the part at i with the following part j.
+        let j = next[i];
+        let k = next[j];
+        next[i] = k;
+        if k < n {
+            prev[k] = i;
+        }
+        rank[j] = Rank::MAX;
+        token[i] = min_rank;
+
+        rank[i] = if k < n {
+            merges.get(token[i], token[k])
+        } else {
+            Rank::MAX
+        };
+        if rank[i] != Rank::MAX {
+            heap.push(Reverse((rank[i], i)));
+        }
+        if i > 0 {
+            let p = prev[i];
+            rank[p] = merges.get(token[p], token[i]);
+            if rank[p] != Rank::MAX {
+                heap.push(Reverse((rank[p], p)));
+            }
+        }
+    }
+
+    let mut tokens = Vec::new();
+    let mut i = 0;
+    while i < n {
+        tokens.push(token[i]);
+        i = next[i];
+    }
+    tokens
+}
+
+pub(crate) fn byte_pair_encode(piece: &[u8], merges: &MergeTable) -> Vec<Rank> {
     if piece.len() == 1 {
-        return vec![ranks[piece]];
+        return vec![merges.byte_token(piece[0])];
+    }
+    if piece.len() >= LARGE_PIECE_THRESHOLD {
+        _byte_pair_merge_large(merges, piece)
+    } else {
+        _byte_pair_merge_small(merges, piece)
     }
-    _byte_pair_merge(ranks, piece)
-        .windows(2)
-        .map(|part| ranks[&piece[part[0].0..part[1].0]])
-        .collect()
 }
 
 // Various performance notes:
@@ -92,13 +337,18 @@ pub fn byte_pair_encode(piece: &[u8], ranks: &HashMap<Vec<u8>, Rank>) -> Vec<Ran
 // some mutable scratch space inside of `regex`. This absolutely kills performance. When using plain
 // old `regex`, we don't hit this, because `find_iter` has a different code path.
 // Related: https://github.com/rust-lang/regex/blob/master/PERFORMANCE.md
-// Anyway, the way we get around this is with having a (mostly) thread local clone of the regex for
-// each thread.
+// Anyway, the way we get around this is with having a thread local clone of the regex for each
+// thread, see `ThreadLocalRegex`.
 //
 // Threading
 // =========
 // I tried using `rayon`. It wasn't really faster than using Python threads and releasing the GIL.
-// So goodbye `rayon`! Let thread count etc be in control of our Python users.
+// So goodbye `rayon`! The batch methods spread their inputs over the process-wide worker pool
+// in `crate::parallel`, which saves Python users from managing threads when they have many
+// documents to tokenize. Single encodes stay on the calling thread unless the text is larger
+// than `parallel::chunked_encode_threshold()`; such texts are cut at positions where the
+// pre-tokenizer split is known not to change (see `o200k_chunks`) and the chunks are encoded
+// in parallel.
 //
 // Caching
 // =======
@@ -114,22 +364,193 @@ pub fn byte_pair_encode(piece: &[u8], ranks: &HashMap<Vec<u8>, Rank>) -> Vec<Ran
 // Hashing
 // =======
 // We use FxHashMap instead of the standard HashMap. This is maybe like a 5-10% win?
-// The current implementation ends up doing a lot of hashing of bytes. In theory, this could be made
-// to be hashing of two-tuples of ints, which looks like it may also be a couple percent faster.
-
-struct FakeThreadId(NonZeroU64);
-
-fn hash_current_thread() -> usize {
-    // It's easier to use unsafe than to use nightly. Rust has this nice u64 thread id counter
-    // that works great for our use case of avoiding collisions in our array. Unfortunately,
-    // it's private. However, there are only so many ways you can layout a u64, so just transmute
-    // https://github.com/rust-lang/rust/issues/67939
-    const _: [u8; 8] = [0; std::mem::size_of::<std::thread::ThreadId>()];
-    const _: [u8; 8] = [0; std::mem::size_of::<FakeThreadId>()];
-    let x = unsafe {
-        std::mem::transmute::<std::thread::ThreadId, FakeThreadId>(thread::current().id()).0
-    };
-    u64::from(x) as usize
+// The merge loops used to hash the bytes of every candidate merge. They now look up pairs of
+// token ids in a `MergeTable` built once per encoder, and pairs of single bytes (the first
+// lookup for every byte of a piece) in a dense array.
+
+/// A regex that hands every thread its own clone, so that threads never share the regex's
+/// mutable scratch space (see the performance notes above).
+///
+/// Clones are created the first time a thread uses the regex and are dropped with the thread.
+/// Clones of a `ThreadLocalRegex` share their per-thread clones.
+#[derive(Clone)]
+struct ThreadLocalRegex {
+    regex: Arc<SharedRegex>,
+}
+
+struct SharedRegex {
+    pattern: String,
+    // Compiled on first use for encoders loaded from a snapshot, which may never need it.
+    regex: OnceLock<Regex>,
+}
+
+type RegexClones = HashMap<usize, (Weak<SharedRegex>, Rc<Regex>)>;
+
+thread_local! {
+    // This thread's clones of every `ThreadLocalRegex` it has used, keyed by the address of
+    // the shared regex. The `Weak` tells whether the regex is still alive, so that an entry
+    // is not mistaken for a new regex that was allocated at the same address.
+    static REGEX_CLONES: RefCell<RegexClones> = RefCell::new(HashMap::default());
+}
+
+impl ThreadLocalRegex {
+    fn new(pattern: &str) -> Result<Self, fancy_regex::Error> {
+        let regex = Self::lazy(pattern.to_owned());
+        let _ = regex.regex.regex.set(Regex::new(pattern)?);
+        Ok(regex)
+    }
+
+    /// A regex that is compiled when it is first used. `pattern` must be valid.
+    fn lazy(pattern: String) -> Self {
+        Self {
+            regex: Arc::new(SharedRegex {
+                pattern,
+                regex: OnceLock::new(),
+            }),
+        }
+    }
+
+    fn pattern(&self) -> &str {
+        &self.regex.pattern
+    }
+
+    /// This thread's clone of the regex.
+    fn local(&self) -> Rc<Regex> {
+        let key = Arc::as_ptr(&self.regex) as usize;
+        REGEX_CLONES.with(|clones| {
+            let mut clones = clones.borrow_mut();
+            if let Some((shared, local)) = clones.get(&key) {
+                if shared.strong_count() > 0 {
+                    return local.clone();
+                }
+            }
+            // Forget the clones of regexes that have been dropped since.
+            clones.retain(|_, (shared, _)| shared.strong_count() > 0);
+            let regex = self.regex.regex.get_or_init(|| {
+                Regex::new(&self.regex.pattern).expect("snapshotted pattern compiled before")
+            });
+            let local = Rc::new(regex.clone());
+            clones.insert(key, (Arc::downgrade(&self.regex), local.clone()));
+            local
+        })
+    }
+}
+
+/// The set of special tokens that `CoreBPE::encode_with_policy` encodes as special tokens.
+/// Special tokens outside the set are encoded as ordinary text.
+///
+/// Build a policy once with `CoreBPE::special_policy` and reuse it; it is only meaningful for
+/// the `CoreBPE` that built it.
+#[derive(Clone)]
+pub struct SpecialPolicy {
+    // Bit `rank - first_rank` is set for every allowed special rank.
+    first_rank: Rank,
+    allowed: Box<[u64]>,
+    // `None` if no special token is allowed.
+    matcher: Option<Arc<SpecialMatcher>>,
+}
+
+// Finds the allowed special tokens in a single pass. Pattern `i` of the automaton is the
+// special token `ranks[i]`.
+struct SpecialMatcher {
+    automaton: AhoCorasick,
+    ranks: Box<[Rank]>,
+}
+
+impl SpecialPolicy {
+    /// `ranks` must be sorted and free of duplicates.
+    fn new(
+        special_tokens_encoder: &HashMap<String, Rank>,
+        vocab: &Vocab,
+        ranks: Vec<Rank>,
+    ) -> Result<Self, aho_corasick::BuildError> {
+        let first_rank = special_tokens_encoder.values().copied().min().unwrap_or(0);
+        let last_rank = special_tokens_encoder.values().copied().max().unwrap_or(0);
+        let mut allowed = vec![0u64; (last_rank - first_rank) as usize / 64 + 1];
+        for &rank in &ranks {
+            let bit = (rank - first_rank) as usize;
+            allowed[bit / 64] |= 1 << (bit % 64);
+        }
+        let matcher = if ranks.is_empty() {
+            None
+        } else {
+            // Leftmost-longest, so that the result does not depend on the order of the
+            // patterns when one special token is a prefix of another.
+            let automaton = AhoCorasick::builder()
+                .match_kind(MatchKind::LeftmostLongest)
+                .build(ranks.iter().map(|&rank| vocab.token_bytes(rank).unwrap()))?;
+            Some(Arc::new(SpecialMatcher {
+                automaton,
+                ranks: ranks.into_boxed_slice(),
+            }))
+        };
+        Ok(Self {
+            first_rank,
+            allowed: allowed.into_boxed_slice(),
+            matcher,
+        })
+    }
+
+    /// Whether the special token `rank` is allowed.
+    pub fn allows(&self, rank: Rank) -> bool {
+        let Some(bit) = rank.checked_sub(self.first_rank) else {
+            return false;
+        };
+        let bit = bit as usize;
+        self.allowed
+            .get(bit / 64)
+            .is_some_and(|word| word & (1 << (bit % 64)) != 0)
+    }
+
+    /// The number of allowed special tokens.
+    pub fn len(&self) -> usize {
+        self.matcher
+            .as_ref()
+            .map_or(0, |matcher| matcher.ranks.len())
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.matcher.is_none()
+    }
+
+    // The allowed special ranks, in order.
+    #[cfg(any(feature = "python-binding", feature = "wasm-binding"))]
+    fn ranks(&self) -> &[Rank] {
+        self.matcher.as_ref().map_or(&[], |matcher| &matcher.ranks)
+    }
+}
+
+/// Remembers the last policy built, for callers that are handed the allowed special tokens anew
+/// with every encode, like the Python and JS bindings, but usually the same ones. Building a
+/// policy for some but not all special tokens builds an automaton, which costs more than most
+/// encodes.
+#[cfg(any(feature = "python-binding", feature = "wasm-binding"))]
+#[derive(Default)]
+pub(crate) struct SpecialPolicyCache {
+    last: std::sync::Mutex<Option<SpecialPolicy>>,
+}
+
+#[cfg(any(feature = "python-binding", feature = "wasm-binding"))]
+impl SpecialPolicyCache {
+    /// The policy of `bpe` that allows the special tokens in `allowed_special`, like
+    /// `CoreBPE::special_policy`. A cache must only be used with one `CoreBPE`.
+    pub(crate) fn get<'a>(
+        &self,
+        bpe: &CoreBPE,
+        allowed_special: impl IntoIterator<Item = &'a str>,
+    ) -> SpecialPolicy {
+        let ranks = bpe.special_ranks(allowed_special);
+        let mut last = self
+            .last
+            .lock()
+            .unwrap_or_else(std::sync::PoisonError::into_inner);
+        if let Some(policy) = last.as_ref().filter(|policy| policy.ranks() == ranks) {
+            return policy.clone();
+        }
+        let policy = bpe.policy_for_ranks(ranks);
+        *last = Some(policy.clone());
+        policy
+    }
 }
 
 #[derive(Debug, Clone)]
@@ -158,29 +579,31 @@ impl std::fmt::Display for DecodeError {
 
 impl std::error::Error for DecodeError {}
 
-const MAX_NUM_THREADS: usize = 128;
-
 #[derive(Clone)]
 pub struct CoreBPE {
-    encoder: HashMap<Vec<u8>, Rank>,
+    merges: MergeTable,
     special_tokens_encoder: HashMap<String, Rank>,
-    decoder: HashMap<Rank, Vec<u8>>,
-    special_tokens_decoder: HashMap<Rank, Vec<u8>>,
-    regex_tls: Vec<Regex>,
-    special_regex_tls: Vec<Regex>,
-    sorted_token_bytes: Vec<Vec<u8>>,
+    vocab: Vocab,
+    regex: ThreadLocalRegex,
+    // Allows every special token, for `encode_with_special_tokens`.
+    all_special: SpecialPolicy,
+    // Whether `regex` is the o200k pattern, which `O200kPieces` splits without the regex.
+    o200k_split: bool,
+    // The ordinary tokens, ordered by their bytes.
+    sorted_ranks: Table<Rank>,
 }
 
 impl CoreBPE {
-    fn _get_tl_regex(&self) -> &Regex {
-        // See performance notes above for what this is about
-        // It's also a little janky, please make a better version of it!
-        // However, it's nice that this doesn't leak memory to short-lived threads
-        &self.regex_tls[hash_current_thread() % MAX_NUM_THREADS]
-    }
-
-    fn _get_tl_special_regex(&self) -> &Regex {
-        &self.special_regex_tls[hash_current_thread() % MAX_NUM_THREADS]
+    /// Call `f` with every piece that the pattern splits `text` into.
+    #[inline]
+    fn for_each_piece<'t>(&self, text: &'t str, mut f: impl FnMut(&'t str)) {
+        if self.o200k_split {
+            O200kPieces::new(text).for_each(f);
+        } else {
+            for mat in self.regex.local().find_iter(text) {
+                f(mat.unwrap().as_str());
+            }
+        }
     }
 
     pub fn decode_bytes<S, E>(&self, tokens: S) -> Result<Vec<u8>, DecodeKeyError>
@@ -191,18 +614,43 @@ impl CoreBPE {
         let token_iter = tokens.into_iter();
         let (lower, _upper) = token_iter.size_hint();
         let mut ret = Vec::with_capacity(lower * 2);
-        for token in token_iter {
+        self.decode_bytes_into(token_iter, &mut ret)?;
+        Ok(ret)
+    }
+
+    /// Like `decode_bytes`, but appends to `into` so that callers can reuse a buffer.
+    /// On error, `into` is left as it was before the call.
+    pub fn decode_bytes_into<S, E>(
+        &self,
+        tokens: S,
+        into: &mut Vec<u8>,
+    ) -> Result<(), DecodeKeyError>
+    where
+        S: IntoIterator<Item = E>,
+        E: Borrow<Rank>,
+    {
+        let initial_len = into.len();
+        for token in tokens {
             let &token = token.borrow();
-            let token_bytes = match self.decoder.get(&token) {
-                Some(bytes) => bytes,
-                None => self
-                    .special_tokens_decoder
-                    .get(&token)
-                    .ok_or(DecodeKeyError { token })?,
+            let Some(token_bytes) = self.vocab.token_bytes(token) else {
+                into.truncate(initial_len);
+                return Err(DecodeKeyError { token });
             };
-            ret.extend(token_bytes);
+            into.extend_from_slice(token_bytes);
         }
-        Ok(ret)
+        Ok(())
+    }
+
+    /// The bytes of `token`, which may be a special token, or `None` if there is no such token.
+    #[inline]
+    pub fn token_bytes(&self, token: Rank) -> Option<&[u8]> {
+        self.vocab.token_bytes(token)
+    }
+
+    /// The number of bytes `token` decodes to, or `None` if there is no such token.
+    #[inline]
+    pub fn token_byte_len(&self, token: Rank) -> Option<usize> {
+        self.vocab.token_bytes(token).map(<[u8]>::len)
     }
 
     pub fn decode_utf8<S, E>(&self, tokens: S) -> Result<String, DecodeError>
@@ -219,76 +667,123 @@ impl CoreBPE {
     }
 
     pub fn encode_ordinary(&self, text: &str) -> Vec<Rank> {
+        let mut ret = vec![];
+        self.encode_ordinary_into(text, &mut ret);
+        ret
+    }
+
+    /// Encode `text` as ordinary text onto `ret`. Returns how many tokens came from the last
+    /// piece, or zero if `text` is empty.
+    ///
+    /// Large texts are split into chunks that encode to the same tokens on their own, and the
+    /// chunks are encoded in parallel on the shared worker pool. Inside a worker, e.g. for one
+    /// text of a batch, the text is encoded in one piece, as there is no pool to spread it on.
+    fn encode_ordinary_into(&self, text: &str, ret: &mut Vec<Rank>) -> usize {
+        if self.o200k_split
+            && text.len() >= parallel::chunked_encode_threshold()
+            && parallel::can_help()
+        {
+            let chunk_len = (text.len() / (4 * parallel::max_threads())).max(MIN_CHUNK_LEN);
+            return self.encode_chunks(&o200k_chunks(text, chunk_len), ret);
+        }
+        self.encode_pieces(text, ret)
+    }
+
+    /// Encode the `chunks` of a text in parallel onto `ret`, like [`Self::encode_pieces`].
+    pub(crate) fn encode_chunks(&self, chunks: &[&str], ret: &mut Vec<Rank>) -> usize {
+        let encoded = parallel::map(chunks, |chunk| {
+            let mut tokens = vec![];
+            let last_piece_token_len = self.encode_pieces(chunk, &mut tokens);
+            (tokens, last_piece_token_len)
+        });
+        let mut last_piece_token_len = 0;
+        for (tokens, last) in encoded {
+            ret.extend(tokens);
+            last_piece_token_len = last;
+        }
+        last_piece_token_len
+    }
+
+    /// Encode `text` onto `ret` on the calling thread. Returns how many tokens came from the
+    /// last piece.
+    fn encode_pieces(&self, text: &str, ret: &mut Vec<Rank>) -> usize {
         // This is the core of the encoding logic; the other functions in here
         // just make things complicated :-)
-        let regex = self._get_tl_regex();
-        let mut ret = vec![];
-        for mat in regex.find_iter(text) {
-            let piece = mat.unwrap().as_str().as_bytes();
-            match self.encoder.get(piece) {
-                Some(token) => ret.push(*token),
-                None => ret.extend(&byte_pair_encode(piece, &self.encoder)),
+        let mut last_piece_token_len = 0;
+        self.for_each_piece(text, |piece| {
+            let piece = piece.as_bytes();
+            if let Some(token) = self.vocab.rank(piece) {
+                last_piece_token_len = 1;
+                ret.push(token);
+                return;
             }
-        }
-        ret
+            let tokens = byte_pair_encode(piece, &self.merges);
+            last_piece_token_len = tokens.len();
+            ret.extend(&tokens);
+        });
+        last_piece_token_len
+    }
+
+    /// [`Self::encode_ordinary`] every text, in parallel. The results are in the order of
+    /// `texts`.
+    pub fn encode_ordinary_batch<S: AsRef<str> + Sync>(&self, texts: &[S]) -> Vec<Vec<Rank>> {
+        parallel::map(texts, |text| self.encode_ordinary(text.as_ref()))
     }
 
     pub fn encode(&self, text: &str, allowed_special: &HashSet<&str>) -> (Vec<Rank>, usize) {
-        let special_regex = self._get_tl_special_regex();
-        let regex = self._get_tl_regex();
+        self.encode_with_policy(text, &self.special_policy(allowed_special.iter().copied()))
+    }
+
+    /// Encode `text`, turning the special tokens that `policy` allows into their special ranks.
+    ///
+    /// Also returns how many tokens came from the last piece of the pre-tokenizer split.
+    pub fn encode_with_policy(&self, text: &str, policy: &SpecialPolicy) -> (Vec<Rank>, usize) {
+        // The automaton only knows the allowed special tokens, so every match is one and the
+        // text is scanned once.
+        let mut specials = policy.matcher.iter().flat_map(|matcher| {
+            matcher
+                .automaton
+                .find_iter(text)
+                .map(|m| (m.span(), matcher.ranks[m.pattern().as_usize()]))
+        });
         let mut ret = vec![];
 
         let mut start = 0;
-        let mut last_piece_token_len = 0;
-        loop {
-            let mut next_special;
-            let mut start_find = start;
-            loop {
-                // Find the next allowed special token, if any
-                next_special = special_regex.find_from_pos(text, start_find).unwrap();
-                match next_special {
-                    Some(m) => {
-                        if allowed_special.contains(&text[m.start()..m.end()]) {
-                            break;
-                        }
-                        start_find = m.start() + 1;
-                    }
-                    None => break,
-                }
-            }
-            let end = next_special.map_or(text.len(), |m| m.start());
-
-            // Okay, here we go, compare this logic to encode_ordinary
-            for mat in regex.find_iter(&text[start..end]) {
-                let piece = mat.unwrap().as_str().as_bytes();
-                if let Some(token) = self.encoder.get(piece) {
-                    last_piece_token_len = 1;
-                    ret.push(*token);
-                    continue;
-                }
-                let tokens = byte_pair_encode(piece, &self.encoder);
-                last_piece_token_len = tokens.len();
-                ret.extend(&tokens);
-            }
+        let last_piece_token_len = loop {
+            let next_special = specials.next();
+            let end = next_special.map_or(text.len(), |(span, _)| span.start);
+
+            // Okay, here we go, compare this logic to encode_ordinary. The last segment is
+            // empty if the text ends with a special token, which makes last_piece_token_len 0.
+            let last_piece_token_len = self.encode_ordinary_into(&text[start..end], &mut ret);
 
             match next_special {
                 // And here we push the special token
-                Some(m) => {
-                    let piece = m.as_str();
-                    let token = self.special_tokens_encoder[piece];
+                Some((span, token)) => {
                     ret.push(token);
-                    start = m.end();
-                    last_piece_token_len = 0;
+                    start = span.end;
                 }
-                None => break,
+                None => break last_piece_token_len,
             }
-        }
+        };
 
         // last_piece_token_len is how many tokens came from the last regex split. This is used
         // for determining unstable tokens, since you can't merge across (stable) regex splits
         (ret, last_piece_token_len)
     }
 
+    /// [`Self::encode_with_policy`] every text, in parallel. The results are in the order of
+    /// `texts`.
+    pub fn encode_batch<S: AsRef<str> + Sync>(
+        &self,
+        texts: &[S],
+        policy: &SpecialPolicy,
+    ) -> Vec<Vec<Rank>> {
+        parallel::map(texts, |text| {
+            self.encode_with_policy(text.as_ref(), policy).0
+        })
+    }
+
     fn _increase_last_piece_token_len(
         &self,
         tokens: Vec<Rank>,
@@ -302,9 +797,9 @@ impl CoreBPE {
         // pattern. This can e.g. cause "\n" + " " to become "\n \n".
         // Here is a quick and dirty fix:
         {
-            let token_is_all_space = |token| {
-                self.decoder
-                    .get(token)
+            let token_is_all_space = |&token| {
+                self.vocab
+                    .token_bytes(token)
                     .map(|token_bytes| {
                         token_bytes
                             .iter()
@@ -360,14 +855,14 @@ impl CoreBPE {
         // (including tokens that exactly match unstable_bytes)
         // Separating this from the loop below helps with performance in a common case.
         let mut point = self
-            .sorted_token_bytes
-            .partition_point(|x| x.as_slice() < unstable_bytes.as_slice());
-        while point < self.sorted_token_bytes.len()
-            && self.sorted_token_bytes[point].starts_with(&unstable_bytes)
+            .sorted_ranks
+            .partition_point(|&x| self.sorted_token(x) < unstable_bytes.as_slice());
+        while point < self.sorted_ranks.len()
+            && self
+                .sorted_token(self.sorted_ranks[point])
+                .starts_with(&unstable_bytes)
         {
-            completions.insert(vec![
-                self.encoder[self.sorted_token_bytes[point].as_slice()],
-            ]);
+            completions.insert(vec![self.sorted_ranks[point]]);
             point += 1;
         }
 
@@ -378,15 +873,17 @@ impl CoreBPE {
             let prefix = &unstable_bytes[..i];
             let suffix = &unstable_bytes[i..];
             let mut point = self
-                .sorted_token_bytes
-                .partition_point(|x| x.as_slice() < suffix);
+                .sorted_ranks
+                .partition_point(|&x| self.sorted_token(x) < suffix);
             // TODO: Perf optimisation if suffix starts with " "?
-            while point < self.sorted_token_bytes.len()
-                && self.sorted_token_bytes[point].starts_with(suffix)
+            while point < self.sorted_ranks.len()
+                && self
+                    .sorted_token(self.sorted_ranks[point])
+                    .starts_with(suffix)
             {
-                let possibility = [prefix, self.sorted_token_bytes[point].as_slice()].concat();
+                let possibility = [prefix, self.sorted_token(self.sorted_ranks[point])].concat();
                 let encoded = match std::str::from_utf8(&possibility) {
-                    // Morally, this is byte_pair_encode(&possibility, &self.encoder)
+                    // Morally, this is byte_pair_encode(&possibility, &self.merges)
                     // But we might have introduced a regex split which would prevent merges.
                     // (particularly possible in the presence of unstable regex splits)
                     // So convert to UTF-8 and do regex splitting.
@@ -398,7 +895,7 @@ impl CoreBPE {
                     // would be a regex split before the UTF-8 truncation point.
                     // Probably niche enough that no one will ever notice (after all, people didn't
                     // notice all the big holes in the previous unstable token implementation)
-                    Err(_) => byte_pair_encode(&possibility, &self.encoder),
+                    Err(_) => byte_pair_encode(&possibility, &self.merges),
                     // Something like the following is intriguing but incorrect:
                     // Err(e) => self.encode_ordinary(unsafe {
                     //     std::str::from_utf8_unchecked(&possibility[..e.valid_up_to()])
@@ -408,7 +905,7 @@ impl CoreBPE {
                 let mut seq_len = 0;
                 for token in encoded {
                     seq.push(token);
-                    seq_len += self.decoder[&token].len();
+                    seq_len += self.vocab.token_bytes(token).unwrap().len();
                     if seq_len >= unstable_bytes.len() {
                         break;
                     }
@@ -433,11 +930,11 @@ impl CoreBPE {
             {
                 let mut reencoded = byte_pair_encode(
                     &unstable_bytes[..unstable_bytes.len() - last_decoded.1],
-                    &self.encoder,
+                    &self.merges,
                 );
                 reencoded.extend(byte_pair_encode(
                     &unstable_bytes[unstable_bytes.len() - last_decoded.1..],
-                    &self.encoder,
+                    &self.merges,
                 ));
                 completions.insert(reencoded);
             }
@@ -467,43 +964,105 @@ impl CoreBPE {
         special_tokens_encoder: HashMap<String, Rank>,
         pattern: &str,
     ) -> Result<Self, Box<dyn std::error::Error + Send + Sync>> {
-        let regex = Regex::new(pattern)?;
-
-        let special_regex = {
-            let parts = special_tokens_encoder
-                .keys()
-                .map(|s| fancy_regex::escape(s))
-                .collect::<Vec<_>>();
-            Regex::new(&parts.join("|"))?
-        };
+        let regex = ThreadLocalRegex::new(pattern)?;
 
-        let decoder: HashMap<Rank, Vec<u8>> =
-            encoder.iter().map(|(k, v)| (*v, k.clone())).collect();
+        let vocab = Vocab::new(&encoder, &special_tokens_encoder)?;
 
-        assert!(
-            encoder.len() == decoder.len(),
-            "Encoder and decoder must be of equal length; maybe you had duplicate token indices in your encoder?"
-        );
+        let merges =
+            MergeTable::new(&vocab).ok_or("Encoder must have a token for every single byte")?;
 
-        let special_tokens_decoder: HashMap<Rank, Vec<u8>> = special_tokens_encoder
-            .iter()
-            .map(|(k, v)| (*v, k.as_bytes().to_vec()))
-            .collect();
+        let mut special_ranks: Vec<Rank> = special_tokens_encoder.values().copied().collect();
+        special_ranks.sort_unstable();
+        special_ranks.dedup();
+        let all_special = SpecialPolicy::new(&special_tokens_encoder, &vocab, special_ranks)?;
 
-        // Clone because I don't know how to tell Rust I'm not going to change the map
-        let mut sorted_token_bytes: Vec<Vec<u8>> = encoder.keys().cloned().collect();
-        sorted_token_bytes.sort();
+        let mut sorted_ranks: Vec<Rank> = vocab.ordinary_tokens().map(|(_, rank)| rank).collect();
+        sorted_ranks.sort_unstable_by_key(|&rank| vocab.token_bytes(rank).unwrap());
 
         Ok(Self {
-            encoder,
+            merges,
             special_tokens_encoder,
-            decoder,
-            special_tokens_decoder,
-            regex_tls: (0..MAX_NUM_THREADS).map(|_| regex.clone()).collect(),
-            special_regex_tls: (0..MAX_NUM_THREADS)
-                .map(|_| special_regex.clone())
-                .collect(),
-            sorted_token_bytes,
+            vocab,
+            regex,
+            all_special,
+            o200k_split: pattern == o200k_pattern(),
+            sorted_ranks: sorted_ranks.into(),
+        })
+    }
+
+    /// Write the tables of this encoder to a snapshot at `path` that `load_snapshot` can map
+    /// back in. `key` must identify everything the encoder was built from.
+    pub(crate) fn write_snapshot(&self, path: &Path, key: &SnapshotKey) -> std::io::Result<()> {
+        let mut snapshot = SnapshotWriter::new(key);
+        self.vocab.write_snapshot(&mut snapshot);
+        self.merges.write_snapshot(&mut snapshot);
+        let mut special_ranks: Vec<Rank> = self.special_tokens_encoder.values().copied().collect();
+        special_ranks.sort_unstable();
+        snapshot.table(&Table::from(special_ranks));
+        snapshot.table(&self.sorted_ranks);
+        snapshot.table(&Table::from(self.regex.pattern().as_bytes().to_vec()));
+        snapshot.finish(path)
+    }
+
+    /// Load an encoder from a snapshot written by `write_snapshot` with the same `key`, after
+    /// checking its data against the digest in its header.
+    #[cfg(test)]
+    pub(crate) fn load_snapshot(path: &Path, key: &SnapshotKey) -> std::io::Result<Self> {
+        let snapshot = SnapshotReader::open(path, key)?;
+        snapshot.check_digest()?;
+        Self::from_snapshot(snapshot)
+    }
+
+    /// Load an encoder from a snapshot that is part of the binary, such as the one that the
+    /// `embedded-vocab` feature compiles in. `bytes` must be 8-byte aligned. Being part of the
+    /// binary, the snapshot is trusted like the code, so its digest is not checked.
+    pub(crate) fn load_static_snapshot(
+        bytes: &'static [u8],
+        key: &SnapshotKey,
+    ) -> std::io::Result<Self> {
+        Self::from_snapshot(SnapshotReader::new(bytes, key)?)
+    }
+
+    /// Load an encoder from `snapshot`, whose data the caller has checked against its digest or
+    /// otherwise trusts. The tables are used in place, in memory shared with every other
+    /// process that maps the snapshot.
+    pub(crate) fn from_snapshot(
+        mut snapshot: SnapshotReader<impl Buffer>,
+    ) -> std::io::Result<Self> {
+        let vocab = Vocab::read_snapshot(&mut snapshot)?;
+        let merges = MergeTable::read_snapshot(&mut snapshot, &vocab)?;
+        let special_ranks: Table<Rank> = snapshot.table()?;
+        let sorted_ranks: Table<Rank> = snapshot.table()?;
+        let pattern: Table<u8> = snapshot.table()?;
+        snapshot.finish()?;
+
+        let special_tokens_encoder = special_ranks
+            .iter()
+            .map(|&rank| {
+                let token = vocab.token_bytes(rank).ok_or_else(invalid_snapshot)?;
+                let token = String::from_utf8(token.to_vec()).map_err(|_| invalid_snapshot())?;
+                Ok((token, rank))
+            })
+            .collect::<std::io::Result<HashMap<_, _>>>()?;
+        if sorted_ranks
+            .iter()
+            .any(|&rank| vocab.token_bytes(rank).is_none())
+        {
+            return Err(invalid_snapshot());
+        }
+        let pattern = String::from_utf8(pattern.to_vec()).map_err(|_| invalid_snapshot())?;
+        let all_special =
+            SpecialPolicy::new(&special_tokens_encoder, &vocab, special_ranks.to_vec())
+                .map_err(|_| invalid_snapshot())?;
+
+        Ok(Self {
+            merges,
+            special_tokens_encoder,
+            vocab,
+            o200k_split: pattern == o200k_pattern(),
+            regex: ThreadLocalRegex::lazy(pattern),
+            all_special,
+            sorted_ranks,
         })
     }
 
@@ -514,12 +1073,46 @@ impl CoreBPE {
             .collect()
     }
 
+    /// Build the policy that allows the special tokens in `allowed_special`. Strings that are
+    /// not special tokens are ignored.
+    pub fn special_policy<'a>(
+        &self,
+        allowed_special: impl IntoIterator<Item = &'a str>,
+    ) -> SpecialPolicy {
+        self.policy_for_ranks(self.special_ranks(allowed_special))
+    }
+
+    // The sorted, distinct ranks of the special tokens in `allowed_special`.
+    fn special_ranks<'a>(&self, allowed_special: impl IntoIterator<Item = &'a str>) -> Vec<Rank> {
+        let mut ranks: Vec<Rank> = allowed_special
+            .into_iter()
+            .filter_map(|token| self.special_tokens_encoder.get(token).copied())
+            .collect();
+        ranks.sort_unstable();
+        ranks.dedup();
+        ranks
+    }
+
+    // `ranks` as returned by `special_ranks`.
+    fn policy_for_ranks(&self, ranks: Vec<Rank>) -> SpecialPolicy {
+        if ranks.len() == self.all_special.len() {
+            return self.all_special.clone();
+        }
+        SpecialPolicy::new(&self.special_tokens_encoder, &self.vocab, ranks)
+            // A subset of the special tokens fits in an automaton since all of them did.
+            .expect("failed to build special token matcher")
+    }
+
+    // The bytes of an entry of `sorted_ranks`.
+    fn sorted_token(&self, rank: Rank) -> &[u8] {
+        self.vocab.token_bytes(rank).unwrap()
+    }
+
     pub fn encode_with_special_tokens(&self, text: &str) -> Vec<Rank> {
-        let allowed_special = self.special_tokens();
-        self.encode(text, &allowed_special).0
+        self.encode_with_policy(text, &self.all_special).0
     }
 
     pub fn is_special_token(&self, token: Rank) -> bool {
-        self.special_tokens_decoder.contains_key(&token)
+        self.all_special.allows(token)
     }
 }
@@ -1,13 +1,17 @@
 use std::{
     collections::HashMap,
     fs::File,
-    io::{BufReader, BufWriter, Read as _, Write as _},
+    io::{BufWriter, Read as _, Write as _},
     path::{Path, PathBuf},
     sync::OnceLock,
 };
 
 use base64::{prelude::BASE64_STANDARD, Engine as _};
 
+use crate::pretokenizer::o200k_pattern;
+use crate::snapshot::{header_key, snapshot_key, SnapshotKey, EMBEDDED_SNAPSHOT};
+#[cfg(not(target_arch = "wasm32"))]
+use crate::snapshot::{snapshot_file_name, SnapshotReader};
 use crate::tiktoken::{CoreBPE, Rank};
 use sha1::Sha1;
 use sha2::{Digest as _, Sha256};
@@ -35,6 +39,12 @@ pub enum LoadError {
 
     #[error("failed to extend encoding")]
     FailedToExtendEncoding(#[source] Box<dyn std::error::Error + Send + Sync>),
+
+    #[error("failed to write snapshot to {0:?}")]
+    WriteSnapshot(PathBuf, #[source] std::io::Error),
+
+    #[error("the snapshot compiled into the crate cannot be used: {0}")]
+    EmbeddedSnapshot(#[source] std::io::Error),
 }
 
 #[derive(Debug, thiserror::Error)]
@@ -123,118 +133,116 @@ impl Encoding {
 
     #[cfg(not(target_arch = "wasm32"))]
     pub fn load(&self) -> Result<CoreBPE, LoadError> {
-        #[cfg(not(target_arch = "wasm32"))]
-        let (vocab_file_path, check_hash) =
-            if let Ok(base_dir) = std::env::var(TIKTOKEN_ENCODINGS_BASE_VAR) {
-                (PathBuf::from(base_dir).join(self.vocab_file_name()), true)
-            } else {
-                let url = self.public_vocab_file_url();
-                (
-                    download_or_find_cached_file(&url, Some(self.expected_hash()))
-                        .map_err(LoadError::DownloadOrLoadVocabFile)?,
-                    false,
-                )
-            };
+        let special_tokens = self.all_special_tokens();
+        let pattern = self.pattern();
+        let key = self.snapshot_key(&special_tokens, &pattern);
+        if let Some(bpe) = load_embedded(EMBEDDED_SNAPSHOT, &key)? {
+            return Ok(bpe);
+        }
+        // The built encoder is snapshotted into the cache dir, next to the downloaded vocab
+        // files. Failing to read or write a snapshot only costs the time to build the encoder.
+        // Only a private cache dir is trusted with snapshots; see `resolve_cache_dir`.
+        let snapshot_path = resolve_cache_dir()
+            .ok()
+            .filter(|cache_dir| is_private_dir(cache_dir))
+            .map(|cache_dir| cache_dir.join(snapshot_file_name(&key)));
+        let load_cached = || {
+            snapshot_path
+                .as_deref()
+                .and_then(|path| load_cached_snapshot(path, &key))
+        };
+        if let Some(bpe) = load_cached() {
+            return Ok(bpe);
+        }
+        // Processes that find no snapshot, like the workers of a server that starts cold, take
+        // turns: the first builds and writes the snapshot, and the rest map it once it is there.
+        let lock = snapshot_path.as_deref().and_then(SnapshotLock::acquire);
+        if lock.is_some() {
+            if let Some(bpe) = load_cached() {
+                return Ok(bpe);
+            }
+        }
 
-        match self {
-            Self::O200kHarmony => {
-                let mut specials: Vec<(String, Rank)> = self
-                    .special_tokens()
-                    .iter()
-                    .map(|(s, r)| ((*s).to_string(), *r))
-                    .collect();
-                specials.extend((200014..=201088).map(|id| (format!("<|reserved_{id}|>"), id)));
-                #[cfg(not(target_arch = "wasm32"))]
-                {
-                    load_encoding_from_file(
-                        vocab_file_path,
-                        check_hash.then(|| self.expected_hash()),
-                        specials,
-                        &self.pattern(),
-                    )
-                }
-                #[cfg(target_arch = "wasm32")]
-                {
-                    load_encoding_from_bytes(&vocab_bytes, None, specials, &self.pattern())
-                }
+        let expected_hash = self.expected_hash();
+        let base_dir = std::env::var(TIKTOKEN_ENCODINGS_BASE_VAR).ok();
+        let (vocab_file_path, verified) = if let Some(base_dir) = &base_dir {
+            let path = PathBuf::from(base_dir).join(self.vocab_file_name());
+            let verified = is_verified(&path, expected_hash);
+            (path, verified)
+        } else {
+            download_or_find_cached_file(&self.public_vocab_file_url(), Some(expected_hash))
+                .map_err(LoadError::DownloadOrLoadVocabFile)?
+        };
+        // A file that has not been verified since it last changed is hashed while it is parsed,
+        // and stamped if it matches. The stamp is taken first: were the file changed during the
+        // parse, e.g. by a process that downloads it again, a stamp taken afterwards would
+        // vouch for contents that were never hashed.
+        let load = |path: &Path, verified: bool| {
+            let stamp = (!verified).then(|| FileStamp::of(path).ok()).flatten();
+            let bpe = load_encoding_from_file(
+                path,
+                (!verified).then_some(expected_hash),
+                special_tokens.iter().cloned(),
+                &pattern,
+            )?;
+            if let Some(stamp) = stamp {
+                record_verified(path, &stamp, expected_hash);
             }
-            Self::O200kBase => {
-                let mut specials: Vec<(String, Rank)> = self
-                    .special_tokens()
-                    .iter()
-                    .map(|(s, r)| ((*s).to_string(), *r))
-                    .collect();
-                specials.extend((199998..=201088).map(|id| (format!("<|reserved_{id}|>"), id)));
-                #[cfg(not(target_arch = "wasm32"))]
-                {
-                    load_encoding_from_file(
-                        vocab_file_path,
-                        check_hash.then(|| self.expected_hash()),
-                        specials,
-                        &self.pattern(),
-                    )
-                }
-                #[cfg(target_arch = "wasm32")]
-                {
-                    load_encoding_from_bytes(&vocab_bytes, None, specials, &self.pattern())
-                }
+            Ok(bpe)
+        };
+        let bpe = match load(&vocab_file_path, verified) {
+            // A cached download that no longer matches its hash is fetched again.
+            Err(LoadError::InvalidTiktokenVocabFile(_)) if base_dir.is_none() && !verified => {
+                let _ = std::fs::remove_file(&vocab_file_path);
+                let (path, verified) = download_or_find_cached_file(
+                    &self.public_vocab_file_url(),
+                    Some(expected_hash),
+                )
+                .map_err(LoadError::DownloadOrLoadVocabFile)?;
+                load(&path, verified)?
             }
-            _ => {
-                #[cfg(not(target_arch = "wasm32"))]
-                {
-                    load_encoding_from_file(
-                        vocab_file_path,
-                        check_hash.then(|| self.expected_hash()),
-                        self.special_tokens().iter().cloned(),
-                        &self.pattern(),
-                    )
-                }
-                #[cfg(target_arch = "wasm32")]
-                {
-                    load_encoding_from_bytes(
-                        &vocab_bytes,
-                        None,
-                        self.special_tokens().iter().cloned(),
-                        &self.pattern(),
-                    )
+            result => result?,
+        };
+        // Either way, the vocab file has now been checked against `expected_hash`, which is
+        // what the snapshot key records.
+        if let Some(path) = &snapshot_path {
+            // Switch to the tables in the snapshot, so that this process shares them with every
+            // other process that loads the encoding instead of keeping a private copy.
+            if bpe.write_snapshot(path, &key).is_ok() {
+                if let Some(mapped) = load_cached_snapshot(path, &key) {
+                    return Ok(mapped);
                 }
             }
         }
+        Ok(bpe)
+    }
+
+    /// Write a snapshot of this encoding to `path`, for the `embedded-vocab` feature to compile
+    /// into the crate (see `build.rs`). Only this version of the crate can use the snapshot.
+    #[cfg(not(target_arch = "wasm32"))]
+    pub fn write_snapshot(&self, path: impl AsRef<Path>) -> Result<(), LoadError> {
+        let path = path.as_ref();
+        let key = self.snapshot_key(&self.all_special_tokens(), &self.pattern());
+        self.load()?
+            .write_snapshot(path, &key)
+            .map_err(|e| LoadError::WriteSnapshot(path.to_owned(), e))
     }
 
     #[cfg(target_arch = "wasm32")]
     pub async fn load(&self) -> Result<CoreBPE, LoadError> {
+        let special_tokens = self.all_special_tokens();
+        let pattern = self.pattern();
+        if let Some(bpe) = load_embedded(
+            EMBEDDED_SNAPSHOT,
+            &self.snapshot_key(&special_tokens, &pattern),
+        )? {
+            return Ok(bpe);
+        }
         let url = self.public_vocab_file_url();
         let vocab_bytes = download_or_find_cached_file_bytes(&url, Some(self.expected_hash()))
             .await
             .map_err(LoadError::DownloadOrLoadVocabFile)?;
-
-        match self {
-            Self::O200kHarmony => {
-                let mut specials: Vec<(String, Rank)> = self
-                    .special_tokens()
-                    .iter()
-                    .map(|(s, r)| ((*s).to_string(), *r))
-                    .collect();
-                specials.extend((200014..=201088).map(|id| (format!("<|reserved_{id}|>"), id)));
-                load_encoding_from_bytes(&vocab_bytes, None, specials, &self.pattern())
-            }
-            Self::O200kBase => {
-                let mut specials: Vec<(String, Rank)> = self
-                    .special_tokens()
-                    .iter()
-                    .map(|(s, r)| ((*s).to_string(), *r))
-                    .collect();
-                specials.extend((199998..=201088).map(|id| (format!("<|reserved_{id}|>"), id)));
-                load_encoding_from_bytes(&vocab_bytes, None, specials, &self.pattern())
-            }
-            _ => load_encoding_from_bytes(
-                &vocab_bytes,
-                None,
-                self.special_tokens().iter().cloned(),
-                &self.pattern(),
-            ),
-        }
+        load_encoding_from_bytes(&vocab_bytes, None, special_tokens, &pattern)
     }
 
     fn public_vocab_file_url(&self) -> String {
@@ -295,30 +303,39 @@ impl Encoding {
         }
     }
 
-    fn pattern(&self) -> String {
+    /// `special_tokens` plus the reserved tokens that fill the rest of the special range.
+    fn all_special_tokens(&self) -> Vec<(String, Rank)> {
+        let mut specials: Vec<(String, Rank)> = self
+            .special_tokens()
+            .iter()
+            .map(|(s, r)| ((*s).to_string(), *r))
+            .collect();
         match self {
-            Self::O200kBase => {
-                [
-                    "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?",
-                    "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?",
-                    "\\p{N}{1,3}",
-                    " ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*",
-                    "\\s*[\\r\\n]+",
-                    "\\s+(?!\\S)",
-                    "\\s+",
-                ].join("|")
-            }
             Self::O200kHarmony => {
-                [
-                    "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]*[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]+(?i:'s|'t|'re|'ve|'m|'ll|'d)?",
-                    "[^\\r\\n\\p{L}\\p{N}]?[\\p{Lu}\\p{Lt}\\p{Lm}\\p{Lo}\\p{M}]+[\\p{Ll}\\p{Lm}\\p{Lo}\\p{M}]*(?i:'s|'t|'re|'ve|'m|'ll|'d)?",
-                    "\\p{N}{1,3}",
-                    " ?[^\\s\\p{L}\\p{N}]+[\\r\\n/]*",
-                    "\\s*[\\r\\n]+",
-                    "\\s+(?!\\S)",
-                    "\\s+",
-                ].join("|")
+                specials.extend((200014..=201088).map(|id| (format!("<|reserved_{id}|>"), id)));
+            }
+            Self::O200kBase => {
+                specials.extend((199998..=201088).map(|id| (format!("<|reserved_{id}|>"), id)));
             }
+            Self::Cl100kBase => {}
+        }
+        specials
+    }
+
+    /// The key of snapshots of this encoding; see `snapshot_key`.
+    fn snapshot_key(&self, special_tokens: &[(String, Rank)], pattern: &str) -> SnapshotKey {
+        snapshot_key(
+            self.expected_hash(),
+            special_tokens
+                .iter()
+                .map(|(token, rank)| (token.as_str(), *rank)),
+            pattern,
+        )
+    }
+
+    fn pattern(&self) -> String {
+        match self {
+            Self::O200kBase | Self::O200kHarmony => o200k_pattern(),
             Self::Cl100kBase => {
                 "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}]?\\p{L}+|\\p{N}{1,3}| ?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|\\s+".to_string()
             }
@@ -326,6 +343,62 @@ impl Encoding {
     }
 }
 
+/// The encoder in `embedded`, the snapshot compiled into the crate, if it is the one with `key`.
+/// It needs no file, download or hash check, so it is tried before anything else.
+///
+/// A binary built with a snapshot may run where there is no vocab file, cache dir or network to
+/// fall back to, so a snapshot that cannot be used is an error rather than a reason to look
+/// elsewhere: one that holds this encoding but fails to load, or one that holds none of the
+/// predefined encodings, e.g. because another version of the crate wrote it. A snapshot of
+/// another predefined encoding is just not this one.
+fn load_embedded(
+    embedded: Option<&'static [u8]>,
+    key: &SnapshotKey,
+) -> Result<Option<CoreBPE>, LoadError> {
+    let Some(bytes) = embedded else {
+        return Ok(None);
+    };
+    let embedded_key = header_key(bytes);
+    if embedded_key != Some(key) {
+        let holds_predefined = embedded_key.is_some_and(|embedded_key| {
+            Encoding::all().iter().any(|encoding| {
+                encoding.snapshot_key(&encoding.all_special_tokens(), &encoding.pattern())
+                    == *embedded_key
+            })
+        });
+        if holds_predefined {
+            return Ok(None);
+        }
+        return Err(LoadError::EmbeddedSnapshot(std::io::Error::new(
+            std::io::ErrorKind::InvalidData,
+            "it holds none of the predefined encodings; write it again with this version of \
+             the crate",
+        )));
+    }
+    CoreBPE::load_static_snapshot(bytes, key)
+        .map(Some)
+        .map_err(LoadError::EmbeddedSnapshot)
+}
+
+/// The encoder in the cached snapshot at `path`, if there is one with `key` and intact data.
+///
+/// Like a vocab file, the snapshot is checked against a digest, the one its header records,
+/// unless its stamp (see `is_verified`) shows that it has not changed since it last was. So
+/// only the first load after the snapshot is written reads all of it.
+#[cfg(not(target_arch = "wasm32"))]
+fn load_cached_snapshot(path: &Path, key: &SnapshotKey) -> Option<CoreBPE> {
+    // Stamped before it is opened, like a vocab file, so that the stamp is never newer than
+    // what is checked.
+    let stamp = FileStamp::of(path).ok()?;
+    let snapshot = SnapshotReader::open(path, key).ok()?;
+    let digest = snapshot.digest();
+    if !is_verified(path, &digest) {
+        snapshot.check_digest().ok()?;
+        record_verified(path, &stamp, &digest);
+    }
+    CoreBPE::from_snapshot(snapshot).ok()
+}
+
 fn load_tiktoken_vocab<R>(
     mut reader: R,
     expected_hash: Option<&str>,
@@ -413,20 +486,22 @@ where
 
 /// This returns the path to a file containing the data at `url`. If the file is
 /// cached, it is used. Otherwise, the file is downloaded and cached.
+///
+/// Also returns whether the file is known to match `expected_hash`: a fresh download is
+/// checked as it is written, and a cached file is if its stamp (see `is_verified`) is
+/// current. Otherwise the caller must check the hash, e.g. while parsing the file.
 #[cfg(not(target_arch = "wasm32"))]
 fn download_or_find_cached_file(
     url: &str,
     expected_hash: Option<&str>,
-) -> Result<PathBuf, RemoteVocabFileError> {
+) -> Result<(PathBuf, bool), RemoteVocabFileError> {
     let cache_dir = resolve_cache_dir()?;
     let cache_path = resolve_cache_path(&cache_dir, url);
     if cache_path.exists() {
-        if verify_file_hash(&cache_path, expected_hash)? {
-            return Ok(cache_path);
-        }
-        let _ = std::fs::remove_file(&cache_path);
+        let verified = expected_hash.is_none_or(|hash| is_verified(&cache_path, hash));
+        return Ok((cache_path, verified));
     }
-    let hash = load_remote_file(url, &cache_path)?;
+    let (hash, stamp) = load_remote_file(url, &cache_path)?;
     if let Some(expected_hash) = expected_hash {
         if hash != expected_hash {
             let _ = std::fs::remove_file(&cache_path);
@@ -437,7 +512,10 @@ fn download_or_find_cached_file(
             });
         }
     }
-    Ok(cache_path)
+    if let Some(stamp) = stamp {
+        record_verified(&cache_path, &stamp, &hash);
+    }
+    Ok((cache_path, true))
 }
 
 #[cfg(target_arch = "wasm32")]
@@ -459,6 +537,54 @@ async fn download_or_find_cached_file_bytes(
     Ok(bytes)
 }
 
+/// An advisory lock on `<snapshot>.lock`, held until it is dropped, for building and writing the
+/// snapshot at that path. Like the snapshot, it is shared by every process that uses the cache
+/// dir. `None` where the lock cannot be taken, e.g. on platforms without `flock` or file systems
+/// that do not support it; each process then builds the encoder itself.
+#[cfg(not(target_arch = "wasm32"))]
+struct SnapshotLock {
+    // Closing the file releases the lock.
+    _file: File,
+}
+
+#[cfg(not(target_arch = "wasm32"))]
+impl SnapshotLock {
+    #[cfg(unix)]
+    fn acquire(snapshot_path: &Path) -> Option<Self> {
+        use std::os::unix::io::AsRawFd;
+
+        let mut name = snapshot_path.file_name().unwrap_or_default().to_owned();
+        name.push(".lock");
+        let file = File::options()
+            .create(true)
+            .truncate(false)
+            .write(true)
+            .open(snapshot_path.with_file_name(name))
+            .ok()?;
+        loop {
+            // SAFETY: `file` is an open file descriptor for the duration of the call.
+            if unsafe { libc::flock(file.as_raw_fd(), libc::LOCK_EX) } == 0 {
+                return Some(Self { _file: file });
+            }
+            if std::io::Error::last_os_error().kind() != std::io::ErrorKind::Interrupted {
+                return None;
+            }
+        }
+    }
+
+    #[cfg(not(unix))]
+    fn acquire(_snapshot_path: &Path) -> Option<Self> {
+        None
+    }
+}
+
+/// The directory that downloaded vocab files, encoder snapshots and their stamps are cached in.
+///
+/// A snapshot is only checked against the digest in its own header, which catches damaged and
+/// truncated files but not a forged one. So snapshots are only read from and written to a
+/// cache dir that `is_private_dir`; anywhere else, such as a default dir under a shared temp
+/// directory that another user created first, the encoder is built from the vocab file, which
+/// is checked against its pinned hash.
 fn resolve_cache_dir() -> Result<PathBuf, RemoteVocabFileError> {
     // we use a different env var and a different default dir name to avoid
     // conflicts with the python tiktoken package, while sharing a cache dir
@@ -478,6 +604,26 @@ fn resolve_cache_dir() -> Result<PathBuf, RemoteVocabFileError> {
     }
 }
 
+/// Whether `dir` belongs to the current user and no other user can write to it, so that nobody
+/// else can plant files in it.
+#[cfg(unix)]
+fn is_private_dir(dir: &Path) -> bool {
+    use std::os::unix::fs::MetadataExt;
+
+    // SAFETY: `geteuid` has no preconditions and cannot fail.
+    let uid = unsafe { libc::geteuid() };
+    std::fs::metadata(dir).is_ok_and(|metadata| {
+        metadata.is_dir() && metadata.uid() == uid && metadata.mode() & 0o022 == 0
+    })
+}
+
+/// Without Unix permissions to check, trust the directory: the default temp directory, and so
+/// the default cache dir, belongs to the current user on these platforms.
+#[cfg(not(unix))]
+fn is_private_dir(_dir: &Path) -> bool {
+    true
+}
+
 fn resolve_cache_path(cache_dir: &Path, url: &str) -> PathBuf {
     let mut hasher = Sha1::new();
     hasher.update(url.as_bytes());
@@ -485,28 +631,85 @@ fn resolve_cache_path(cache_dir: &Path, url: &str) -> PathBuf {
     cache_dir.join(cache_key)
 }
 
-fn verify_file_hash(
-    file_path: &Path,
-    expected_hash: Option<&str>,
-) -> Result<bool, RemoteVocabFileError> {
-    let Some(expected_hash) = expected_hash else {
-        return Ok(true);
+/// What identifies the contents of a file without reading it. It is recorded in a stamp next to
+/// a file whose hash has been verified, a vocab file or a snapshot, so that the file is only
+/// hashed again once it changes.
+#[derive(Debug, PartialEq, Eq)]
+struct FileStamp {
+    len: u64,
+    modified_ns: u128,
+    inode: u64,
+}
+
+impl FileStamp {
+    fn of(path: &Path) -> std::io::Result<Self> {
+        Self::from_metadata(&std::fs::metadata(path)?)
+    }
+
+    fn from_metadata(metadata: &std::fs::Metadata) -> std::io::Result<Self> {
+        let modified = metadata.modified()?;
+        #[cfg(unix)]
+        let inode = std::os::unix::fs::MetadataExt::ino(metadata);
+        #[cfg(not(unix))]
+        let inode = 0;
+        Ok(Self {
+            len: metadata.len(),
+            modified_ns: modified
+                .duration_since(std::time::UNIX_EPOCH)
+                .map_or(0, |since| since.as_nanos()),
+            inode,
+        })
+    }
+}
+
+fn stamp_path(file_path: &Path) -> PathBuf {
+    let mut name = file_path.file_name().unwrap_or_default().to_owned();
+    name.push(".verified");
+    file_path.with_file_name(name)
+}
+
+/// Whether `file_path` has been verified to have SHA-256 `expected_hash` and not changed since.
+/// Stamps are only trusted in a directory that `is_private_dir`, as anyone who can write to the
+/// directory could forge one for a file of their own.
+fn is_verified(file_path: &Path, expected_hash: &str) -> bool {
+    if !file_path.parent().is_some_and(is_private_dir) {
+        return false;
+    }
+    read_stamp(file_path).is_some_and(|(stamp, hash)| {
+        hash == expected_hash && FileStamp::of(file_path).is_ok_and(|current| current == stamp)
+    })
+}
+
+fn read_stamp(file_path: &Path) -> Option<(FileStamp, String)> {
+    let stamp = std::fs::read_to_string(stamp_path(file_path)).ok()?;
+    let mut fields = stamp.split_whitespace();
+    let recorded = FileStamp {
+        len: fields.next()?.parse().ok()?,
+        modified_ns: fields.next()?.parse().ok()?,
+        inode: fields.next()?.parse().ok()?,
     };
-    let file = File::open(file_path)
-        .map_err(|e| RemoteVocabFileError::IOError(format!("opening file {file_path:?}"), e))?;
-    let mut reader = BufReader::new(file);
-    let mut hasher = Sha256::new();
-    std::io::copy(&mut reader, &mut hasher).map_err(|e| {
-        RemoteVocabFileError::IOError(format!("copying file {file_path:?} contents to hasher"), e)
-    })?;
-    let computed_hash = format!("{:x}", hasher.finalize());
-    Ok(computed_hash == expected_hash)
+    Some((recorded, fields.next()?.to_owned()))
+}
+
+/// Record that `file_path`, as it was when `stamp` was taken, has SHA-256 `hash`. Failing to is
+/// harmless: the file is just hashed again next time.
+fn record_verified(file_path: &Path, stamp: &FileStamp, hash: &str) {
+    let _ = std::fs::write(
+        stamp_path(file_path),
+        format!(
+            "{} {} {} {hash}\n",
+            stamp.len, stamp.modified_ns, stamp.inode
+        ),
+    );
 }
 
 /// Loads a remote file to `destination` and returns the computed hash of the
-/// file contents.
+/// file contents, and the stamp of the file as written, if it can be taken.
 #[cfg(not(target_arch = "wasm32"))]
-fn load_remote_file(url: &str, destination: &Path) -> Result<String, RemoteVocabFileError> {
+fn load_remote_file(
+    url: &str,
+    destination: &Path,
+) -> Result<(String, Option<FileStamp>), RemoteVocabFileError> {
     let client = reqwest::blocking::Client::new();
     let mut response = client
         .get(url)
@@ -531,11 +734,22 @@ fn load_remote_file(url: &str, destination: &Path) -> Result<String, RemoteVocab
         })?;
         hasher.update(&buffer[..bytes_read]);
     }
-    Ok(format!("{:x}", hasher.finalize()))
+    // Stamp the file that was written, rather than whatever is at `destination` by now.
+    let file = dest.into_inner().map_err(|e| {
+        RemoteVocabFileError::IOError(format!("writing to file {destination:?}"), e.into_error())
+    })?;
+    let stamp = file
+        .metadata()
+        .and_then(|metadata| FileStamp::from_metadata(&metadata))
+        .ok();
+    Ok((format!("{:x}", hasher.finalize()), stamp))
 }
 
 #[cfg(target_arch = "wasm32")]
-fn load_remote_file(_url: &str, _destination: &Path) -> Result<String, RemoteVocabFileError> {
+fn load_remote_file(
+    _url: &str,
+    _destination: &Path,
+) -> Result<(String, Option<FileStamp>), RemoteVocabFileError> {
     Err(RemoteVocabFileError::FailedToDownloadOrLoadVocabFile(
         Box::new(std::io::Error::new(
             std::io::ErrorKind::Other,
@@ -572,4 +786,144 @@ mod tests {
             let _ = encoding.load().unwrap();
         }
     }
+
+    #[test]
+    fn test_verified_stamp() {
+        let dir = std::env::temp_dir().join(format!("harmony-stamp-test-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("vocab.tiktoken");
+        std::fs::write(&path, "YQ== 0\n").unwrap();
+        let hash = format!("{:x}", Sha256::digest("YQ== 0\n"));
+        assert!(!is_verified(&path, &hash));
+
+        record_verified(&path, &FileStamp::of(&path).unwrap(), &hash);
+        assert!(is_verified(&path, &hash));
+        assert!(!is_verified(&path, "0000"));
+        #[cfg(unix)]
+        {
+            use std::os::unix::fs::PermissionsExt;
+
+            // Nor is a stamp in a directory that others can write to.
+            std::fs::set_permissions(&dir, std::fs::Permissions::from_mode(0o777)).unwrap();
+            assert!(!is_verified(&path, &hash));
+            std::fs::set_permissions(&dir, std::fs::Permissions::from_mode(0o755)).unwrap();
+            assert!(is_verified(&path, &hash));
+        }
+
+        // Any change to the file invalidates the stamp, even one made after the stamp was taken
+        // but before it was recorded.
+        let stamp = FileStamp::of(&path).unwrap();
+        std::fs::write(&path, "YQ== 0\nYg== 1\n").unwrap();
+        assert!(!is_verified(&path, &hash));
+        record_verified(&path, &stamp, &hash);
+        assert!(!is_verified(&path, &hash));
+        std::fs::write(stamp_path(&path), "garbage").unwrap();
+        assert!(!is_verified(&path, &hash));
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_cached_snapshot_digest() {
+        let dir =
+            std::env::temp_dir().join(format!("harmony-snapshot-stamp-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("snapshot");
+        let bpe = CoreBPE::new((0..=255u8).map(|byte| (vec![byte], byte as Rank)), [], "").unwrap();
+        let key = snapshot_key("vocab", [], "");
+        bpe.write_snapshot(&path, &key).unwrap();
+
+        // The first load checks the digest and stamps the snapshot; later ones trust the stamp.
+        assert!(load_cached_snapshot(&path, &key).is_some());
+        let digest = SnapshotReader::open(&path, &key).unwrap().digest();
+        assert!(is_verified(&path, &digest));
+        assert!(load_cached_snapshot(&path, &key).is_some());
+
+        // A damaged snapshot no longer matches its stamp, so its digest is checked again.
+        let mut bytes = std::fs::read(&path).unwrap();
+        *bytes.last_mut().unwrap() ^= 1;
+        let damaged = dir.join("damaged");
+        std::fs::write(&damaged, &bytes).unwrap();
+        std::fs::copy(stamp_path(&path), stamp_path(&damaged)).unwrap();
+        assert!(load_cached_snapshot(&damaged, &key).is_none());
+        assert!(!is_verified(&damaged, &digest));
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_embedded_snapshot() {
+        let dir = std::env::temp_dir().join(format!("harmony-embedded-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("snapshot");
+        let bpe = CoreBPE::new((0..=255u8).map(|byte| (vec![byte], byte as Rank)), [], "").unwrap();
+        // Stands in for a snapshot compiled into the binary, which is 8-byte aligned.
+        let embed = |key: &SnapshotKey| -> &'static [u8] {
+            bpe.write_snapshot(&path, key).unwrap();
+            let bytes = std::fs::read(&path).unwrap();
+            let words = vec![0u64; bytes.len().div_ceil(8)].leak();
+            // SAFETY: the leaked words are `8 * words.len()` initialised bytes that live forever.
+            let buffer = unsafe {
+                std::slice::from_raw_parts_mut(words.as_mut_ptr() as *mut u8, 8 * words.len())
+            };
+            buffer[..bytes.len()].copy_from_slice(&bytes);
+            &buffer[..bytes.len()]
+        };
+        let key_of = |encoding: Encoding| {
+            encoding.snapshot_key(&encoding.all_special_tokens(), &encoding.pattern())
+        };
+        let (base, harmony) = (key_of(Encoding::O200kBase), key_of(Encoding::O200kHarmony));
+
+        assert!(load_embedded(None, &base).unwrap().is_none());
+        let embedded = embed(&base);
+        assert!(load_embedded(Some(embedded), &base).unwrap().is_some());
+        // A snapshot of another encoding is left alone.
+        assert!(load_embedded(Some(embedded), &harmony).unwrap().is_none());
+        // One of this encoding that cannot be loaded is an error, not a reason to look elsewhere.
+        let truncated = &embedded[..embedded.len() - 8];
+        assert!(load_embedded(Some(truncated), &base).is_err());
+        // So is one of no predefined encoding, e.g. one written by another version of the crate.
+        let stale = embed(&snapshot_key("vocab", [], ""));
+        assert!(load_embedded(Some(stale), &base).is_err());
+        assert!(load_embedded(Some(&stale[..8]), &base).is_err());
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_private_dir() {
+        use std::os::unix::fs::PermissionsExt;
+
+        let dir = std::env::temp_dir().join(format!("harmony-private-test-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        std::fs::set_permissions(&dir, std::fs::Permissions::from_mode(0o700)).unwrap();
+        assert!(is_private_dir(&dir));
+        for shared in [0o770, 0o777, 0o1777] {
+            std::fs::set_permissions(&dir, std::fs::Permissions::from_mode(shared)).unwrap();
+            assert!(!is_private_dir(&dir));
+        }
+        assert!(!is_private_dir(&dir.join("missing")));
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_snapshot_lock() {
+        use std::sync::atomic::{AtomicUsize, Ordering};
+
+        let dir = std::env::temp_dir().join(format!("harmony-lock-test-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("snapshot");
+        // Every thread opens the lock file itself, like another process would.
+        let holders = AtomicUsize::new(0);
+        std::thread::scope(|scope| {
+            for _ in 0..4 {
+                scope.spawn(|| {
+                    let _lock = SnapshotLock::acquire(&path).unwrap();
+                    assert_eq!(holders.fetch_add(1, Ordering::SeqCst), 0);
+                    std::thread::sleep(std::time::Duration::from_millis(10));
+                    holders.fetch_sub(1, Ordering::SeqCst);
+                });
+            }
+        });
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
 }
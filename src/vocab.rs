@@ -0,0 +1,250 @@
+//! The token table of a `CoreBPE`.
+//!
+//! The bytes of every token, ordinary and special, are stored back to back in one buffer and
+//! indexed by rank, so decoding a token is two loads and a copy. Ordinary tokens are also
+//! found by their bytes through an open-addressing hash index into that buffer. The index
+//! replaces a `HashMap<Vec<u8>, Rank>` with one allocation per token: it is a fraction of the
+//! size, and a lookup touches one slot and the token's bytes.
+//!
+//! The vocabulary is plain arrays and the hash function is fixed rather than seeded, so the
+//! arrays can be stored and loaded again without rehashing.
+
+use rustc_hash::FxHashMap as HashMap;
+
+use crate::snapshot::{SnapshotReader, SnapshotWriter};
+use crate::table::{Buffer, Pod, Table};
+use crate::tiktoken::Rank;
+
+/// Ranks must be below this, as the tables have a slot for every rank up to the largest.
+/// Vocabularies number their tokens densely from zero, so this only rules out nonsense.
+const MAX_RANKS: Rank = 1 << 24;
+
+// Marks an empty slot of the index; tokens are never empty.
+const EMPTY: Slot = Slot(0);
+
+#[derive(Clone)]
+pub(crate) struct Vocab {
+    bytes: Table<u8>,
+    // Token `rank` is `bytes[offsets[rank]..offsets[rank + 1]]`. Tokens are never empty, so an
+    // empty range means that there is no token with that rank.
+    offsets: Table<u32>,
+    // The ordinary tokens. A token is in the first empty-or-matching slot at or after
+    // `hash(bytes) >> index_shift`, wrapping around.
+    index: Table<Slot>,
+    index_shift: u32,
+}
+
+impl Vocab {
+    pub(crate) fn new(
+        encoder: &HashMap<Vec<u8>, Rank>,
+        special_tokens_encoder: &HashMap<String, Rank>,
+    ) -> Result<Self, &'static str> {
+        let tokens = encoder
+            .iter()
+            .map(|(bytes, &rank)| (bytes.as_slice(), rank));
+        let special_tokens = special_tokens_encoder
+            .iter()
+            .map(|(token, &rank)| (token.as_bytes(), rank));
+        let max_rank = tokens
+            .clone()
+            .chain(special_tokens.clone())
+            .map(|(_, rank)| rank)
+            .max();
+        if max_rank.is_some_and(|rank| rank >= MAX_RANKS) {
+            return Err("Token ranks must be below 2^24");
+        }
+
+        let mut lens = vec![0u32; max_rank.map_or(0, |rank| rank as usize + 1)];
+        for (bytes, rank) in tokens.clone() {
+            if bytes.is_empty() {
+                return Err("Tokens must not be empty");
+            }
+            if lens[rank as usize] != 0 {
+                return Err("Encoder has duplicate token indices");
+            }
+            lens[rank as usize] = bytes.len() as u32;
+        }
+        for (bytes, rank) in special_tokens.clone() {
+            if bytes.is_empty() {
+                return Err("Special tokens must not be empty");
+            }
+            if lens[rank as usize] != 0 {
+                return Err("Special token ranks must not be shared with other tokens");
+            }
+            lens[rank as usize] = bytes.len() as u32;
+        }
+
+        let mut offsets = Vec::with_capacity(lens.len() + 1);
+        let mut total = 0u32;
+        offsets.push(0);
+        for len in lens {
+            total = total.checked_add(len).ok_or("Tokens must fit in 4 GiB")?;
+            offsets.push(total);
+        }
+        let mut bytes = vec![0u8; total as usize];
+        for (token, rank) in tokens.clone().chain(special_tokens) {
+            let start = offsets[rank as usize] as usize;
+            bytes[start..start + token.len()].copy_from_slice(token);
+        }
+
+        // At most four fifths of the slots are used. Probes walk forward and a cache line holds
+        // eight slots, so the longer probe sequences of a fuller table cost little.
+        let slots = (encoder.len() + encoder.len() / 4)
+            .next_power_of_two()
+            .max(2);
+        let index_shift = 64 - slots.trailing_zeros();
+        let mut index = vec![EMPTY; slots];
+        for (token, rank) in tokens {
+            let mut slot = (hash(token) >> index_shift) as usize;
+            while index[slot] != EMPTY {
+                slot = (slot + 1) & (slots - 1);
+            }
+            index[slot] = Slot::new(offsets[rank as usize], token.len(), rank);
+        }
+        Ok(Self {
+            bytes: bytes.into(),
+            offsets: offsets.into(),
+            index: index.into(),
+            index_shift,
+        })
+    }
+
+    pub(crate) fn write_snapshot(&self, snapshot: &mut SnapshotWriter) {
+        snapshot.table(&self.bytes);
+        snapshot.table(&self.offsets);
+        snapshot.table(&self.index);
+        snapshot.scalar(self.index_shift as u64);
+    }
+
+    pub(crate) fn read_snapshot(
+        snapshot: &mut SnapshotReader<impl Buffer>,
+    ) -> std::io::Result<Self> {
+        let vocab = Self {
+            bytes: snapshot.table()?,
+            offsets: snapshot.table()?,
+            index: snapshot.table()?,
+            index_shift: snapshot.scalar()? as u32,
+        };
+        // Check what lookups rely on beyond their bounds checks, so that a damaged snapshot is
+        // rejected here rather than found out by a panic or a probe that never ends.
+        let slots = vocab.index.len();
+        let offsets_valid = vocab.offsets.first() == Some(&0)
+            && vocab.offsets.windows(2).all(|pair| pair[0] <= pair[1])
+            && vocab.offsets.last().map(|&end| end as usize) == Some(vocab.bytes.len());
+        let index_valid = slots.is_power_of_two()
+            && slots >= 2
+            && vocab.index_shift == 64 - slots.trailing_zeros()
+            && vocab.index.contains(&EMPTY)
+            && vocab
+                .index
+                .iter()
+                .all(|&entry| entry == EMPTY || vocab.token_bytes(entry.rank()).is_some());
+        if !offsets_valid || !index_valid {
+            return Err(std::io::Error::new(
+                std::io::ErrorKind::InvalidData,
+                "invalid snapshot: inconsistent vocabulary",
+            ));
+        }
+        Ok(vocab)
+    }
+
+    /// The bytes of the token `rank`, which may be a special token.
+    #[inline]
+    pub(crate) fn token_bytes(&self, rank: Rank) -> Option<&[u8]> {
+        let rank = rank as usize;
+        let (&start, &end) = (self.offsets.get(rank)?, self.offsets.get(rank + 1)?);
+        (start != end).then(|| &self.bytes[start as usize..end as usize])
+    }
+
+    /// The rank of the ordinary token `bytes`. Special tokens are not found.
+    #[inline]
+    pub(crate) fn rank(&self, bytes: &[u8]) -> Option<Rank> {
+        let mask = self.index.len() - 1;
+        let mut slot = self.home_slot(bytes);
+        loop {
+            let entry = self.index[slot];
+            if entry == EMPTY {
+                return None;
+            }
+            if entry.may_have_len(bytes.len()) {
+                let start = entry.start();
+                let found = self.bytes.get(start..start + bytes.len()) == Some(bytes);
+                // Lengths of 255 bytes and more are saturated in the slot.
+                if found && (bytes.len() < 255 || self.token_len(entry.rank()) == bytes.len()) {
+                    return Some(entry.rank());
+                }
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    /// The ordinary tokens and their ranks, in no particular order.
+    pub(crate) fn ordinary_tokens(&self) -> impl Iterator<Item = (&[u8], Rank)> + '_ {
+        self.index
+            .iter()
+            .filter(|&&entry| entry != EMPTY)
+            .map(|entry| (self.token_bytes(entry.rank()).unwrap(), entry.rank()))
+    }
+
+    fn token_len(&self, rank: Rank) -> usize {
+        (self.offsets[rank as usize + 1] - self.offsets[rank as usize]) as usize
+    }
+
+    /// The first slot to probe for `bytes`.
+    #[inline]
+    fn home_slot(&self, bytes: &[u8]) -> usize {
+        // The high bits of the hash are the well mixed ones.
+        (hash(bytes) >> self.index_shift) as usize
+    }
+}
+
+/// A slot of the index: the offset of the token's bytes, its length (saturated at 255) and its
+/// rank, packed into 64 bits. Probes compare the bytes without first loading the token's
+/// offsets, and the length rules out most of the tokens that do not match.
+#[derive(Clone, Copy, PartialEq, Eq)]
+#[repr(transparent)]
+struct Slot(u64);
+
+// SAFETY: a `u64`.
+unsafe impl Pod for Slot {}
+
+impl Slot {
+    fn new(start: u32, len: usize, rank: Rank) -> Self {
+        Self((start as u64) << 32 | (len.min(255) as u64) << 24 | rank as u64)
+    }
+
+    #[inline]
+    fn start(self) -> usize {
+        (self.0 >> 32) as usize
+    }
+
+    #[inline]
+    fn rank(self) -> Rank {
+        self.0 as Rank & (MAX_RANKS - 1)
+    }
+
+    #[inline]
+    fn may_have_len(self, len: usize) -> bool {
+        (self.0 >> 24) as u8 as usize == len.min(255)
+    }
+}
+
+/// An FxHash-style hash over 8 bytes at a time. It is part of the layout of the index, so it
+/// must not change, or depend on the platform or the process.
+#[inline]
+fn hash(bytes: &[u8]) -> u64 {
+    const SEED: u64 = 0x51_7c_c1_b7_27_22_0a_95;
+    let mut hash = bytes.len() as u64;
+    let mut add = |word: u64| hash = (hash.rotate_left(5) ^ word).wrapping_mul(SEED);
+    let mut words = bytes.chunks_exact(8);
+    for word in &mut words {
+        add(u64::from_le_bytes(word.try_into().unwrap()));
+    }
+    let rest = words.remainder();
+    if !rest.is_empty() {
+        let mut word = [0u8; 8];
+        word[..rest.len()].copy_from_slice(rest);
+        add(u64::from_le_bytes(word));
+    }
+    hash
+}
@@ -2,11 +2,13 @@ use wasm_bindgen::prelude::*;
 
 use crate::{
     chat::{Message, Role, ToolNamespaceConfig},
-    encoding::{HarmonyEncoding, ParseOptions, StreamableParser},
-    load_harmony_encoding as inner_load_harmony_encoding, HarmonyEncodingName,
+    encoding::{HarmonyEncoding, ParseOptions, ParserCheckpoint, ParserEvent, StreamableParser},
+    load_harmony_encoding as inner_load_harmony_encoding,
+    tiktoken::SpecialPolicyCache,
+    HarmonyEncodingName,
 };
 
-use serde::Deserialize;
+use serde::{Deserialize, Serialize};
 
 #[wasm_bindgen]
 extern "C" {
@@ -21,6 +23,15 @@ extern "C" {
 
     #[wasm_bindgen(typescript_type = "RenderOptions")]
     pub type JsRenderOptions;
+
+    #[wasm_bindgen(typescript_type = "ProcessSummary")]
+    pub type JsProcessSummary;
+
+    #[wasm_bindgen(typescript_type = "ParserEvent[]")]
+    pub type JsParserEvents;
+
+    #[wasm_bindgen(typescript_type = "number[][]")]
+    pub type JsTokenBatch;
 }
 
 #[wasm_bindgen(typescript_custom_section)]
@@ -51,6 +62,24 @@ export interface RenderConversationConfig {
   auto_drop_analysis?: boolean;
 }
 
+export interface StateTransition {
+  token_index: number;
+  delta_offset: number;
+  state: 'ExpectStart' | 'Header' | 'Content';
+}
+
+export interface ProcessSummary {
+  content_delta: string;
+  state_transitions: StateTransition[];
+  messages_completed: number;
+}
+
+export type ParserEvent =
+  | { type: 'MessageStart'; role: Author['role']; name?: string }
+  | { type: 'HeaderComplete'; channel?: string; recipient?: string; content_type?: string }
+  | { type: 'ContentDelta'; text: string }
+  | { type: 'MessageEnd' };
+
 export interface ToolNamespaceConfig {
   name: string;
   description?: string;
@@ -58,9 +87,69 @@ export interface ToolNamespaceConfig {
 }
 "#;
 
+/// Owned copy of a [`ParserEvent`] in the shape of the `ParserEvent` TS type.
+#[derive(Serialize)]
+#[serde(tag = "type")]
+enum JsEvent {
+    MessageStart {
+        role: Role,
+        #[serde(skip_serializing_if = "Option::is_none")]
+        name: Option<String>,
+    },
+    HeaderComplete {
+        #[serde(skip_serializing_if = "Option::is_none")]
+        channel: Option<String>,
+        #[serde(skip_serializing_if = "Option::is_none")]
+        recipient: Option<String>,
+        #[serde(skip_serializing_if = "Option::is_none")]
+        content_type: Option<String>,
+    },
+    ContentDelta {
+        text: String,
+    },
+    MessageEnd,
+}
+
+impl From<ParserEvent<'_>> for JsEvent {
+    fn from(event: ParserEvent<'_>) -> Self {
+        match event {
+            ParserEvent::MessageStart { role, name } => JsEvent::MessageStart {
+                role,
+                name: name.map(str::to_owned),
+            },
+            ParserEvent::HeaderComplete {
+                channel,
+                recipient,
+                content_type,
+            } => JsEvent::HeaderComplete {
+                channel: channel.map(str::to_owned),
+                recipient: recipient.map(str::to_owned),
+                content_type: content_type.map(str::to_owned),
+            },
+            ParserEvent::ContentDelta(text) => JsEvent::ContentDelta {
+                text: text.to_owned(),
+            },
+            ParserEvent::MessageEnd => JsEvent::MessageEnd,
+        }
+    }
+}
+
+fn token_batch_to_js(batch: &[Vec<u32>]) -> Result<JsTokenBatch, JsValue> {
+    serde_wasm_bindgen::to_value(batch)
+        .map(JsValue::unchecked_into)
+        .map_err(|e| JsValue::from_str(&e.to_string()))
+}
+
+fn events_to_js(events: &[JsEvent]) -> Result<JsParserEvents, JsValue> {
+    serde_wasm_bindgen::to_value(events)
+        .map(JsValue::unchecked_into)
+        .map_err(|e| JsValue::from_str(&e.to_string()))
+}
+
 #[wasm_bindgen]
 pub struct JsHarmonyEncoding {
     inner: HarmonyEncoding,
+    policies: SpecialPolicyCache,
 }
 
 #[wasm_bindgen]
@@ -212,9 +301,36 @@ impl JsHarmonyEncoding {
                 serde_wasm_bindgen::from_value(allowed_special)
                     .map_err(|e| JsValue::from_str(&format!("invalid allowed_special: {e}")))?
             };
-        let allowed_set: std::collections::HashSet<&str> =
-            allowed_vec.iter().map(|s| s.as_str()).collect();
-        Ok(self.inner.tokenizer().encode(text, &allowed_set).0)
+        let tokenizer = self.inner.tokenizer();
+        let policy = self
+            .policies
+            .get(tokenizer, allowed_vec.iter().map(String::as_str));
+        Ok(tokenizer.encode_with_policy(text, &policy).0)
+    }
+
+    #[wasm_bindgen(js_name = encodeBatch)]
+    pub fn encode_batch(
+        &self,
+        texts: Vec<String>,
+        allowed_special: JsValue,
+    ) -> Result<JsTokenBatch, JsValue> {
+        let allowed_vec: Vec<String> =
+            if allowed_special.is_undefined() || allowed_special.is_null() {
+                Vec::new()
+            } else {
+                serde_wasm_bindgen::from_value(allowed_special)
+                    .map_err(|e| JsValue::from_str(&format!("invalid allowed_special: {e}")))?
+            };
+        let policy = self.policies.get(
+            self.inner.tokenizer(),
+            allowed_vec.iter().map(String::as_str),
+        );
+        token_batch_to_js(&self.inner.encode_batch(&texts, &policy))
+    }
+
+    #[wasm_bindgen(js_name = encodeOrdinaryBatch)]
+    pub fn encode_ordinary_batch(&self, texts: Vec<String>) -> Result<JsTokenBatch, JsValue> {
+        token_batch_to_js(&self.inner.encode_ordinary_batch(&texts))
     }
 
     #[wasm_bindgen(js_name = specialTokens)]
@@ -280,13 +396,58 @@ impl JsStreamableParser {
             .map_err(|e| JsValue::from_str(&e.to_string()))
     }
 
-    #[wasm_bindgen(getter, js_name = currentContent)]
-    pub fn current_content(&self) -> Result<String, JsValue> {
+    #[wasm_bindgen(js_name = processMany)]
+    pub fn process_many(&mut self, tokens: &[u32]) -> Result<JsProcessSummary, JsValue> {
+        let summary = self
+            .inner
+            .process_many(tokens)
+            .map_err(|e| JsValue::from_str(&e.to_string()))?;
+        serde_wasm_bindgen::to_value(&summary)
+            .map(JsValue::unchecked_into)
+            .map_err(|e| JsValue::from_str(&e.to_string()))
+    }
+
+    #[wasm_bindgen(js_name = processEvents)]
+    pub fn process_events(&mut self, tokens: &[u32]) -> Result<JsParserEvents, JsValue> {
+        let mut events = Vec::new();
         self.inner
-            .current_content()
+            .process_many_with_events(tokens, |event| events.push(JsEvent::from(event)))
+            .map_err(|e| JsValue::from_str(&e.to_string()))?;
+        events_to_js(&events)
+    }
+
+    #[wasm_bindgen(js_name = processEosEvents)]
+    pub fn process_eos_events(&mut self) -> Result<JsParserEvents, JsValue> {
+        let mut events = Vec::new();
+        self.inner
+            .process_eos_with_events(|event| events.push(JsEvent::from(event)))
+            .map_err(|e| JsValue::from_str(&e.to_string()))?;
+        events_to_js(&events)
+    }
+
+    pub fn fork(&mut self) -> JsStreamableParser {
+        JsStreamableParser {
+            inner: self.inner.fork(),
+        }
+    }
+
+    pub fn checkpoint(&self) -> JsParserCheckpoint {
+        JsParserCheckpoint {
+            inner: self.inner.checkpoint(),
+        }
+    }
+
+    pub fn rollback(&mut self, checkpoint: &JsParserCheckpoint) -> Result<(), JsValue> {
+        self.inner
+            .rollback(&checkpoint.inner)
             .map_err(|e| JsValue::from_str(&e.to_string()))
     }
 
+    #[wasm_bindgen(getter, js_name = currentContent)]
+    pub fn current_content(&self) -> String {
+        self.inner.current_content_str().to_owned()
+    }
+
     #[wasm_bindgen(getter, js_name = currentRole)]
     pub fn current_role(&self) -> String {
         self.inner
@@ -301,17 +462,16 @@ impl JsStreamableParser {
     }
 
     #[wasm_bindgen(getter, js_name = lastContentDelta)]
-    pub fn last_content_delta(&self) -> Result<String, JsValue> {
-        match self.inner.last_content_delta() {
-            Ok(Some(s)) => Ok(s),
-            Ok(None) => Ok(String::new()),
-            Err(e) => Err(JsValue::from_str(&e.to_string())),
-        }
+    pub fn last_content_delta(&self) -> String {
+        self.inner
+            .last_content_delta_str()
+            .unwrap_or_default()
+            .to_owned()
     }
 
     #[wasm_bindgen(getter)]
     pub fn messages(&self) -> Result<String, JsValue> {
-        serde_json::to_string(self.inner.messages())
+        serde_json::to_string(&self.inner.messages())
             .map_err(|e| JsValue::from_str(&format!("failed to serialise messages to JSON: {e}")))
     }
 
@@ -338,6 +498,11 @@ impl JsStreamableParser {
     }
 }
 
+#[wasm_bindgen]
+pub struct JsParserCheckpoint {
+    inner: ParserCheckpoint,
+}
+
 #[wasm_bindgen]
 pub enum StreamState {
     ExpectStart,
@@ -358,7 +523,10 @@ pub async fn load_harmony_encoding(
         .map_err(|e| JsValue::from_str(&e.to_string()))?;
     let encoding =
         inner_load_harmony_encoding(parsed).map_err(|e| JsValue::from_str(&e.to_string()))?;
-    Ok(JsHarmonyEncoding { inner: encoding })
+    Ok(JsHarmonyEncoding {
+        inner: encoding,
+        policies: SpecialPolicyCache::default(),
+    })
 }
 
 #[wasm_bindgen]
@@ -9,6 +9,7 @@ to the canonical Rust implementation.
 
 from __future__ import annotations
 
+import os
 import sys
 from pathlib import Path
 from typing import List
@@ -23,18 +24,24 @@ if str(ROOT_DIR) not in sys.path:
 import pytest  # noqa: E402
 from openai_harmony import (  # noqa: E402
     Author,
+    ContentDelta,
     Conversation,
     DeveloperContent,
     HarmonyEncodingName,
     HarmonyError,
+    HeaderComplete,
     Message,
+    MessageEnd,
+    MessageStart,
     ReasoningEffort,
     RenderConversationConfig,
     Role,
     StreamableParser,
+    StreamState,
     SystemContent,
     ToolDescription,
     load_harmony_encoding,
+    warm_up,
 )
 from pydantic import ValidationError
 
@@ -882,6 +889,21 @@ def test_encode_allowed_special():
     assert encoding.encode("<|start|>", allowed_special={"<|start|>"}) == [200006]
     assert encoding.encode("<|start|>", allowed_special="all") == [200006]
 
+    # The allowed set may change from call to call.
+    text = "<|start|><|message|>"
+    start_only = encoding.encode(
+        text, allowed_special={"<|start|>"}, disallowed_special=()
+    )
+    assert start_only[0] == 200006 and 200008 not in start_only
+    message_only = encoding.encode(
+        text, allowed_special={"<|message|>"}, disallowed_special=()
+    )
+    assert message_only[-1] == 200008 and 200006 not in message_only
+    assert (
+        encoding.encode(text, allowed_special={"<|start|>"}, disallowed_special=())
+        == start_only
+    )
+
     with pytest.raises(
         HarmonyError, match="Encountered text corresponding to disallowed special token"
     ):
@@ -896,6 +918,55 @@ def test_encode_allowed_special():
     ]
 
 
+def test_encode_batch():
+    encoding = load_harmony_encoding(HarmonyEncodingName.HARMONY_GPT_OSS)
+    texts = ["hello world", "<|start|>", "", "many more words " * 100]
+
+    assert encoding.encode_batch(texts, allowed_special="all") == [
+        encoding.encode(text, allowed_special="all") for text in texts
+    ]
+    assert encoding.encode_ordinary_batch(texts) == [
+        encoding.encode(text, disallowed_special=()) for text in texts
+    ]
+
+    with pytest.raises(
+        HarmonyError, match="Encountered text corresponding to disallowed special token"
+    ):
+        encoding.encode_batch(texts)
+
+
+@pytest.mark.skipif(not hasattr(os, "fork"), reason="requires os.fork")
+def test_encoding_works_after_fork():
+    encoding = load_harmony_encoding(HarmonyEncodingName.HARMONY_GPT_OSS)
+    text = "<|start|>user<|message|>hello world<|end|>"
+    expected = encoding.encode(text, allowed_special="all")
+    # Start the batch worker pool before forking; the child must not use it.
+    assert encoding.encode_batch([text] * 8, allowed_special="all") == [expected] * 8
+
+    pid = os.fork()
+    if pid == 0:
+        # Child: exit with the outcome instead of returning into pytest.
+        ok = encoding.encode(text, allowed_special="all") == expected and (
+            load_harmony_encoding(HarmonyEncodingName.HARMONY_GPT_OSS).encode_batch(
+                [text] * 8, allowed_special="all"
+            )
+            == [expected] * 8
+        )
+        os._exit(0 if ok else 1)
+    _, status = os.waitpid(pid, 0)
+    assert os.WIFEXITED(status) and os.WEXITSTATUS(status) == 0
+
+
+def test_load_harmony_encoding_is_shared():
+    warm_up()
+    first = load_harmony_encoding(HarmonyEncodingName.HARMONY_GPT_OSS)
+    second = load_harmony_encoding("HarmonyGptOss")
+    text = "<|start|>user<|message|>hello world<|end|>"
+    assert first.encode(text, allowed_special="all") == second.encode(
+        text, allowed_special="all"
+    )
+
+
 def test_is_special_token():
     encoding = load_harmony_encoding(HarmonyEncodingName.HARMONY_GPT_OSS)
 
@@ -958,6 +1029,124 @@ def test_streamable_parser():
     assert len(parser.messages) == 3
 
 
+def test_streamable_parser_process_many():
+    encoding = load_harmony_encoding(HarmonyEncodingName.HARMONY_GPT_OSS)
+
+    text = (
+        "<|start|>assistant<|channel|>analysis<|message|>Thinking 🤔<|end|>"
+        "<|start|>assistant<|channel|>final<|message|>Done"
+    )
+    tokens = encoding.encode(text, allowed_special="all")
+
+    one_by_one = StreamableParser(encoding, None)
+    for token in tokens:
+        one_by_one.process(token)
+
+    parser = StreamableParser(encoding, None)
+    summary = parser.process_many(tokens)
+
+    assert summary.content_delta == "Thinking 🤔Done"
+    assert summary.messages_completed == 1
+    assert [t.state for t in summary.state_transitions] == [
+        StreamState.HEADER,
+        StreamState.CONTENT,
+        StreamState.EXPECT_START,
+        StreamState.HEADER,
+        StreamState.CONTENT,
+    ]
+    assert summary.state_transitions[2].delta_offset == len("Thinking 🤔".encode())
+    assert parser.messages == one_by_one.messages
+    assert parser.current_content == one_by_one.current_content == "Done"
+    assert parser.tokens == tokens
+
+
+def test_streamable_parser_fork():
+    encoding = load_harmony_encoding(HarmonyEncodingName.HARMONY_GPT_OSS)
+
+    prefix = encoding.encode(
+        "<|start|>assistant<|channel|>analysis<|message|>Hmm.<|end|>"
+        "<|start|>assistant<|channel|>final<|message|>It is",
+        allowed_special="all",
+    )
+    parser = StreamableParser(encoding, None)
+    for token in prefix:
+        parser.process(token)
+
+    forked = parser.fork()
+    for token in encoding.encode(" yes<|return|>", allowed_special="all"):
+        parser.process(token)
+    for token in encoding.encode(" no<|return|>", allowed_special="all"):
+        forked.process(token)
+
+    assert parser.messages[0] == forked.messages[0]
+    assert parser.messages[1].content[0].text == "It is yes"
+    assert forked.messages[1].content[0].text == "It is no"
+    assert forked.tokens[: len(prefix)] == prefix
+
+
+def test_streamable_parser_rollback():
+    encoding = load_harmony_encoding(HarmonyEncodingName.HARMONY_GPT_OSS)
+
+    accepted = encoding.encode(
+        "<|start|>assistant<|channel|>final<|message|>Hello", allowed_special="all"
+    )
+    rejected = encoding.encode(" wrong guess<|end|><|start|>user", allowed_special="all")
+    rest = encoding.encode(" world<|return|>", allowed_special="all")
+
+    parser = StreamableParser(encoding, None)
+    for token in accepted:
+        parser.process(token)
+    checkpoint = parser.checkpoint()
+    for token in rejected:
+        parser.process(token)
+    assert len(parser.messages) == 1
+
+    parser.rollback(checkpoint)
+    assert parser.tokens == accepted
+    assert parser.messages == []
+    assert parser.current_content == "Hello"
+    assert parser.state == StreamState.CONTENT
+
+    for token in rest:
+        parser.process(token)
+    assert parser.messages == [
+        Message.from_role_and_content(Role.ASSISTANT, "Hello world").with_channel(
+            "final"
+        )
+    ]
+
+
+def test_streamable_parser_events():
+    encoding = load_harmony_encoding(HarmonyEncodingName.HARMONY_GPT_OSS)
+
+    tokens = encoding.encode(
+        "<|start|>assistant<|channel|>analysis<|message|>Hi<|end|>"
+        "<|start|>assistant to=functions.lookup<|channel|>commentary"
+        ' <|constrain|>json<|message|>{"q": 1}<|call|>',
+        allowed_special="all",
+    )
+    parser = StreamableParser(encoding, None)
+    events = parser.process_events(tokens[:-1])
+    events += parser.process_events(tokens[-1])
+    events += parser.process_eos_events()
+
+    deltas = "".join(e.text for e in events if isinstance(e, ContentDelta))
+    assert deltas == 'Hi{"q": 1}'
+    assert [e for e in events if not isinstance(e, ContentDelta)] == [
+        MessageStart(Role.ASSISTANT),
+        HeaderComplete(channel="analysis"),
+        MessageEnd(),
+        MessageStart(Role.ASSISTANT),
+        HeaderComplete(
+            channel="commentary",
+            recipient="functions.lookup",
+            content_type="<|constrain|>json",
+        ),
+        MessageEnd(),
+    ]
+    assert len(parser.messages) == 2
+
+
 def test_streamable_parser_tool_call_with_constrain_adjacent():
     encoding = load_harmony_encoding(HarmonyEncodingName.HARMONY_GPT_OSS)
 